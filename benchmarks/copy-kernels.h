@@ -0,0 +1,419 @@
+/*
+ * Written in 2014 by Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * To the extent possible under law, I waive all copyright and related or
+ * neighboring rights. You should have received a copy of the CC0 license along
+ * with this work. If not, see http://creativecommons.org/publicdomain/zero/1.0
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <cpuid.h>
+
+/*
+ * The copy kernels memcpy-test measures, shared with libfastcopy. They all
+ * have memcpy()'s signature, but the aligned and streaming ones only copy
+ * whole vectors, and need the alignment their names say.
+ */
+
+static inline void *naive_incaddr(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	unsigned long tmp;
+
+	while (n--) {
+		asm volatile ("movb (%1),%b0; movb %b0,(%2);" :
+			"=&r" (tmp) : "r" (src), "r" (dst) :
+			"memory");
+		src++;
+		dst++;
+	}
+
+	return ret;
+}
+
+static inline void *naive_effaddr(void *dst, const void *src, size_t n)
+{
+	unsigned long tmp;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		asm volatile ("movb (%1,%3,1),%b0; movb %b0,(%2,%3,1);" :
+			"=&r" (tmp) : "r" (src), "r" (dst), "r" (i) :
+			"memory");
+
+	return dst;
+}
+
+static inline void *erms(void *dst, const void *src, size_t n)
+{
+	void *d = dst;
+
+	asm volatile ("rep movsb;" : "+D" (d), "+S" (src), "+c" (n) :: "memory");
+	return dst;
+}
+
+static inline void *sse_nocache64(void *dst, const void *src, size_t n)
+{
+	unsigned long tmp;
+	size_t i;
+
+	n /= 8;
+	for (i = 0; i < n; i++)
+		asm volatile ("movq (%1,%3,8),%0; movntiq %0,(%2,%3,8);" :
+				"=&r" (tmp) : "r" (src), "r" (dst), "r" (i) :
+				"memory");
+
+	return dst;
+}
+
+static inline void *sse_aligned128(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	double tmp;
+	size_t i;
+
+	n /= 16;
+	for (i = 0; i < n; i++) {
+		asm volatile ("movdqa (%1),%0; movdqa %0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 16;
+		dst += 16;
+	}
+
+	return ret;
+}
+
+__attribute__((target("avx")))
+static inline void *avx_aligned256(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	double tmp;
+	size_t i;
+
+	n /= 32;
+	for (i = 0; i < n; i++) {
+		asm volatile ("vmovdqa (%1),%t0; vmovdqa %t0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 32;
+		dst += 32;
+	}
+
+	asm volatile ("vzeroupper;");
+	return ret;
+}
+
+/*
+ * These work for any alignment and length. Anything shorter than a vector is
+ * passed down to the next narrower kernel, and under 16 bytes to copy_short().
+ * Otherwise the first and last vectors are copied with unaligned loads and
+ * stores, and everything in between with aligned stores, starting at the
+ * first vector boundary in @dst: the head and tail overlap the middle, which
+ * is harmless since they write the same bytes.
+ */
+
+/*
+ * Copy less than 16 bytes with two loads and two stores of the widest size
+ * which fits, the second ending at the end, overlapping the first if need be.
+ */
+static inline void *copy_short(void *dst, const void *src, size_t n)
+{
+	unsigned long a, b;
+
+	if (n >= 8)
+		asm volatile ("movq (%2),%0; movq -8(%2,%4),%1;"
+			      "movq %0,(%3); movq %1,-8(%3,%4);" :
+			"=&r" (a), "=&r" (b) : "r" (src), "r" (dst), "r" (n) :
+			"memory");
+	else if (n >= 4)
+		asm volatile ("movl (%2),%k0; movl -4(%2,%4),%k1;"
+			      "movl %k0,(%3); movl %k1,-4(%3,%4);" :
+			"=&r" (a), "=&r" (b) : "r" (src), "r" (dst), "r" (n) :
+			"memory");
+	else if (n >= 2)
+		asm volatile ("movw (%2),%w0; movw -2(%2,%4),%w1;"
+			      "movw %w0,(%3); movw %w1,-2(%3,%4);" :
+			"=&r" (a), "=&r" (b) : "r" (src), "r" (dst), "r" (n) :
+			"memory");
+	else if (n)
+		asm volatile ("movb (%1),%b0; movb %b0,(%2);" :
+			"=&r" (a) : "r" (src), "r" (dst) : "memory");
+
+	return dst;
+}
+
+static inline void *sse_unaligned128(void *dst, const void *src, size_t n)
+{
+	void *ret = dst, *end = dst + n;
+	double tmp;
+	size_t skip;
+
+	if (n < 16)
+		return copy_short(dst, src, n);
+
+	asm volatile ("movdqu (%1),%0; movdqu %0,(%2);" :
+		"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+	asm volatile ("movdqu -16(%1),%0; movdqu %0,-16(%2);" :
+		"=&x" (tmp) : "r" (src + n), "r" (end) : "memory");
+
+	skip = 16 - ((unsigned long)dst & 15);
+	src += skip;
+	dst += skip;
+	while (dst + 16 <= end) {
+		asm volatile ("movdqu (%1),%0; movdqa %0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 16;
+		dst += 16;
+	}
+
+	return ret;
+}
+
+__attribute__((target("avx")))
+static inline void *avx_unaligned256(void *dst, const void *src, size_t n)
+{
+	void *ret = dst, *end = dst + n;
+	double tmp;
+	size_t skip;
+
+	if (n < 32)
+		return sse_unaligned128(dst, src, n);
+
+	asm volatile ("vmovdqu (%1),%t0; vmovdqu %t0,(%2);" :
+		"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+	asm volatile ("vmovdqu -32(%1),%t0; vmovdqu %t0,-32(%2);" :
+		"=&x" (tmp) : "r" (src + n), "r" (end) : "memory");
+
+	skip = 32 - ((unsigned long)dst & 31);
+	src += skip;
+	dst += skip;
+	while (dst + 32 <= end) {
+		asm volatile ("vmovdqu (%1),%t0; vmovdqa %t0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 32;
+		dst += 32;
+	}
+
+	asm volatile ("vzeroupper;");
+	return ret;
+}
+
+/*
+ * The streaming kernels store around the cache with vmovntdq, which needs an
+ * aligned destination (the loads don't care). The fence makes sure the copy
+ * is really done when they return.
+ */
+
+__attribute__((target("avx")))
+static inline void *avx_nocache256(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	double tmp;
+	size_t i;
+
+	n /= 32;
+	for (i = 0; i < n; i++) {
+		asm volatile ("vmovdqu (%1),%t0; vmovntdq %t0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 32;
+		dst += 32;
+	}
+
+	asm volatile ("sfence; vzeroupper;" ::: "memory");
+	return ret;
+}
+
+__attribute__((target("avx512f")))
+static inline void *avx512_aligned512(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	double tmp;
+	size_t i;
+
+	n /= 64;
+	for (i = 0; i < n; i++) {
+		asm volatile ("vmovdqa64 (%1),%g0; vmovdqa64 %g0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 64;
+		dst += 64;
+	}
+
+	asm volatile ("vzeroupper;");
+	return ret;
+}
+
+__attribute__((target("avx512f")))
+static inline void *avx512_unaligned512(void *dst, const void *src, size_t n)
+{
+	void *ret = dst, *end = dst + n;
+	double tmp;
+	size_t skip;
+
+	if (n < 64)
+		return avx_unaligned256(dst, src, n);
+
+	asm volatile ("vmovdqu64 (%1),%g0; vmovdqu64 %g0,(%2);" :
+		"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+	asm volatile ("vmovdqu64 -64(%1),%g0; vmovdqu64 %g0,-64(%2);" :
+		"=&x" (tmp) : "r" (src + n), "r" (end) : "memory");
+
+	skip = 64 - ((unsigned long)dst & 63);
+	src += skip;
+	dst += skip;
+	while (dst + 64 <= end) {
+		asm volatile ("vmovdqu64 (%1),%g0; vmovdqa64 %g0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 64;
+		dst += 64;
+	}
+
+	asm volatile ("vzeroupper;");
+	return ret;
+}
+
+__attribute__((target("avx512f")))
+static inline void *avx512_nocache512(void *dst, const void *src, size_t n)
+{
+	void *ret = dst;
+	double tmp;
+	size_t i;
+
+	n /= 64;
+	for (i = 0; i < n; i++) {
+		asm volatile ("vmovdqu64 (%1),%g0; vmovntdq %g0,(%2);" :
+			"=&x" (tmp) : "r" (src), "r" (dst) : "memory");
+		src += 64;
+		dst += 64;
+	}
+
+	asm volatile ("sfence; vzeroupper;" ::: "memory");
+	return ret;
+}
+
+/*
+ * VERIFICATION
+ *
+ * Before a kernel is timed, check it does exactly what @ref (memcpy()) does
+ * over the lengths and offsets it supports: every byte near the destination
+ * has to match, so writing past either end is caught as well as copying the
+ * wrong thing. The lengths cover every short path, and the streaming paths
+ * libfastcopy takes from 4KiB. The three buffers must each be VERIFY_BYTES
+ * long, and aligned for the kernel.
+ */
+
+#define VERIFY_SHORT 160
+#define VERIFY_GUARD 64
+#define VERIFY_BYTES ((64 << 10) + 256)
+
+static const size_t verify_offsets[] = {0, 1, 7, 8, 15, 16, 31, 32, 33, 63};
+static const size_t verify_lengths[] = {
+	255, 256, 257, 1000, 4095, 4096, 4097, 8191, 65536, 65537,
+};
+
+#define NR_VERIFY_OFFSETS (sizeof(verify_offsets) / sizeof(verify_offsets[0]))
+#define NR_VERIFY_LENGTHS (sizeof(verify_lengths) / sizeof(verify_lengths[0]))
+
+struct verify_failure {
+	size_t n;
+	size_t src_off;
+	size_t dst_off;
+};
+
+static inline int verify_copy(void *(*fn)(void *, const void *, size_t),
+			      void *(*ref)(void *, const void *, size_t),
+			      size_t src_align, size_t dst_align, size_t width,
+			      char *src, char *dst, char *want,
+			      struct verify_failure *fail)
+{
+	const size_t *offsets = verify_offsets;
+	size_t i, j, s, d, n, end;
+	void *ret;
+
+	for (i = 0; i < VERIFY_BYTES; i++)
+		src[i] = i * 131 + (i >> 8);
+
+	for (i = 0; i < VERIFY_SHORT + NR_VERIFY_LENGTHS; i++) {
+		n = i < VERIFY_SHORT ? i : verify_lengths[i - VERIFY_SHORT];
+		if (n % width)
+			continue;
+
+		for (s = 0; s < NR_VERIFY_OFFSETS; s++) {
+			if (offsets[s] % src_align)
+				continue;
+
+			for (d = 0; d < NR_VERIFY_OFFSETS; d++) {
+				if (offsets[d] % dst_align)
+					continue;
+
+				end = offsets[d] + n + VERIFY_GUARD;
+				for (j = 0; j < end; j++)
+					dst[j] = want[j] = 0xa5;
+
+				ref(want + offsets[d], src + offsets[s], n);
+				ret = fn(dst + offsets[d], src + offsets[s], n);
+
+				for (j = 0; j < end && dst[j] == want[j]; j++)
+					;
+
+				if (ret != dst + offsets[d] || j < end) {
+					fail->n = n;
+					fail->src_off = offsets[s];
+					fail->dst_off = offsets[d];
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * CPU FEATURES
+ *
+ * Nothing is built for the machine it's built on: the kernels which need more
+ * than baseline x86-64 say so with target attributes, and the ones the CPU
+ * (or the kernel, which has to save the wider registers) doesn't support are
+ * dropped from funcs[] before anything runs.
+ */
+
+#define CPU_AVX		(1 << 0)
+#define CPU_AVX512F	(1 << 1)
+#define CPU_ERMS	(1 << 2)
+
+#define CPUID_7_EBX_ERMS (1 << 9)
+#define XCR0_AVX_STATE 0x06
+#define XCR0_AVX512_STATE 0xe6
+
+static inline unsigned int cpu_features(void)
+{
+	unsigned int a, b, c, d, xcr0 = 0, ret = 0;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return 0;
+
+	if (c & bit_OSXSAVE)
+		asm ("xgetbv;" : "=a" (xcr0), "=d" (d) : "c" (0));
+
+	if ((c & bit_AVX) && (xcr0 & XCR0_AVX_STATE) == XCR0_AVX_STATE)
+		ret |= CPU_AVX;
+
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return ret;
+
+	if (b & CPUID_7_EBX_ERMS)
+		ret |= CPU_ERMS;
+
+	if ((b & bit_AVX512F) && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE)
+		ret |= CPU_AVX512F;
+
+	return ret;
+}
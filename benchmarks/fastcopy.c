@@ -0,0 +1,556 @@
+/*
+ * Written in 2014 by Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * To the extent possible under law, I waive all copyright and related or
+ * neighboring rights. You should have received a copy of the CC0 license along
+ * with this work. If not, see http://creativecommons.org/publicdomain/zero/1.0
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <immintrin.h>
+
+#include "copy-kernels.h"
+#include "fastcopy.h"
+
+/*
+ * LIBFASTCOPY
+ *
+ * Requests are split into four size classes, and each class has its own copy
+ * and set kernel. By default, every class uses the widest unaligned vectors
+ * the CPU has. With FASTCOPY_CALIBRATE=1, every candidate the CPU can run is
+ * timed when the library is loaded instead, on a few lengths typical of each
+ * class, relative to libc, and the fastest one overall is used from then on:
+ * the C library's own functions are candidates too, and a kernel has to beat
+ * the one picked so far by CALIBRATE_MARGIN to replace it. Calibrating takes
+ * a couple of hundred milliseconds, and where two kernels are within the
+ * noise of each other it can pick either, so it's only worth it to see what
+ * this CPU likes. Before a kernel is timed, it has to do exactly what libc's
+ * memcpy() or memset() does, or it isn't used at all. FASTCOPY_VERBOSE=1
+ * prints what was picked.
+ *
+ * This isn't an IFUNC, because a resolver runs while the dynamic linker is
+ * still relocating, which is no time to be benchmarking anything. Until the
+ * constructor runs, everything uses rep movsb/stosb, which work anywhere.
+ *
+ * Built with FASTCOPY_PRELOAD, the library also defines memcpy() and
+ * memset(), so LD_PRELOAD can put it under a program without rebuilding it.
+ * The libc versions are found with dlsym(RTLD_NEXT). The library is built
+ * with -fno-builtin and -fno-tree-loop-distribute-patterns, so the compiler
+ * can't turn any of it back into calls to itself.
+ */
+
+#define NR_CLASSES 4
+#define CALIBRATE_NSEC 20000L
+#define CALIBRATE_TRIALS 5
+#define CALIBRATE_MARGIN 0.98
+
+static const size_t class_max[NR_CLASSES - 1] = {256, 4096, 256 << 10};
+
+/* The smallest class covers everything from one byte, so try a spread */
+#define NR_SAMPLES 3
+static const size_t class_sample[NR_CLASSES][NR_SAMPLES] = {
+	{8, 48, 200}, {2048}, {64 << 10}, {8 << 20},
+};
+
+static inline int size_class(size_t n)
+{
+	return (n > class_max[0]) + (n > class_max[1]) + (n > class_max[2]);
+}
+
+typedef void *(*copy_fn)(void *, const void *, size_t);
+typedef void *(*set_fn)(void *, int, size_t);
+
+/*
+ * SET KERNELS
+ *
+ * Like the unaligned copy kernels: the ends are stored unaligned, and the
+ * middle with aligned stores, overlapping the ends.
+ */
+
+static void *set_erms(void *dst, int c, size_t n)
+{
+	void *d = dst;
+
+	asm volatile ("rep stosb;" : "+D" (d), "+c" (n) : "a" (c) : "memory");
+	return dst;
+}
+
+static void *set_nocache64(void *dst, int c, size_t n)
+{
+	long long v = 0x0101010101010101ULL * (unsigned char)c;
+	char *d = dst, *end = d + n;
+	size_t head;
+
+	if (n < 64)
+		return set_erms(dst, c, n);
+
+	head = -(unsigned long)d & 7;
+	set_erms(d, c, head);
+	for (d += head; d + 8 <= end; d += 8)
+		_mm_stream_si64((long long *)d, v);
+
+	set_erms(d, c, end - d);
+	_mm_sfence();
+	return dst;
+}
+
+static void *set_sse128(void *dst, int c, size_t n)
+{
+	__m128i v = _mm_set1_epi8(c);
+	char *d = dst, *end = d + n;
+
+	if (n < 16)
+		return set_erms(dst, c, n);
+
+	_mm_storeu_si128((__m128i *)d, v);
+	_mm_storeu_si128((__m128i *)(end - 16), v);
+	for (d += 16 - ((unsigned long)d & 15); d + 16 <= end; d += 16)
+		_mm_store_si128((__m128i *)d, v);
+
+	return dst;
+}
+
+__attribute__((target("avx")))
+static void *set_avx256(void *dst, int c, size_t n)
+{
+	__m256i v = _mm256_set1_epi8(c);
+	char *d = dst, *end = d + n;
+
+	if (n < 32)
+		return set_sse128(dst, c, n);
+
+	_mm256_storeu_si256((__m256i *)d, v);
+	_mm256_storeu_si256((__m256i *)(end - 32), v);
+	for (d += 32 - ((unsigned long)d & 31); d + 32 <= end; d += 32)
+		_mm256_store_si256((__m256i *)d, v);
+
+	_mm256_zeroupper();
+	return dst;
+}
+
+__attribute__((target("avx512f")))
+static void *set_avx512(void *dst, int c, size_t n)
+{
+	__m512i v = _mm512_set1_epi32(0x01010101U * (unsigned char)c);
+	char *d = dst, *end = d + n;
+
+	if (n < 64)
+		return set_avx256(dst, c, n);
+
+	_mm512_storeu_si512(d, v);
+	_mm512_storeu_si512(end - 64, v);
+	for (d += 64 - ((unsigned long)d & 63); d + 64 <= end; d += 64)
+		_mm512_store_si512(d, v);
+
+	_mm256_zeroupper();
+	return dst;
+}
+
+/*
+ * STREAMING COPIES
+ *
+ * The streaming kernels need an aligned destination, so copy the first and
+ * last vectors unaligned, and stream everything in between. They're only
+ * worth it far beyond the size of the caches.
+ */
+
+__attribute__((target("avx")))
+static void *stream_copy256(void *dst, const void *src, size_t n)
+{
+	size_t head;
+
+	if (n < 4096)
+		return avx_unaligned256(dst, src, n);
+
+	head = 32 - ((unsigned long)dst & 31);
+	avx_unaligned256(dst, src, 32);
+	avx_nocache256(dst + head, src + head, (n - head) & ~31UL);
+	avx_unaligned256(dst + n - 32, src + n - 32, 32);
+	return dst;
+}
+
+__attribute__((target("avx512f")))
+static void *stream_copy512(void *dst, const void *src, size_t n)
+{
+	size_t head;
+
+	if (n < 4096)
+		return avx512_unaligned512(dst, src, n);
+
+	head = 64 - ((unsigned long)dst & 63);
+	avx512_unaligned512(dst, src, 64);
+	avx512_nocache512(dst + head, src + head, (n - head) & ~63UL);
+	avx512_unaligned512(dst + n - 64, src + n - 64, 64);
+	return dst;
+}
+
+/*
+ * DISPATCH
+ */
+
+struct copy_kernel {
+	copy_fn func;
+	const char *name;
+	unsigned int features;
+};
+
+struct set_kernel {
+	set_fn func;
+	const char *name;
+	unsigned int features;
+};
+
+/* The C library's versions go first, and are filled in at load time */
+static struct copy_kernel copy_kernels[] = {
+	{NULL, "libc", 0},
+	{erms, "erms", 0},
+	{sse_unaligned128, "sse_unaligned128", 0},
+	{avx_unaligned256, "avx_unaligned256", CPU_AVX},
+	{stream_copy256, "stream_copy256", CPU_AVX},
+	{avx512_unaligned512, "avx512_unaligned512", CPU_AVX512F},
+	{stream_copy512, "stream_copy512", CPU_AVX512F},
+};
+
+static struct set_kernel set_kernels[] = {
+	{NULL, "libc", 0},
+	{set_erms, "set_erms", 0},
+	{set_nocache64, "set_nocache64", 0},
+	{set_sse128, "set_sse128", 0},
+	{set_avx256, "set_avx256", CPU_AVX},
+	{set_avx512, "set_avx512", CPU_AVX512F},
+};
+
+#define NR_COPY_KERNELS (int)(sizeof(copy_kernels) / sizeof(copy_kernels[0]))
+#define NR_SET_KERNELS (int)(sizeof(set_kernels) / sizeof(set_kernels[0]))
+
+static copy_fn copy_table[NR_CLASSES] = {erms, erms, erms, erms};
+static set_fn set_table[NR_CLASSES] = {set_erms, set_erms, set_erms, set_erms};
+static int copy_choice[NR_CLASSES] = {1, 1, 1, 1};
+static int set_choice[NR_CLASSES] = {1, 1, 1, 1};
+
+void *fast_memcpy(void *dst, const void *src, size_t n)
+{
+	return copy_table[size_class(n)](dst, src, n);
+}
+
+void *fast_memset(void *dst, int c, size_t n)
+{
+	return set_table[size_class(n)](dst, c, n);
+}
+
+const char *fast_memcpy_kernel(size_t n)
+{
+	return copy_kernels[copy_choice[size_class(n)]].name;
+}
+
+const char *fast_memset_kernel(size_t n)
+{
+	return set_kernels[set_choice[size_class(n)]].name;
+}
+
+#ifdef FASTCOPY_PRELOAD
+void *memcpy(void *dst, const void *src, size_t n)
+	__attribute__((alias("fast_memcpy")));
+void *memset(void *dst, int c, size_t n)
+	__attribute__((alias("fast_memset")));
+#endif
+
+/*
+ * CALIBRATION
+ */
+
+static long nsec_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000000L +
+	       (now.tv_nsec - then->tv_nsec);
+}
+
+/*
+ * Returns the best time per call over a few trials, each long enough to make
+ * the clock's resolution irrelevant. Exactly one of @copy and @set is used.
+ */
+static double time_kernel(copy_fn copy, set_fn set, char *dst, const char *src,
+			  size_t n)
+{
+	double best = 0, t;
+	struct timespec then;
+	long reps, i;
+	int trial;
+
+	for (reps = 1;; reps *= 2) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &then);
+		for (i = 0; i < reps; i++)
+			copy ? copy(dst, src, n) : set(dst, 0x5a, n);
+
+		if (nsec_since(&then) >= CALIBRATE_NSEC)
+			break;
+	}
+
+	for (trial = 0; trial < CALIBRATE_TRIALS; trial++) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &then);
+		for (i = 0; i < reps; i++)
+			copy ? copy(dst, src, n) : set(dst, 0x5a, n);
+
+		t = (double)nsec_since(&then) / reps;
+		if (!trial || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+/*
+ * Returns whether copy kernel @k can be used: the CPU has to support it, and
+ * it has to copy like libc does, which is checked in @src and @dst.
+ */
+static int copy_kernel_ok(int k, unsigned int have, char *src, char *dst,
+			  char *want)
+{
+	struct verify_failure fail;
+
+	if ((copy_kernels[k].features & have) != copy_kernels[k].features)
+		return 0;
+
+	if (verify_copy(copy_kernels[k].func, copy_kernels[0].func, 1, 1, 1,
+			src, dst, want, &fail)) {
+		fprintf(stderr, "fastcopy: %s doesn't copy %zu bytes from src+%zu to dst+%zu like memcpy(), not using it\n",
+			copy_kernels[k].name, fail.n, fail.src_off,
+			fail.dst_off);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Like verify_copy(), for a set kernel against @ref (memset()): @dst and @want
+ * must each be VERIFY_BYTES long. The fill value has bits above the low byte
+ * set, which have to be ignored.
+ */
+static int verify_set(set_fn fn, set_fn ref, char *dst, char *want,
+		      struct verify_failure *fail)
+{
+	size_t i, j, d, n, end, off;
+	void *ret;
+
+	for (i = 0; i < VERIFY_SHORT + NR_VERIFY_LENGTHS; i++) {
+		n = i < VERIFY_SHORT ? i : verify_lengths[i - VERIFY_SHORT];
+
+		for (d = 0; d < NR_VERIFY_OFFSETS; d++) {
+			off = verify_offsets[d];
+			end = off + n + VERIFY_GUARD;
+			for (j = 0; j < end; j++)
+				dst[j] = want[j] = 0xa5;
+
+			ref(want + off, 0x15a, n);
+			ret = fn(dst + off, 0x15a, n);
+
+			for (j = 0; j < end && dst[j] == want[j]; j++)
+				;
+
+			if (ret != dst + off || j < end) {
+				fail->n = n;
+				fail->src_off = 0;
+				fail->dst_off = off;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns whether set kernel @k can be used, like copy_kernel_ok()
+ */
+static int set_kernel_ok(int k, unsigned int have, char *dst, char *want)
+{
+	struct verify_failure fail;
+
+	if ((set_kernels[k].features & have) != set_kernels[k].features)
+		return 0;
+
+	if (verify_set(set_kernels[k].func, set_kernels[0].func, dst, want,
+		       &fail)) {
+		fprintf(stderr, "fastcopy: %s doesn't set %zu bytes at dst+%zu like memset(), not using it\n",
+			set_kernels[k].name, fail.n, fail.dst_off);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Fills in @times with the time @copy or @set takes on each sample length of
+ * class @c, and returns how many there are.
+ */
+static int time_class(copy_fn copy, set_fn set, char *dst, const char *src,
+		      int c, double *times)
+{
+	int i;
+
+	for (i = 0; i < NR_SAMPLES && class_sample[c][i]; i++)
+		times[i] = time_kernel(copy, set, dst, src, class_sample[c][i]);
+
+	return i;
+}
+
+/*
+ * Returns the sum of @times relative to @base: libc scores one per sample
+ */
+static double relative_time(const double *times, const double *base, int nr)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		sum += times[i] / base[i];
+
+	return sum;
+}
+
+static void calibrate(unsigned int have)
+{
+	size_t size = class_sample[NR_CLASSES - 1][0];
+	double t, best, base[NR_SAMPLES], times[NR_SAMPLES];
+	int c, k, nr, ok[NR_COPY_KERNELS], set_ok[NR_SET_KERNELS];
+	char *src, *dst, *want;
+
+	src = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		   MAP_ANON|MAP_PRIVATE|MAP_POPULATE, -1, 0);
+	dst = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		   MAP_ANON|MAP_PRIVATE|MAP_POPULATE, -1, 0);
+	want = mmap(NULL, VERIFY_BYTES, PROT_READ|PROT_WRITE,
+		    MAP_ANON|MAP_PRIVATE|MAP_POPULATE, -1, 0);
+	if (src == MAP_FAILED || dst == MAP_FAILED || want == MAP_FAILED)
+		goto out;
+
+	for (k = 1; k < NR_COPY_KERNELS; k++)
+		ok[k] = copy_kernel_ok(k, have, src, dst, want);
+	for (k = 1; k < NR_SET_KERNELS; k++)
+		set_ok[k] = set_kernel_ok(k, have, dst, want);
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		copy_choice[c] = 0;
+		nr = time_class(copy_kernels[0].func, NULL, dst, src, c, base);
+		best = nr;
+		for (k = 1; k < NR_COPY_KERNELS; k++) {
+			if (!ok[k])
+				continue;
+
+			time_class(copy_kernels[k].func, NULL, dst, src, c, times);
+			t = relative_time(times, base, nr);
+			if (t < best * CALIBRATE_MARGIN) {
+				best = t;
+				copy_choice[c] = k;
+			}
+		}
+
+		set_choice[c] = 0;
+		nr = time_class(NULL, set_kernels[0].func, dst, NULL, c, base);
+		best = nr;
+		for (k = 1; k < NR_SET_KERNELS; k++) {
+			if (!set_ok[k])
+				continue;
+
+			time_class(NULL, set_kernels[k].func, dst, NULL, c, times);
+			t = relative_time(times, base, nr);
+			if (t < best * CALIBRATE_MARGIN) {
+				best = t;
+				set_choice[c] = k;
+			}
+		}
+	}
+
+out:
+	if (src != MAP_FAILED)
+		munmap(src, size);
+	if (dst != MAP_FAILED)
+		munmap(dst, size);
+	if (want != MAP_FAILED)
+		munmap(want, VERIFY_BYTES);
+}
+
+/*
+ * Without calibrating, use the widest unaligned vectors the CPU has
+ */
+static void pick_by_features(unsigned int have)
+{
+	copy_fn copy = sse_unaligned128;
+	set_fn set = set_sse128;
+	int c, k;
+
+	if (have & CPU_AVX) {
+		copy = avx_unaligned256;
+		set = set_avx256;
+	}
+
+	if (have & CPU_AVX512F) {
+		copy = avx512_unaligned512;
+		set = set_avx512;
+	}
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		for (k = 0; k < NR_COPY_KERNELS; k++)
+			if (copy_kernels[k].func == copy)
+				copy_choice[c] = k;
+
+		for (k = 0; k < NR_SET_KERNELS; k++)
+			if (set_kernels[k].func == set)
+				set_choice[c] = k;
+	}
+}
+
+__attribute__((constructor))
+static void fastcopy_init(void)
+{
+	const char *env = getenv("FASTCOPY_CALIBRATE");
+	unsigned int have = cpu_features();
+	int c;
+
+#ifdef FASTCOPY_PRELOAD
+	copy_kernels[0].func = (copy_fn)dlsym(RTLD_NEXT, "memcpy");
+	set_kernels[0].func = (set_fn)dlsym(RTLD_NEXT, "memset");
+	if (!copy_kernels[0].func || !set_kernels[0].func)
+		return;
+#else
+	copy_kernels[0].func = memcpy;
+	set_kernels[0].func = memset;
+#endif
+
+	if (env && strcmp(env, "0"))
+		calibrate(have);
+	else
+		pick_by_features(have);
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		copy_table[c] = copy_kernels[copy_choice[c]].func;
+		set_table[c] = set_kernels[set_choice[c]].func;
+	}
+
+	env = getenv("FASTCOPY_VERBOSE");
+	if (!env || !strcmp(env, "0"))
+		return;
+
+	for (c = 0; c < NR_CLASSES; c++)
+		fprintf(stderr, "fastcopy: %s %zu bytes: memcpy %s, memset %s\n",
+			c < NR_CLASSES - 1 ? "up to" : "over",
+			class_max[c < NR_CLASSES - 1 ? c : c - 1],
+			copy_kernels[copy_choice[c]].name,
+			set_kernels[set_choice[c]].name);
+}
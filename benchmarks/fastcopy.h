@@ -0,0 +1,31 @@
+/*
+ * Written in 2014 by Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * To the extent possible under law, I waive all copyright and related or
+ * neighboring rights. You should have received a copy of the CC0 license along
+ * with this work. If not, see http://creativecommons.org/publicdomain/zero/1.0
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Drop-in replacements for memcpy() and memset(), which use whichever kernel
+ * was fastest on this CPU for the size of the request: see fastcopy.c.
+ */
+extern void *fast_memcpy(void *dst, const void *src, size_t n);
+extern void *fast_memset(void *dst, int c, size_t n);
+
+/*
+ * The name of the kernel each would use for @n bytes
+ */
+extern const char *fast_memcpy_kernel(size_t n);
+extern const char *fast_memset_kernel(size_t n);
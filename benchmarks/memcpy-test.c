@@ -16,12 +16,22 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
 #include <time.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <sched.h>
 
+#include "copy-kernels.h"
+
 #define CACHE_LINE_BYTES 64
 
 static inline void flush_cache_line(const void *addr)
@@ -43,117 +53,362 @@ static void dump_caches(const void *a, const void *b, size_t n)
 	asm volatile ("mfence;" ::: "memory");
 }
 
-static void *naive_incaddr(void *dst, const void *src, size_t n)
+/*
+ * @src_align and @dst_align are the alignments the kernel needs for each
+ * buffer: the alignment sweep skips the cells it can't run. @width is the
+ * vector size of a kernel which only copies whole vectors: the main table
+ * skips shorter lengths. @features are the CPU_* features it needs to run at
+ * all.
+ */
+struct memcpy_func {
+	void *(*func)(void*, const void*, size_t);
+	char *name;
+	size_t src_align;
+	size_t dst_align;
+	size_t width;
+	unsigned int features;
+};
+
+#define MEMCPY_FUNC(fn) \
+	{.func = fn, .name = #fn, .src_align = 1, .dst_align = 1, .width = 1,}
+#define MEMCPY_FUNC_VEC(fn, sa, da, w, f) \
+	{.func = fn, .name = #fn, .src_align = sa, .dst_align = da, .width = w, \
+	 .features = f,}
+static struct memcpy_func funcs[] = {
+	MEMCPY_FUNC(naive_incaddr),
+	MEMCPY_FUNC(naive_effaddr),
+	MEMCPY_FUNC_VEC(sse_nocache64, 1, 1, 8, 0),
+	MEMCPY_FUNC_VEC(sse_aligned128, 16, 16, 16, 0),
+	MEMCPY_FUNC(sse_unaligned128),
+	MEMCPY_FUNC_VEC(avx_aligned256, 32, 32, 32, CPU_AVX),
+	MEMCPY_FUNC_VEC(avx_unaligned256, 1, 1, 1, CPU_AVX),
+	MEMCPY_FUNC_VEC(avx_nocache256, 1, 32, 32, CPU_AVX),
+	MEMCPY_FUNC_VEC(avx512_aligned512, 64, 64, 64, CPU_AVX512F),
+	MEMCPY_FUNC_VEC(avx512_unaligned512, 1, 1, 1, CPU_AVX512F),
+	MEMCPY_FUNC_VEC(avx512_nocache512, 1, 64, 64, CPU_AVX512F),
+	MEMCPY_FUNC(erms),
+	MEMCPY_FUNC(memcpy),
+	MEMCPY_FUNC(NULL),
+};
+
+/*
+ * Drop the kernels this CPU can't run from funcs[], keeping the order
+ */
+static void select_funcs(void)
+{
+	unsigned int have = cpu_features();
+	int i, j;
+
+	printf("CPU features:%s%s%s\n", have & CPU_AVX ? " avx" : "",
+	       have & CPU_AVX512F ? " avx512f" : "",
+	       have & CPU_ERMS ? " erms" : "");
+
+	for (i = j = 0; funcs[i].func; i++) {
+		if ((funcs[i].features & have) != funcs[i].features) {
+			printf("Skipping %s, this CPU doesn't support it\n", funcs[i].name);
+			continue;
+		}
+
+		funcs[j++] = funcs[i];
+	}
+
+	funcs[j] = funcs[i];
+}
+
+/*
+ * Drop the kernels which don't copy exactly what memcpy() does from funcs[],
+ * so a broken kernel can't look fast
+ */
+static void verify_funcs(void)
 {
-	void *ret = dst;
-	unsigned long tmp = 0;
+	char *src, *dst, *want;
+	struct verify_failure fail;
+	int i, j;
+
+	src = aligned_alloc(64, VERIFY_BYTES);
+	dst = aligned_alloc(64, VERIFY_BYTES);
+	want = aligned_alloc(64, VERIFY_BYTES);
+	if (!src || !dst || !want) {
+		puts("Couldn't allocate verification buffers!");
+		abort();
+	}
+
+	for (i = j = 0; funcs[i].func; i++) {
+		if (verify_copy(funcs[i].func, memcpy, funcs[i].src_align,
+				funcs[i].dst_align, funcs[i].width, src, dst,
+				want, &fail)) {
+			printf("WARNING: Skipping %s, it doesn't copy %zu bytes from src+%zu to dst+%zu like memcpy()\n",
+			       funcs[i].name, fail.n, fail.src_off, fail.dst_off);
+			continue;
+		}
 
-	while (n--) {
-		asm ("movb (%0),%b1; movb %b1,(%2);" ::
-			"r" (src), "r" (tmp), "r" (dst) :
-			"memory");
-		src++;
-		dst++;
+		funcs[j++] = funcs[i];
+	}
+
+	funcs[j] = funcs[i];
+	free(want);
+	free(dst);
+	free(src);
+}
+
+/*
+ * PAGES
+ *
+ * The buffers can be backed by base pages, transparent huge pages, or explicit
+ * hugetlb pages, so we can see how much of the cost of a big copy is TLB
+ * misses. "default" leaves it to the system THP policy, which is what we did
+ * before there was a choice. Buffers are rounded up to a whole number of huge
+ * pages, and must be freed with free_buffer() so the rounding matches.
+ */
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+struct page_kind {
+	const char *name;
+	size_t size;
+	int flags;
+	int advice;
+};
+
+static const struct page_kind page_kinds[] = {
+	{"default", 0, 0, -1},
+	{"4k", 0, 0, MADV_NOHUGEPAGE},
+	{"thp", HUGE_2M, 0, MADV_HUGEPAGE},
+	{"2m", HUGE_2M, MAP_HUGETLB | MAP_HUGE_2MB, -1},
+	{"1g", HUGE_1G, MAP_HUGETLB | MAP_HUGE_1GB, -1},
+	{NULL},
+};
+
+static const struct page_kind *pages = &page_kinds[0];
+
+static size_t buffer_len(size_t size)
+{
+	if (!pages->size)
+		return size;
+
+	return (size + pages->size - 1) & ~(pages->size - 1);
+}
+
+/*
+ * Map a buffer without faulting it in. Returns NULL if this kind of page isn't
+ * available, which for hugetlb means nobody reserved enough of them.
+ */
+static void *map_buffer(size_t size)
+{
+	size_t len = buffer_len(size);
+	char *ret, *aligned;
+
+	if (pages->flags & MAP_HUGETLB) {
+		ret = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			   MAP_ANON|MAP_PRIVATE|pages->flags, -1, 0);
+		return ret == MAP_FAILED ? NULL : ret;
+	}
+
+	/* THP can only back huge page aligned ranges, so align it ourselves */
+	ret = mmap(NULL, len + pages->size, PROT_READ|PROT_WRITE,
+		   MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (ret == MAP_FAILED)
+		return NULL;
+
+	if (pages->size) {
+		aligned = (char *)(((unsigned long)ret + pages->size - 1) &
+				   ~(pages->size - 1));
+		if (aligned != ret)
+			munmap(ret, aligned - ret);
+
+		munmap(aligned + len, ret + pages->size - aligned);
+		ret = aligned;
+	}
+
+	if (pages->advice != -1 && madvise(ret, len, pages->advice)) {
+		munmap(ret, len);
+		return NULL;
 	}
 
 	return ret;
 }
 
-static void *naive_effaddr(void *dst, const void *src, size_t n)
+static void *alloc_buffer(size_t size)
 {
-	unsigned long tmp = 0;
-	size_t i;
+	void *ret = map_buffer(size);
 
-	for (i = 0; i < n; i++)
-		asm ("movb (%0,%3,1),%b1; movb %b1,(%2,%3,1);" ::
-			"r" (src), "r" (tmp), "r" (dst), "r" (i) :
-			"memory");
+	if (!ret) {
+		puts("Couldn't allocate buffer!");
+		abort();
+	}
 
-	return dst;
+	/* Fault it in after the advice, so the advice applies */
+	memset(ret, 0, buffer_len(size));
+	return ret;
 }
 
-static void *erms(void *dst, const void *src, size_t n)
+static void free_buffer(void *buf, size_t size)
 {
-	asm ("rep movsb;" :: "S" (dst), "D" (src), "c" (n) : "memory","cc");
-	return dst;
+	munmap(buf, buffer_len(size));
 }
 
-static void *sse_nocache64(void *dst, const void *src, size_t n)
+static int set_page_kind(const char *name)
 {
-	unsigned long tmp = 0;
-	size_t i;
+	int i;
 
-	n /= 8;
-	for (i = 0; i < n; i++)
-		asm ("movq (%0,%3,8),%1; movntiq %1,(%2,%3,8);" ::
-				"r" (src), "r" (tmp), "r" (dst), "r" (i) :
-				"memory");
+	for (i = 0; page_kinds[i].name; i++) {
+		if (!strcmp(page_kinds[i].name, name)) {
+			pages = &page_kinds[i];
+			return 0;
+		}
+	}
 
-	return dst;
+	return -1;
 }
 
-static void *sse_aligned128(void *dst, const void *src, size_t n)
+/*
+ * Check the current kind of page can actually be had for all @nr buffers of
+ * @size bytes a test maps at once, and complain if not. Mapping hugetlb pages
+ * reserves them, so this fails here rather than when a test faults them in.
+ */
+static int pages_available(size_t size, int nr)
 {
-	double tmp = 0;
-	size_t i;
+	char buf[128] = "";
+	void **p;
+	int i, ok, err;
+	FILE *f;
 
-	n /= 16;
-	for (i = 0; i < n; i++) {
-		asm ("movdqa (%0),%1; movdqa %1,(%0);" ::
-			"r" (src), "x" (tmp), "r" (dst) : "memory");
-		src += 16;
-		dst += 16;
+	p = calloc(nr, sizeof(*p));
+	if (!p) {
+		puts("Couldn't allocate buffer list!");
+		abort();
+	}
+
+	for (i = 0; i < nr; i++)
+		if (!(p[i] = map_buffer(size)))
+			break;
+
+	err = errno;
+	ok = i == nr;
+	while (i--)
+		free_buffer(p[i], size);
+	free(p);
+
+	if (!ok) {
+		errno = err;
+		printf("WARNING: Couldn't map %d %zu KiB buffers of %s pages, skipping them: %m\n",
+		       nr, size >> 10, pages->name);
+		return 0;
 	}
 
-	return dst;
+	if (pages->advice == MADV_HUGEPAGE) {
+		f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+		if (f) {
+			if (!fgets(buf, sizeof(buf), f))
+				buf[0] = '\0';
+
+			fclose(f);
+		}
+
+		if (strstr(buf, "[never]"))
+			puts("WARNING: THP is disabled, thp means 4k here");
+	}
+
+	return 1;
 }
 
-static void *avx_aligned256(void *dst, const void *src, size_t n)
+/*
+ * TLB COUNTERS
+ *
+ * Count user mode dTLB load and store misses with perf, by raw syscall since
+ * glibc has no wrapper. Some CPUs only count one of the two, and VMs and
+ * locked down kernels often count neither, in which case we just don't report
+ * them. The counters are inherited by the threads of the scaling test, whose
+ * counts are added to ours when they exit: resetting a counter doesn't clear
+ * those, so we count the difference between the start and the stop instead.
+ */
+
+static int tlb_fds[2] = {-1, -1};
+static uint64_t tlb_base[2];
+
+static int open_tlb_counters(void)
 {
-	double tmp = 0;
-	size_t i;
+	static const int ops[2] = {
+		PERF_COUNT_HW_CACHE_OP_READ,
+		PERF_COUNT_HW_CACHE_OP_WRITE,
+	};
+	struct perf_event_attr attr;
+	int i;
 
-	n /= 32;
-	for (i = 0; i < n; i++) {
-		asm ("vmovdqa (%0),%1; vmovdqa %1,(%0);" ::
-			"r" (src), "x" (tmp), "r" (dst) : "memory");
-		src += 32;
-		dst += 32;
+	for (i = 0; i < 2; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | ops[i] << 8 |
+			      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+
+		tlb_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
 	}
 
-	return dst;
+	return tlb_fds[0] == -1 && tlb_fds[1] == -1 ? -1 : 0;
 }
 
-struct memcpy_func {
-	void *(*func)(void*, const void*, size_t);
-	char *name;
-};
+static int have_tlb_counters(void)
+{
+	return tlb_fds[0] != -1 || tlb_fds[1] != -1;
+}
 
-#define MEMCPY_FUNC(fn) {.func = fn, .name = #fn,}
-static struct memcpy_func funcs[] = {
-	MEMCPY_FUNC(naive_incaddr),
-	MEMCPY_FUNC(naive_effaddr),
-	MEMCPY_FUNC(sse_nocache64),
-	MEMCPY_FUNC(sse_aligned128),
-	MEMCPY_FUNC(avx_aligned256),
-	MEMCPY_FUNC(erms),
-	MEMCPY_FUNC(memcpy),
-	MEMCPY_FUNC(NULL),
-};
+static void tlb_start(void)
+{
+	int i;
 
-static void *alloc_buffer(size_t size)
+	for (i = 0; i < 2; i++) {
+		if (tlb_fds[i] == -1)
+			continue;
+
+		if (read(tlb_fds[i], &tlb_base[i], sizeof(tlb_base[i])) !=
+		    sizeof(tlb_base[i]))
+			tlb_base[i] = 0;
+
+		ioctl(tlb_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static unsigned long tlb_stop(void)
 {
-	void *ret = mmap(NULL, size, PROT_READ|PROT_WRITE,
-			MAP_ANON|MAP_PRIVATE|MAP_POPULATE, 0, 0);
+	unsigned long total = 0;
+	uint64_t v;
+	int i;
 
-	if (ret == MAP_FAILED) {
-		puts("Couldn't allocate buffer!");
-		abort();
+	for (i = 0; i < 2; i++) {
+		if (tlb_fds[i] == -1)
+			continue;
+
+		ioctl(tlb_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(tlb_fds[i], &v, sizeof(v)) == sizeof(v))
+			total += v - tlb_base[i];
 	}
 
-	return ret;
+	return total;
 }
 
+/*
+ * Returns @misses per MiB of @bytes copied
+ */
+static double tlb_per_mib(unsigned long misses, double bytes)
+{
+	return misses / bytes * (1 << 20);
+}
 
 static int monopolize_cpu(void)
 {
@@ -175,58 +430,1012 @@ static int monopolize_cpu(void)
 	return sched_setscheduler(0, SCHED_FIFO, &sp);
 }
 
-void run_tests(int max_order, long count)
+/*
+ * Every (function, order) cell is timed over many trials, each of which
+ * copies the buffer back and forth enough times to take at least
+ * MIN_TRIAL_NSEC, so the clock's resolution doesn't matter. The spread of
+ * the trials is checked with the coefficient of variation (stddev / mean):
+ * a cell over the limit is measured again from scratch, keeping whichever
+ * attempt was quietest, and is marked with a '*' if none were quiet enough.
+ * The tail is reported as the slowest trial, since a p99 is just the slowest
+ * of fewer than a hundred trials anyway.
+ */
+
+#define MIN_TRIAL_NSEC 50000L
+#define DEFAULT_TRIALS 50
+#define DEFAULT_MAX_CV 0.02
+#define DEFAULT_RERUNS 3
+
+struct cell_stats {
+	double min;
+	double median;
+	double p90;
+	double max;
+	double cv;
+	double tlb;
+	int noisy;
+	int unsupported;
+};
+
+static long nsec_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000000L +
+	       (now.tv_nsec - then->tv_nsec);
+}
+
+static long time_copies(struct memcpy_func *f, char *a, char *b, size_t n,
+			long reps)
+{
+	struct timespec then;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &then);
+	for (i = 0; i < reps; i++) {
+		f->func(a, b, n);
+		f->func(b, a, n);
+	}
+
+	return nsec_since(&then);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Nearest rank percentile of the sorted samples
+ */
+static double percentile(const double *s, int n, double p)
 {
-	int order, i, j;
+	int i = (int)(p * n + 0.999999) - 1;
+
+	return s[i < 0 ? 0 : i];
+}
+
+static void measure_cell(struct memcpy_func *f, char *a, char *b, size_t n,
+			 int trials, double *samples, struct cell_stats *st)
+{
+	double mean = 0, var = 0;
+	long reps = 1;
+	int i;
+
+	dump_caches(a, b, n);
+
+	/* Calibrating doubles as the warmup */
+	while (time_copies(f, a, b, n, reps) < MIN_TRIAL_NSEC)
+		reps *= 2;
+
+	tlb_start();
+	for (i = 0; i < trials; i++) {
+		samples[i] = (double)time_copies(f, a, b, n, reps) /
+			     (n * reps * 2) * 1024.0;
+		mean += samples[i];
+	}
+
+	st->tlb = tlb_per_mib(tlb_stop(), (double)n * reps * 2 * trials);
+
+	mean /= trials;
+	for (i = 0; i < trials; i++)
+		var += (samples[i] - mean) * (samples[i] - mean);
+
+	qsort(samples, trials, sizeof(*samples), cmp_double);
+	st->min = samples[0];
+	st->median = percentile(samples, trials, 0.5);
+	st->p90 = percentile(samples, trials, 0.9);
+	st->max = samples[trials - 1];
+	st->cv = sqrt(var / trials) / mean;
+}
+
+static void print_row(const char *name, const char *stat,
+		      struct cell_stats *st, int nr, size_t offset)
+{
+	int i;
+
+	printf("%-19s %5s:", name, stat);
+	for (i = 0; i < nr; i++) {
+		double v = *(double *)((char *)&st[i] + offset);
+
+		if (st[i].unsupported)
+			printf(" %5s ", "x");
+		else if (offset == offsetof(struct cell_stats, cv))
+			printf(" %5.1f%c", v * 100.0, st[i].noisy ? '*' : ' ');
+		else if (offset == offsetof(struct cell_stats, tlb))
+			printf(" %5.*f ", v < 1000.0 ? 1 : 0, v);
+		else
+			printf(" %05.0f ", v);
+	}
+	puts("");
+}
+
+void run_tests(int max_order, int trials, double max_cv, int reruns)
+{
+	int order, i, j, nr = max_order - 3;
 	char *src_buf, *dst_buf;
 	struct memcpy_func *cur;
-	struct timespec then, now;
-	long nsec_elapsed, buffer_size, total_copied;
-	double ns_per_kbyte;
+	struct cell_stats *st, tmp;
+	long buffer_size;
+	double *samples;
 
 	buffer_size = 1L << max_order;
 
 	src_buf = alloc_buffer(buffer_size);
 	dst_buf = alloc_buffer(buffer_size);
+	st = calloc(nr, sizeof(*st));
+	samples = calloc(trials, sizeof(*samples));
+	if (!st || !samples) {
+		puts("Couldn't allocate statistics!");
+		abort();
+	}
 
-	printf("%20s:", "ORDER");
+	printf("ns/KiB over %d trials, cells re-run up to %d times if CV > %.1f%%\n",
+	       trials, reruns, max_cv * 100.0);
+	if (have_tlb_counters())
+		puts("dTLB is load and store misses per MiB copied");
+	puts("x is shorter than the vector the kernel copies whole");
+	printf("%25s:", "ORDER");
 	for (order = 4; order <= max_order; order++)
-		printf(" %-5d", order);
+		printf(" %-5d ", order);
 	puts("");
 
 	for (i = 0; (cur = &funcs[i]) && cur->func; i++) {
-		printf("%-20s:", cur->name);
-
 		for (order = 4; order <= max_order; order++) {
-			dump_caches(src_buf, dst_buf, 1UL << order);
+			struct cell_stats *c = &st[order - 4];
+
+			c->unsupported = (1UL << order) < cur->width;
+			if (c->unsupported)
+				continue;
+
+			measure_cell(cur, src_buf, dst_buf, 1UL << order,
+				     trials, samples, c);
+
+			for (j = 0; j < reruns && c->cv > max_cv; j++) {
+				measure_cell(cur, src_buf, dst_buf, 1UL << order,
+					     trials, samples, &tmp);
+				if (tmp.cv < c->cv)
+					*c = tmp;
+			}
+
+			c->noisy = c->cv > max_cv;
+		}
+
+		print_row(cur->name, "min", st, nr, offsetof(struct cell_stats, min));
+		print_row("", "med", st, nr, offsetof(struct cell_stats, median));
+		print_row("", "p90", st, nr, offsetof(struct cell_stats, p90));
+		print_row("", "max", st, nr, offsetof(struct cell_stats, max));
+		print_row("", "cv%", st, nr, offsetof(struct cell_stats, cv));
+		if (have_tlb_counters())
+			print_row("", "dTLB", st, nr, offsetof(struct cell_stats, tlb));
+		fflush(stdout);
+	}
+
+	free(samples);
+	free(st);
+	free_buffer(src_buf, buffer_size);
+	free_buffer(dst_buf, buffer_size);
+}
+
+/*
+ * ALIGNMENT SWEEP
+ *
+ * Time copying @size bytes from every source offset to every destination
+ * offset 0..63 bytes past a page boundary, and draw a map for each kernel of
+ * the median of a few trials relative to its fully aligned cell. The rows are
+ * source offsets and the columns destination offsets. The dTLB misses are
+ * counted over the whole map.
+ */
+
+#define SWEEP_OFFSETS 64
+#define SWEEP_TRIALS 7
+
+static char heat(double ratio)
+{
+	static const struct {
+		double max;
+		char c;
+	} levels[] = {
+		{1.02, ' '}, {1.05, '.'}, {1.10, ':'}, {1.25, '-'},
+		{1.50, '+'}, {2.00, '*'},
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+		if (ratio < levels[i].max)
+			return levels[i].c;
+
+	return '#';
+}
+
+/*
+ * Time copying @n bytes from @src to @dst, only in that direction, and return
+ * the median over @trials trials of @reps copies in ns/KiB.
+ */
+static double time_one_way(struct memcpy_func *f, char *dst, const char *src,
+			   size_t n, long reps, int trials, double *samples)
+{
+	struct timespec then;
+	long j;
+	int i;
+
+	for (i = 0; i < trials; i++) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &then);
+		for (j = 0; j < reps; j++)
+			f->func(dst, src, n);
+
+		samples[i] = (double)nsec_since(&then) / (n * reps) * 1024.0;
+	}
+
+	qsort(samples, trials, sizeof(*samples), cmp_double);
+	return percentile(samples, trials, 0.5);
+}
+
+/*
+ * Returns how many copies a trial of time_one_way() needs to take at least
+ * MIN_TRIAL_NSEC, which warms things up as a side effect.
+ */
+static long calibrate_one_way(struct memcpy_func *f, char *dst, const char *src,
+			      size_t n)
+{
+	struct timespec then;
+	long reps, j;
+
+	for (reps = 1;; reps *= 2) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &then);
+		for (j = 0; j < reps; j++)
+			f->func(dst, src, n);
+
+		if (nsec_since(&then) >= MIN_TRIAL_NSEC)
+			return reps;
+	}
+}
+
+void run_alignment_sweep(size_t size)
+{
+	double base, ratio, sum, worst, samples[SWEEP_TRIALS];
+	int i, s, d, nr, worst_s, worst_d;
+	char *src_buf, *dst_buf;
+	struct memcpy_func *cur;
+	unsigned long misses;
+	long reps;
+
+	src_buf = alloc_buffer(size + SWEEP_OFFSETS);
+	dst_buf = alloc_buffer(size + SWEEP_OFFSETS);
+	memset(src_buf, 0x5a, size + SWEEP_OFFSETS);
+
+	printf("Alignment sweep copying %zu bytes, median of %d trials relative to offset 0/0\n",
+	       size, SWEEP_TRIALS);
+	printf("' ' <2%%  '.' <5%%  ':' <10%%  '-' <25%%  '+' <50%%  '*' <100%%  '#' slower  'x' unsupported\n");
+
+	for (i = 0; (cur = &funcs[i]) && cur->func; i++) {
+		reps = calibrate_one_way(cur, dst_buf, src_buf, size);
+		tlb_start();
+		base = time_one_way(cur, dst_buf, src_buf, size, reps,
+				    SWEEP_TRIALS, samples);
+		sum = worst = 0;
+		nr = worst_s = worst_d = 0;
+
+		printf("\n%s: %.0f ns/KiB aligned\n", cur->name, base);
+		printf("src\\dst ");
+		for (d = 0; d < SWEEP_OFFSETS; d += 8)
+			printf("%-8d", d);
+		puts("");
+
+		for (s = 0; s < SWEEP_OFFSETS; s++) {
+			printf("%7d ", s);
+			for (d = 0; d < SWEEP_OFFSETS; d++) {
+				if (s % cur->src_align || d % cur->dst_align) {
+					putchar('x');
+					continue;
+				}
+
+				ratio = time_one_way(cur, dst_buf + d, src_buf + s,
+						     size, reps, SWEEP_TRIALS,
+						     samples) / base;
+				sum += ratio;
+				nr++;
+				if (ratio > worst) {
+					worst = ratio;
+					worst_s = s;
+					worst_d = d;
+				}
+
+				putchar(heat(ratio));
+			}
+
+			puts("");
+			fflush(stdout);
+		}
+
+		printf("%s: mean %.2fx, worst %.2fx at src+%d dst+%d", cur->name,
+		       sum / nr, worst, worst_s, worst_d);
+		misses = tlb_stop();
+		if (have_tlb_counters())
+			printf(", %.1f dTLB misses per MiB",
+			       tlb_per_mib(misses, (double)size * reps *
+						   SWEEP_TRIALS * (nr + 1)));
+		puts("");
+	}
+
+	free_buffer(src_buf, size + SWEEP_OFFSETS);
+	free_buffer(dst_buf, size + SWEEP_OFFSETS);
+}
+
+/*
+ * BANDWIDTH SCALING
+ *
+ * Run each kernel on 1..N threads at once, each pinned to its own CPU (in the
+ * order of our affinity mask, wrapping if there are more threads than CPUs),
+ * copying a 2^max_order byte buffer back and forth. Every thread either has
+ * its own pair of buffers, or they all share one pair. The threads start
+ * together at a barrier, and do the same number of copies, calibrated so one
+ * thread takes at least SCALE_MIN_NSEC: the aggregate bandwidth is all the
+ * bytes copied over the time from the first thread starting to the last one
+ * finishing, and the per-thread bandwidth is the mean of what each thread saw
+ * by itself. Each line is the trial with the median aggregate bandwidth, and
+ * the dTLB misses of all the threads per MiB they copied.
+ *
+ * The saturation point is the fewest threads which get within
+ * SCALE_SATURATED of the best aggregate bandwidth any number of threads did.
+ */
+
+#define SCALE_MIN_NSEC 100000000L
+#define SCALE_TRIALS 5
+#define SCALE_SATURATED 0.95
+
+struct scale_thread {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	struct memcpy_func *f;
+	char *a;
+	char *b;
+	size_t size;
+	long reps;
+	int cpu;
+	struct timespec start;
+	struct timespec end;
+} __attribute__((aligned(64)));
+
+struct scale_result {
+	double total;
+	double per_thread;
+	double tlb;
+};
+
+static double ts_nsec(const struct timespec *ts)
+{
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+static void *scale_thread_fn(void *arg)
+{
+	struct scale_thread *t = arg;
+	cpu_set_t mask;
+	long i;
+
+	CPU_ZERO(&mask);
+	CPU_SET(t->cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		printf("WARNING: Couldn't pin thread to CPU %d: %m\n", t->cpu);
+
+	pthread_barrier_wait(t->barrier);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t->start);
+	for (i = 0; i < t->reps; i++) {
+		t->f->func(t->a, t->b, t->size);
+		t->f->func(t->b, t->a, t->size);
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t->end);
+
+	return NULL;
+}
+
+static int cmp_scale_result(const void *a, const void *b)
+{
+	return cmp_double(&((const struct scale_result *)a)->total,
+			  &((const struct scale_result *)b)->total);
+}
+
+static void run_scale_trial(struct scale_thread *threads, int nr,
+			    struct scale_result *res)
+{
+	double first = 0, last = 0, bytes, per_thread = 0;
+	pthread_barrier_t barrier;
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, nr);
+	tlb_start();
+	for (i = 0; i < nr; i++) {
+		threads[i].barrier = &barrier;
+		if (pthread_create(&threads[i].thread, NULL, scale_thread_fn, &threads[i])) {
+			puts("Couldn't create thread!");
+			abort();
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (!i || ts_nsec(&threads[i].start) < first)
+			first = ts_nsec(&threads[i].start);
+		if (!i || ts_nsec(&threads[i].end) > last)
+			last = ts_nsec(&threads[i].end);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	bytes = 2.0 * threads[0].size * threads[0].reps;
+	res->tlb = tlb_per_mib(tlb_stop(), bytes * nr);
+	for (i = 0; i < nr; i++)
+		per_thread += bytes / (ts_nsec(&threads[i].end) -
+				       ts_nsec(&threads[i].start));
+
+	res->total = bytes * nr / (last - first);
+	res->per_thread = per_thread / nr;
+}
+
+void run_scaling(int max_order, int max_threads, int shared)
+{
+	struct scale_result *results, trials[SCALE_TRIALS];
+	size_t size = 1UL << max_order;
+	struct scale_thread *threads;
+	int i, k, nr, nr_cpus = 0, *cpus, saturated;
+	struct memcpy_func *cur;
+	cpu_set_t mask;
+	double best;
+	long reps;
+
+	if (sched_getaffinity(0, sizeof(mask), &mask)) {
+		puts("Couldn't get CPU affinity!");
+		abort();
+	}
+
+	cpus = calloc(CPU_SETSIZE, sizeof(*cpus));
+	threads = aligned_alloc(64, max_threads * sizeof(*threads));
+	results = calloc(max_threads + 1, sizeof(*results));
+	if (!cpus || !threads || !results) {
+		puts("Couldn't allocate threads!");
+		abort();
+	}
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &mask))
+			cpus[nr_cpus++] = i;
+
+	memset(threads, 0, max_threads * sizeof(*threads));
+	for (i = 0; i < max_threads; i++) {
+		threads[i].cpu = cpus[i % nr_cpus];
+		threads[i].size = size;
+		if (!i || !shared) {
+			threads[i].a = alloc_buffer(size);
+			threads[i].b = alloc_buffer(size);
+		} else {
+			threads[i].a = threads[0].a;
+			threads[i].b = threads[0].b;
+		}
+	}
+
+	printf("Bandwidth scaling on up to %d threads over %d CPUs, %s %zu KiB buffers, median of %d trials\n",
+	       max_threads, nr_cpus, shared ? "one shared pair of" : "private",
+	       size >> 10, SCALE_TRIALS);
+
+	for (k = 0; (cur = &funcs[k]) && cur->func; k++) {
+		/* Calibrate on one thread, and use the same count for all */
+		for (reps = 1;; reps *= 2) {
+			threads[0].f = cur;
+			threads[0].reps = reps;
+			run_scale_trial(threads, 1, &trials[0]);
+			if (ts_nsec(&threads[0].end) - ts_nsec(&threads[0].start) >= SCALE_MIN_NSEC)
+				break;
+		}
+
+		printf("\n%s:\n%8s %12s %16s %8s%s\n", cur->name, "threads",
+		       "total GB/s", "per-thread GB/s", "speedup",
+		       have_tlb_counters() ? "  dTLB/MiB" : "");
+
+		best = 0;
+		for (nr = 1; nr <= max_threads; nr++) {
+			for (i = 0; i < nr; i++) {
+				threads[i].f = cur;
+				threads[i].reps = reps;
+			}
+
+			for (i = 0; i < SCALE_TRIALS; i++)
+				run_scale_trial(threads, nr, &trials[i]);
+
+			qsort(trials, SCALE_TRIALS, sizeof(*trials), cmp_scale_result);
+			results[nr] = trials[SCALE_TRIALS / 2];
+			if (results[nr].total > best)
+				best = results[nr].total;
+
+			printf("%8d %12.2f %16.2f %7.2fx", nr, results[nr].total,
+			       results[nr].per_thread, results[nr].total / results[1].total);
+			if (have_tlb_counters())
+				printf(" %10.1f", results[nr].tlb);
+			puts("");
+			fflush(stdout);
+		}
+
+		for (saturated = 1; results[saturated].total < best * SCALE_SATURATED; saturated++)
+			;
+
+		printf("%s: saturates at %d threads, %.2f GB/s (peak %.2f GB/s)\n",
+		       cur->name, saturated, results[saturated].total, best);
+	}
+
+	for (i = 0; i < max_threads; i++) {
+		if (i && shared)
+			break;
+
+		free_buffer(threads[i].a, size);
+		free_buffer(threads[i].b, size);
+	}
+
+	free(results);
+	free(threads);
+	free(cpus);
+}
+
+/*
+ * NUMA PLACEMENT
+ *
+ * For every node with CPUs we may use, pin ourselves to its CPUs and time
+ * one way copies of 2^max_order bytes between every pair of source and
+ * destination nodes, giving a matrix of GB/s for each kernel. The buffers are
+ * placed with the mbind() and move_pages() system calls directly, so this
+ * doesn't need libnuma. Without NUMA support, with only one node, or if any
+ * buffer can't be bound to its node, the whole machine is node 0 and there's
+ * one row. With dTLB counters, each row of GB/s is followed by one of misses
+ * per MiB copied.
+ */
+
+#define MAX_NODES 64
+#define NODE_SYSFS "/sys/devices/system/node"
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_STRICT
+#define MPOL_MF_STRICT (1 << 0)
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+struct numa_node {
+	int id;
+	cpu_set_t cpus;
+	int nr_cpus;
+};
+
+/*
+ * Parse a sysfs list like "0-3,8,10-11" into @set, a bitmap of @max bits.
+ * Returns the number of entries, or -1 if it doesn't parse.
+ */
+static int parse_list_file(const char *path, unsigned char *set, int max)
+{
+	int lo, hi, n = 0, nr = 0;
+	char buf[4096], *p;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p)
+		return -1;
+
+	memset(set, 0, (max + 7) / 8);
+	while (sscanf(p, "%d%n", &lo, &n) == 1) {
+		p += n;
+		hi = lo;
+		if (*p == '-' && sscanf(p + 1, "%d%n", &hi, &n) == 1)
+			p += n + 1;
+
+		for (; lo <= hi && lo < max; lo++, nr++)
+			set[lo / 8] |= 1 << (lo % 8);
+
+		if (*p != ',')
+			break;
+		p++;
+	}
+
+	return nr;
+}
+
+/*
+ * Make the whole machine node 0
+ */
+static int one_numa_node(struct numa_node *nodes, const cpu_set_t *allowed)
+{
+	nodes[0].id = 0;
+	nodes[0].cpus = *allowed;
+	nodes[0].nr_cpus = CPU_COUNT(allowed);
+	return 1;
+}
+
+/*
+ * Returns the number of nodes, filling in @nodes with their CPUs which are
+ * also in @allowed (the nodes without any still count, as places to put
+ * memory).
+ */
+static int get_numa_nodes(struct numa_node *nodes, const cpu_set_t *allowed)
+{
+	unsigned char online[MAX_NODES / 8], cpus[CPU_SETSIZE / 8];
+	char path[128];
+	int i, c, nr = 0;
+
+	if (parse_list_file(NODE_SYSFS "/online", online, MAX_NODES) <= 0)
+		return one_numa_node(nodes, allowed);
+
+	for (i = 0; i < MAX_NODES; i++) {
+		if (!(online[i / 8] & (1 << (i % 8))))
+			continue;
+
+		nodes[nr].id = i;
+		nodes[nr].nr_cpus = 0;
+		CPU_ZERO(&nodes[nr].cpus);
 
-			clock_gettime(CLOCK_MONOTONIC_RAW, &then);
-			for (j = 0; j < count; j++) {
-				cur->func(src_buf, dst_buf, 1UL << order);
-				cur->func(dst_buf, src_buf, 1UL << order);
+		snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", i);
+		if (parse_list_file(path, cpus, CPU_SETSIZE) > 0) {
+			for (c = 0; c < CPU_SETSIZE; c++) {
+				if (!(cpus[c / 8] & (1 << (c % 8))) ||
+				    !CPU_ISSET(c, allowed))
+					continue;
+
+				CPU_SET(c, &nodes[nr].cpus);
+				nodes[nr].nr_cpus++;
 			}
-			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		}
+
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Returns a buffer of @size bytes bound to @node, or NULL if it can't be
+ * bound there.
+ */
+static void *alloc_node_buffer(size_t size, int node)
+{
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+	void *ret;
+
+	ret = map_buffer(size);
+	if (!ret) {
+		puts("Couldn't allocate buffer!");
+		abort();
+	}
+
+	mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+	if (syscall(SYS_mbind, ret, buffer_len(size), MPOL_BIND, mask, MAX_NODES,
+		    MPOL_MF_STRICT | MPOL_MF_MOVE)) {
+		printf("WARNING: Couldn't bind memory to node %d, ignoring NUMA: %m\n", node);
+		free_buffer(ret, size);
+		return NULL;
+	}
+
+	/* Fault it in now, under the policy */
+	memset(ret, 0, buffer_len(size));
+	return ret;
+}
+
+/*
+ * Returns the fraction of the pages of @buf which move_pages() says are on
+ * @node, which should be all of them unless the node ran out of memory.
+ */
+static double fraction_on_node(void *buf, size_t size, int node)
+{
+	long page = sysconf(_SC_PAGESIZE), i, nr = size / page, on = 0;
+	void **pages = calloc(nr, sizeof(*pages));
+	int *status = calloc(nr, sizeof(*status));
 
-			nsec_elapsed = (now.tv_sec - then.tv_sec) * 1000000000L;
-			nsec_elapsed += (now.tv_nsec - then.tv_nsec);
+	if (!pages || !status) {
+		puts("Couldn't allocate page list!");
+		abort();
+	}
+
+	for (i = 0; i < nr; i++)
+		pages[i] = (char *)buf + i * page;
+
+	if (syscall(SYS_move_pages, 0, nr, pages, NULL, status, 0))
+		on = -nr;
+
+	for (i = 0; i < nr && on >= 0; i++)
+		on += status[i] == node;
+
+	free(status);
+	free(pages);
+	return on < 0 ? -1.0 : (double)on / nr;
+}
+
+/*
+ * Put two buffers on each node, so a node can copy to itself. If any of them
+ * can't be bound, frees the ones that were and returns -1: a matrix where
+ * some nodes are placed and others aren't would be nonsense.
+ */
+static int alloc_numa_buffers(char *(*bufs)[2], const struct numa_node *nodes,
+			      int nr_nodes, size_t size)
+{
+	double frac;
+	int i, k;
+
+	for (i = 0; i < nr_nodes; i++) {
+		for (k = 0; k < 2; k++) {
+			bufs[i][k] = alloc_node_buffer(size, nodes[i].id);
+			if (!bufs[i][k]) {
+				while (k--)
+					free_buffer(bufs[i][k], size);
+				while (i--)
+					for (k = 0; k < 2; k++)
+						free_buffer(bufs[i][k], size);
+
+				return -1;
+			}
 
-			total_copied = (1L << order) * count * 2;
-			ns_per_kbyte = (double)nsec_elapsed / total_copied * 1000.0;
-			printf(" %05.0f", ns_per_kbyte);
+			frac = fraction_on_node(bufs[i][k], size, nodes[i].id);
+			if (frac >= 0 && frac < 0.99)
+				printf("WARNING: Only %.0f%% of a buffer is on node %d\n",
+				       frac * 100.0, nodes[i].id);
 		}
+	}
+
+	return 0;
+}
+
+void run_numa_matrix(int max_order, int trials)
+{
+	struct numa_node nodes[MAX_NODES];
+	char *bufs[MAX_NODES][2];
+	double tlb[MAX_NODES];
+	size_t size = 1UL << max_order;
+	int i, k, r, src, dst, nr_nodes, numa;
+	struct memcpy_func *cur;
+	cpu_set_t allowed;
+	double *samples;
+	long reps;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		puts("Couldn't get CPU affinity!");
+		abort();
+	}
+
+	samples = calloc(trials, sizeof(*samples));
+	if (!samples) {
+		puts("Couldn't allocate statistics!");
+		abort();
+	}
 
+	nr_nodes = get_numa_nodes(nodes, &allowed);
+	numa = nr_nodes > 1;
+	if (numa && alloc_numa_buffers(bufs, nodes, nr_nodes, size)) {
+		nr_nodes = one_numa_node(nodes, &allowed);
+		numa = 0;
+	}
+
+	if (!numa)
+		for (i = 0; i < nr_nodes; i++)
+			for (k = 0; k < 2; k++)
+				bufs[i][k] = alloc_buffer(size);
+
+	printf("NUMA copy matrix over %d node%s, %zu KiB one way copies, GB/s (median of %d trials)\n",
+	       nr_nodes, nr_nodes == 1 ? "" : "s", size >> 10, trials);
+	if (!numa)
+		puts("Buffers aren't placed: every copy is local");
+
+	for (k = 0; (cur = &funcs[k]) && cur->func; k++) {
+		printf("\n%s:\n", cur->name);
+		printf("%-10s %-8s", "cpu node", "src\\dst");
+		for (dst = 0; dst < nr_nodes; dst++)
+			printf(" %8d", nodes[dst].id);
 		puts("");
+
+		for (r = 0; r < nr_nodes; r++) {
+			if (!nodes[r].nr_cpus)
+				continue;
+
+			if (sched_setaffinity(0, sizeof(nodes[r].cpus), &nodes[r].cpus))
+				printf("WARNING: Couldn't run on node %d: %m\n", nodes[r].id);
+
+			for (src = 0; src < nr_nodes; src++) {
+				printf("%-10d %-8d", nodes[r].id, nodes[src].id);
+				for (dst = 0; dst < nr_nodes; dst++) {
+					char *d = bufs[dst][0], *s = bufs[src][src == dst];
+
+					reps = calibrate_one_way(cur, d, s, size);
+					tlb_start();
+					/* ns per KiB to bytes per ns */
+					printf(" %8.2f", 1024.0 / time_one_way(cur, d, s,
+							size, reps, trials, samples));
+					tlb[dst] = tlb_per_mib(tlb_stop(),
+							       (double)size * reps * trials);
+					fflush(stdout);
+				}
+				puts("");
+
+				if (!have_tlb_counters())
+					continue;
+
+				printf("%-10s %-8s", "", "dTLB");
+				for (dst = 0; dst < nr_nodes; dst++)
+					printf(" %8.1f", tlb[dst]);
+				puts("");
+			}
+		}
 	}
 
-	munmap(src_buf, buffer_size);
-	munmap(dst_buf, buffer_size);
+	sched_setaffinity(0, sizeof(allowed), &allowed);
+	for (i = 0; i < nr_nodes; i++)
+		for (k = 0; k < 2; k++)
+			free_buffer(bufs[i][k], size);
+
+	free(samples);
 }
 
-int main(void)
+static void usage(const char *name)
 {
-	if (monopolize_cpu())
+	printf("Usage: %s [-o max_order] [-t trials] [-c max_cv_percent] [-r reruns] [-a sweep_bytes] [-j max_threads [-s]] [-n] [-p pages]\n", name);
+	printf("\t-a: Run the alignment sweep copying this many bytes instead\n");
+	printf("\t-j: Measure bandwidth scaling on 1..max_threads threads instead\n");
+	printf("\t-s: Make the threads share one pair of buffers\n");
+	printf("\t-n: Measure copies between each pair of NUMA nodes instead\n");
+	printf("\t-p: Comma separated page kinds to back the buffers with, each run in\n");
+	printf("\t    turn: default, 4k, thp, 2m, 1g, or all\n");
+}
+
+struct run_opts {
+	int max_order;
+	int trials;
+	double max_cv;
+	int reruns;
+	long sweep_bytes;
+	int max_threads;
+	int shared;
+	int numa;
+};
+
+static void run_selected(const struct run_opts *o)
+{
+	if (o->max_threads)
+		run_scaling(o->max_order, o->max_threads, o->shared);
+	else if (o->numa)
+		run_numa_matrix(o->max_order, o->trials);
+	else if (o->sweep_bytes)
+		run_alignment_sweep(o->sweep_bytes);
+	else
+		run_tests(o->max_order, o->trials, o->max_cv, o->reruns);
+}
+
+/*
+ * Returns how many buffers the selected test maps at once, and sets @size to
+ * how big each one is.
+ */
+static int buffers_needed(const struct run_opts *o, size_t *size)
+{
+	struct numa_node nodes[MAX_NODES];
+	cpu_set_t allowed;
+
+	*size = 1UL << o->max_order;
+	if (o->max_threads)
+		return o->shared ? 2 : 2 * o->max_threads;
+
+	if (o->numa) {
+		if (sched_getaffinity(0, sizeof(allowed), &allowed))
+			CPU_ZERO(&allowed);
+
+		return 2 * get_numa_nodes(nodes, &allowed);
+	}
+
+	if (o->sweep_bytes)
+		*size = o->sweep_bytes + SWEEP_OFFSETS;
+
+	return 2;
+}
+
+/*
+ * Run the test once with the buffers backed by each kind of page in the comma
+ * separated list @kinds.
+ */
+static void run_pages(char *kinds, const struct run_opts *o)
+{
+	char all[] = "4k,thp,2m,1g";
+	char *kind, *save;
+	int nr = 0, nr_buffers;
+	size_t size;
+
+	if (!strcmp(kinds, "all"))
+		kinds = all;
+
+	for (kind = strtok_r(kinds, ",", &save); kind;
+	     kind = strtok_r(NULL, ",", &save)) {
+		if (set_page_kind(kind)) {
+			printf("Unknown page kind '%s'\n", kind);
+			continue;
+		}
+
+		nr_buffers = buffers_needed(o, &size);
+		if (!pages_available(size, nr_buffers))
+			continue;
+
+		printf("%sPages: %s\n", nr++ ? "\n" : "", pages->name);
+		fflush(stdout);
+		run_selected(o);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct run_opts opts = {
+		.max_order = 25,
+		.trials = DEFAULT_TRIALS,
+		.max_cv = DEFAULT_MAX_CV,
+		.reruns = DEFAULT_RERUNS,
+	};
+	char *kinds = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:t:c:r:a:j:snp:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			opts.max_order = atoi(optarg);
+			break;
+		case 't':
+			opts.trials = atoi(optarg);
+			break;
+		case 'c':
+			opts.max_cv = atof(optarg) / 100.0;
+			break;
+		case 'r':
+			opts.reruns = atoi(optarg);
+			break;
+		case 'a':
+			opts.sweep_bytes = atol(optarg);
+			break;
+		case 'j':
+			opts.max_threads = atoi(optarg);
+			break;
+		case 's':
+			opts.shared = 1;
+			break;
+		case 'n':
+			opts.numa = 1;
+			break;
+		case 'p':
+			kinds = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (opts.max_order < 4 || opts.max_order > 40 || opts.trials < 1 ||
+	    opts.reruns < 0 || opts.sweep_bytes < 0 || opts.sweep_bytes % 64 ||
+	    opts.max_threads < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	select_funcs();
+	verify_funcs();
+
+	if (open_tlb_counters())
+		printf("WARNING: Couldn't open dTLB counters, not counting misses: %m\n");
+
+	/*
+	 * The threads pin themselves, and hogging every CPU is asking for it.
+	 * Likewise, the NUMA matrix pins itself to one node at a time.
+	 */
+	if (!opts.max_threads && !opts.numa && monopolize_cpu())
 		printf("WARNING: Couldn't hog CPU: %m\n");
 
-	run_tests(25, 200);
+	if (kinds)
+		run_pages(kinds, &opts);
+	else
+		run_selected(&opts);
+
 	return 0;
 }
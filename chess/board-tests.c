@@ -13,6 +13,12 @@
  */
 
 #include "board.c"
+#include "nnue.c"
+#include "trace.c"
+#include "timeman.c"
+#include "cache.c"
+#include "negamax.h"
+#include "pgn-parse.h"
 
 /*
  * Validate the starting board is self-consistent
@@ -23,20 +29,608 @@ static void test_starting_consistency(void)
 	int i;
 
 	for (i = 0; i < 32; i++) {
-		struct position p = *__pos(c, i);
+		unsigned char sq = *__pos(c, i);
 
 		/*
 		 * Validate piece @i in the position map does in fact exist at
-		 * the coordinates it is supposed to on the starting board.
+		 * the square it is supposed to on the starting board.
 		 */
-		BUG_ON(p_id(*__piece(c, p.x, p.y)) != i);
+		BUG_ON(p_id(c->sq[sq]) != i);
 	}
 
 	free(c);
 }
 
+/*
+ * Validate the side to move, castling rights, and en passant square in the
+ * board header are maintained as moves are made.
+ */
+static void test_board_header(void)
+{
+	struct chessboard *c = get_new_board();
+
+	BUG_ON(c->side != WHITE || c->ep != NO_SQUARE || c->castling != 0xf);
+
+	BUG_ON(execute_move(c, 4, 1, 4, 3));
+	BUG_ON(c->side != BLACK || c->ep != SQUARE(4, 2));
+
+	BUG_ON(execute_move(c, 6, 7, 5, 5));
+	BUG_ON(c->side != WHITE || c->ep != NO_SQUARE);
+
+	BUG_ON(execute_move(c, 4, 0, 4, 1));
+	BUG_ON(c->castling != (CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN));
+
+	BUG_ON(execute_move(c, 5, 5, 6, 7));
+	BUG_ON(execute_move(c, 0, 1, 0, 3));
+	BUG_ON(execute_move(c, 7, 6, 7, 4));
+	BUG_ON(execute_move(c, 0, 0, 0, 2));
+	BUG_ON(execute_move(c, 7, 7, 7, 5));
+	BUG_ON(c->castling != CASTLE_BLACK_QUEEN || c->ep != NO_SQUARE);
+
+	free(c);
+}
+
+/*
+ * Validate the move generator against published perft results, which between
+ * them exercise castling, en passant, and promotion, including the awkward
+ * cases where each of them interacts with check.
+ */
+static void test_perft(void)
+{
+	static const struct {
+		const char *fen;
+		unsigned long long nodes[4];
+	} positions[] = {
+		{
+			"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+			{20, 400, 8902, 197281},
+		},
+		{
+			"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+			{48, 2039, 97862, 0},
+		},
+		{
+			"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+			{14, 191, 2812, 43238},
+		},
+		{
+			"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+			{6, 264, 9467, 0},
+		},
+		{
+			"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+			{44, 1486, 62379, 0},
+		},
+	};
+	struct chessboard *c, *start = get_new_board();
+	unsigned int i, d;
+
+	for (i = 0; i < sizeof(positions) / sizeof(*positions); i++) {
+		c = get_fen_board(positions[i].fen);
+		BUG_ON(!c);
+
+		for (d = 0; d < 4 && positions[i].nodes[d]; d++)
+			BUG_ON(perft(c, d + 1) != positions[i].nodes[d]);
+
+		if (i == 0)
+			BUG_ON(memcmp(c, start, sizeof(*c)));
+
+		free(c);
+	}
+
+	BUG_ON(get_fen_board("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBN w KQkq -"));
+	BUG_ON(get_fen_board("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR x KQkq -"));
+	BUG_ON(get_fen_board("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQQBNR w KQkq -"));
+	BUG_ON(get_fen_board("8/8/8/8/8/8/8/8 w - -"));
+	free(start);
+}
+
+/*
+ * Validate positions survive being written out as EPD and packed, and read
+ * back in again.
+ */
+static void test_position_output(void)
+{
+	static const char *const epds[] = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -",
+		"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+		"rnbqkb1r/ppp1pppp/5n2/3pP3/8/8/PPPP1PPP/RNBQKBNR w Kq d6",
+		"8/P7/8/8/8/8/k6K/8 b - -",
+	};
+	struct chessboard *c, *u;
+	struct packed_position pp;
+	char buf[EPD_MAX];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(epds) / sizeof(*epds); i++) {
+		c = get_fen_board(epds[i]);
+		BUG_ON(!c);
+
+		BUG_ON(board_epd(c, buf) != (int)strlen(epds[i]));
+		BUG_ON(strcmp(buf, epds[i]));
+
+		pack_board(c, &pp);
+		BUG_ON(pp.result != PACKED_NO_RESULT);
+		u = unpack_board(&pp);
+		BUG_ON(!u || memcmp(c, u, sizeof(*c)));
+
+		free(u);
+		free(c);
+	}
+
+	memset(&pp, 0, sizeof(pp));
+	BUG_ON(unpack_board(&pp));
+}
+
+static void put_piece(struct chessboard *c, int x, int y, enum piece_type t,
+		      enum piece_color color, enum piece_id id)
+{
+	*__piece(c, x, y) = P(t, color, id);
+	*__pos(c, __p_id(color, id)) = SQUARE(x, y);
+}
+
+/*
+ * Validate replaying PGN: SAN castling, promotion, en passant and sloppy
+ * captures, skipping comments, variations and NAGs, games without moves
+ * (which count, but have no positions), and abandoning a game at an illegal
+ * move. Nothing from one game may leak into the next.
+ */
+static void test_pgn(void)
+{
+	static const char pgn[] =
+		"[Event \"Forfeit\"]\n"
+		"[FEN \"4k3/8/8/8/8/8/8/4K2R w K - 0 1\"]\n"
+		"[Result \"1-0\"]\n\n"
+		"1-0\n\n"
+		"[Event \"Ruy Lopez\"]\n"
+		"[Result \"1/2-1/2\"]\n\n"
+		"1. e4 e5 2. Nf3 Nc6 3. Bb5 a6 4. O-O {castles} (4. d4 exd4) Nf6 $1\n"
+		"5. d4 ed4 6. e5 d5 7. exd6 1/2-1/2\n\n"
+		"[Event \"Promotion\"]\n"
+		"[FEN \"8/P7/8/8/8/8/k6K/8 w - - 0 1\"]\n"
+		"[Result \"1-0\"]\n\n"
+		"1. a8=Q+ Kb3 1-0\n\n"
+		"[Event \"Illegal\"]\n"
+		"[Result \"*\"]\n\n"
+		"1. e4 e5 2. Ke3 *\n";
+	static const struct {
+		int line;
+		const char *fen;
+	} want[] = {
+		{0, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1 [0.5]"},
+		{7, "r1bqkbnr/1ppp1ppp/p1n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQ1RK1 b kq - 1 4 [0.5]"},
+		{13, "r1bqkb1r/1pp2ppp/p1nP1n2/1B6/3p4/5N2/PPP2PPP/RNBQ1RK1 b kq - 0 7 [0.5]"},
+		{15, "Q7/8/8/8/8/8/k6K/8 b - - 0 1 [1.0]"},
+		{17, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"},
+	};
+	struct pgn_shard s = {
+		.start = pgn,
+		.end = pgn + sizeof(pgn) - 1,
+	};
+	char lines[32][EPD_MAX + 32];
+	unsigned int i, n = 0;
+
+	s.out = tmpfile();
+	BUG_ON(!s.out);
+	pgn_thread(&s);
+
+	BUG_ON(s.games != 4 || s.bad_games != 1 || s.positions != 20);
+
+	rewind(s.out);
+	while (n < 32 && fgets(lines[n], sizeof(lines[n]), s.out)) {
+		lines[n][strcspn(lines[n], "\n")] = '\0';
+		n++;
+	}
+	fclose(s.out);
+
+	BUG_ON(n != 20);
+	for (i = 0; i < sizeof(want) / sizeof(*want); i++)
+		BUG_ON(strcmp(lines[want[i].line], want[i].fen));
+}
+
+/*
+ * Validate static exchange evaluation, including x-ray attackers
+ */
+static void test_static_exchange(void)
+{
+	struct move m = new_move(4, 0, 4, 5);
+	struct chessboard *c;
+
+	/* Rook takes an undefended pawn */
+	c = get_zero_board();
+	put_piece(c, 4, 0, ROOK, WHITE, K_ROOK);
+	put_piece(c, 4, 5, PAWN, BLACK, K_KING_PAWN);
+	BUG_ON(static_exchange_eval(c, m) != piece_values[PAWN]);
+
+	/* ...which is defended by another pawn */
+	put_piece(c, 3, 6, PAWN, BLACK, Q_QUEEN_PAWN);
+	BUG_ON(static_exchange_eval(c, m) != piece_values[PAWN] - piece_values[ROOK]);
+	free(c);
+
+	/* Rook takes a knight defended by a rook */
+	c = get_zero_board();
+	put_piece(c, 4, 0, ROOK, WHITE, K_ROOK);
+	put_piece(c, 4, 5, KNIGHT, BLACK, K_KNIGHT);
+	put_piece(c, 4, 7, ROOK, BLACK, K_ROOK);
+	BUG_ON(static_exchange_eval(c, m) != piece_values[KNIGHT] - piece_values[ROOK]);
+
+	/* ...with a second rook behind the first, attacking through it */
+	put_piece(c, 4, 1, ROOK, WHITE, Q_ROOK);
+	m = new_move(4, 1, 4, 5);
+	BUG_ON(static_exchange_eval(c, m) != piece_values[KNIGHT]);
+	free(c);
+
+	/* Pawn takes en passant, which lands on an empty square */
+	c = get_zero_board();
+	put_piece(c, 4, 4, PAWN, WHITE, K_KING_PAWN);
+	put_piece(c, 3, 4, PAWN, BLACK, Q_QUEEN_PAWN);
+	c->ep = SQUARE(3, 5);
+	m = new_move(4, 4, 3, 5);
+	BUG_ON(!move_is_capture(c, m));
+	BUG_ON(static_exchange_eval(c, m) != piece_values[PAWN]);
+
+	/* ...and is recaptured */
+	put_piece(c, 2, 6, PAWN, BLACK, Q_BISHOP_PAWN);
+	BUG_ON(static_exchange_eval(c, m) != 0);
+	BUG_ON(move_is_capture(c, new_move(4, 4, 4, 5)));
+	free(c);
+}
+
+/*
+ * Validate that transpositions hash the same, and side to move is hashed
+ */
+static void test_board_hash(void)
+{
+	struct chessboard *a = get_new_board();
+	struct chessboard *b = get_new_board();
+
+	BUG_ON(board_hash(a, WHITE) == board_hash(a, BLACK));
+
+	execute_move(a, 1, 0, 2, 2);
+	execute_move(a, 6, 0, 5, 2);
+	BUG_ON(board_hash(a, WHITE) == board_hash(b, WHITE));
+
+	execute_move(b, 6, 0, 5, 2);
+	execute_move(b, 1, 0, 2, 2);
+	BUG_ON(board_hash(a, WHITE) != board_hash(b, WHITE));
+
+	free(a);
+	free(b);
+}
+
+/*
+ * Validate the incrementally updated NNUE accumulator matches one computed
+ * from scratch, and that the SIMD kernels match the scalar one, using a
+ * network with random weights.
+ */
+static void test_nnue(void)
+{
+	static const struct move moves[] = {
+		{SQUARE(4, 1), SQUARE(4, 3)},
+		{SQUARE(3, 6), SQUARE(3, 4)},
+		{SQUARE(4, 3), SQUARE(3, 4)},
+		{SQUARE(3, 7), SQUARE(3, 4)},
+		{SQUARE(1, 0), SQUARE(2, 2)},
+		{SQUARE(3, 4), SQUARE(0, 1)},
+	};
+	struct nnue_file_header h = {
+		.magic = NNUE_MAGIC,
+		.version = NNUE_VERSION,
+		.inputs = NNUE_INPUTS,
+		.hidden = NNUE_HIDDEN,
+		.l1 = NNUE_L1,
+	};
+	struct nnue_accumulator acc[2], fresh;
+	char path[] = "/tmp/chess-nnue-test.XXXXXX";
+	struct move_list l;
+	struct chessboard *c = get_new_board();
+	unsigned int i, len;
+	short *w;
+	int fd;
+
+	len = (NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN + NNUE_L1 * NNUE_HIDDEN +
+	       NNUE_L1 * 2 + NNUE_L1 + 2);
+	w = malloc(len * sizeof(*w));
+	BUG_ON(!w);
+
+	srand(1);
+	for (i = 0; i < len; i++)
+		w[i] = rand() % 64 - 24;
+
+	fd = mkstemp(path);
+	BUG_ON(fd == -1);
+	BUG_ON(write(fd, &h, sizeof(h)) != sizeof(h));
+	BUG_ON(write(fd, w, len * sizeof(*w)) != (ssize_t)(len * sizeof(*w)));
+	close(fd);
+
+	BUG_ON(nnue_load(path));
+	unlink(path);
+
+	nnue_refresh(&acc[0], c);
+	for (i = 0; i < sizeof(moves) / sizeof(*moves); i++) {
+		nnue_update(&acc[!(i & 1)], &acc[i & 1], c, moves[i]);
+		BUG_ON(execute_move(c, move_sx(moves[i]), move_sy(moves[i]),
+				    move_dx(moves[i]), move_dy(moves[i])));
+
+		nnue_refresh(&fresh, c);
+		BUG_ON(memcmp(&fresh, &acc[!(i & 1)], sizeof(fresh)));
+		BUG_ON(nnue_evaluate(&fresh) != forward_scalar(&fresh));
+#ifdef NNUE_X86
+		BUG_ON(forward_sse2(&fresh) != forward_scalar(&fresh));
+		if (__builtin_cpu_supports("avx2"))
+			BUG_ON(forward_avx2(&fresh) != forward_scalar(&fresh));
+#endif
+	}
+
+	/* Castling both ways, en passant, and (under)promotions with capture */
+	free(c);
+	c = get_fen_board("r3k2r/1P6/8/3pP3/8/8/8/R3K2R w KQkq d6 0 1");
+	BUG_ON(!c);
+
+	l.n = 0;
+	enumerate_moves(c, WHITE, &l);
+	BUG_ON(l.n != 36);
+
+	nnue_refresh(&acc[0], c);
+	for (i = 0; i < (unsigned int)l.n; i++) {
+		struct chessboard tmp = *c;
+
+		nnue_update(&acc[1], &acc[0], c, l.m[i]);
+		execute_raw_move(&tmp, l.m[i]);
+		nnue_refresh(&fresh, &tmp);
+		BUG_ON(memcmp(&fresh, &acc[1], sizeof(fresh)));
+	}
+
+	nnue_unload();
+	free(w);
+	free(c);
+}
+
+/*
+ * Validate the batched heuristic matches the one-at-a-time version
+ */
+static void test_batched_heuristic(void)
+{
+	struct chessboard *boards[HEURISTIC_BATCH];
+	int scores[HEURISTIC_BATCH];
+	int i, n, x, y;
+
+	srand(2);
+	for (n = 1; n <= 37; n += 12) {
+		for (i = 0; i < n; i++) {
+			boards[i] = get_new_board();
+
+			/* Remove a random piece, so the boards differ */
+			x = rand() % 8;
+			y = rand() % 8;
+			if (!pos_empty(boards[i], x, y)) {
+				*__pos(boards[i], p_id(get_piece(boards[i], x, y))) = NO_SQUARE;
+				*__piece(boards[i], x, y) = 0;
+			}
+		}
+
+		calculate_board_heuristics(boards, n, scores);
+		for (i = 0; i < n; i++) {
+			BUG_ON(scores[i] != calculate_board_heuristic(boards[i]));
+			free(boards[i]);
+		}
+	}
+}
+
+/*
+ * Validate records emitted on two rings all reach the file, each thread's in
+ * the order they were emitted, with nothing dropped.
+ */
+static void test_trace(void)
+{
+	char path[] = "/tmp/chess-trace-test.XXXXXX";
+	struct trace_file_header h;
+	struct trace_record rec;
+	struct move m = new_move(1, 2, 3, 4);
+	int fd, i, ply, next[2] = {0, 0};
+
+	fd = mkstemp(path);
+	BUG_ON(fd == -1);
+	close(fd);
+
+	BUG_ON(trace_start(path, 2));
+	trace_new_search();
+	for (i = 0; i < 1000; i++)
+		trace_emit(trace_ring(i & 1), i % 7, m, -i, i, i >> 1, TRACE_EXACT);
+
+	BUG_ON(trace_ring(0)->dropped || trace_ring(1)->dropped);
+	BUG_ON(trace_ring(2));
+	trace_stop();
+
+	fd = open(path, O_RDONLY);
+	BUG_ON(fd == -1);
+	unlink(path);
+
+	BUG_ON(read(fd, &h, sizeof(h)) != sizeof(h));
+	BUG_ON(memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)));
+	BUG_ON(h.record_size != sizeof(rec));
+
+	while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		i = next[rec.thread] * 2 + rec.thread;
+		ply = i % 7;
+		BUG_ON(rec.search != 1 || rec.ply != ply || rec.alpha != -i ||
+		       rec.beta != i || rec.score != i >> 1 || rec.move != (SQUARE(1, 2) | SQUARE(3, 4) << 8));
+		next[rec.thread]++;
+	}
+
+	BUG_ON(next[0] != 500 || next[1] != 500);
+	close(fd);
+}
+
+/*
+ * Validate the per-move limits are sane for a range of clocks, that the soft
+ * limit shrinks for a settled search and stretches for an unsettled one, and
+ * that the hard limit fires.
+ */
+static void test_time_manager(void)
+{
+	static const unsigned long clocks[] = {0, 10, 100, 1000, 60000, 3600000};
+	struct time_manager tm;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(clocks) / sizeof(*clocks)); i++) {
+		tm_start_clock(&tm, clocks[i], 0, 0);
+		BUG_ON(tm.soft > tm.hard || tm.hard > clocks[i] * 1000);
+		tm_start_clock(&tm, clocks[i], 500, 0);
+		BUG_ON(tm.soft > tm.hard || tm.hard > (clocks[i] + 500) * 1000);
+	}
+
+	/* With no time left on the clock, the first iteration is the last */
+	tm_start_fixed(&tm, 0);
+	while (!tm_hard_limit_hit())
+		usleep(1000);
+	BUG_ON(tm_next_iteration(&tm, 1, 0));
+	tm_stop(&tm);
+	BUG_ON(tm_hard_limit_hit());
+
+	/*
+	 * The soft limit shrinks as the best move settles, and stretches when
+	 * it changes or the score drops, but never past the hard limit
+	 */
+	memset(&tm, 0, sizeof(tm));
+	tm.soft = 100000;
+	tm.hard = 300000;
+	tm.best = -1;
+	BUG_ON(scaled_soft_limit(&tm, 1, 0) != 100000);
+	BUG_ON(scaled_soft_limit(&tm, 1, 0) != 100000);
+	BUG_ON(scaled_soft_limit(&tm, 1, 0) != 100000);
+	BUG_ON(scaled_soft_limit(&tm, 1, 0) != 100000 * SCALE_STABLE / 100);
+	BUG_ON(scaled_soft_limit(&tm, 1, -SCORE_SWING) !=
+	       100000 * SCALE_STABLE / 100);
+	BUG_ON(scaled_soft_limit(&tm, 1, -SCORE_SWING * 3) !=
+	       100000 * SCALE_STABLE / 100 * SCALE_SCORE_DROP / 100);
+	BUG_ON(scaled_soft_limit(&tm, 2, -SCORE_SWING * 3) !=
+	       100000 * SCALE_UNSTABLE / 100);
+	BUG_ON(scaled_soft_limit(&tm, 3, -SCORE_SWING * 6) !=
+	       100000 * SCALE_UNSTABLE / 100 * SCALE_SCORE_DROP / 100);
+	tm.soft = 200000;
+	BUG_ON(scaled_soft_limit(&tm, 4, -SCORE_SWING * 9) != tm.hard);
+
+	/*
+	 * Past the soft limit, or without time for an iteration twice as long
+	 * as the last before the hard limit, there's no next iteration. Time
+	 * only ever makes these later, so they can't be flaky.
+	 */
+	memset(&tm, 0, sizeof(tm));
+	tm.soft = 100000;
+	tm.hard = 1000000;
+	tm.start = now_usec() - 150000;
+	BUG_ON(tm_next_iteration(&tm, 1, 0));
+
+	memset(&tm, 0, sizeof(tm));
+	tm.soft = 1000000;
+	tm.hard = 1000000;
+	tm.start = now_usec() - 400000;
+	tm.last_iteration = 50000;
+	BUG_ON(tm_next_iteration(&tm, 1, 0));
+}
+
+/*
+ * Validate the result cache only returns results at least as deep as asked
+ * for, keeps results for different parameters apart, and evicts the least
+ * recently used entry when it is full.
+ */
+static void test_result_cache(void)
+{
+	struct result_cache *rc;
+	struct cache_result res;
+	struct cache_stats st;
+	unsigned long long k;
+
+	BUG_ON(cache_init(&rc, 8) != -EINVAL);
+	BUG_ON(cache_init(&rc, 4 * sizeof(int) + 4 * sizeof(struct cache_entry)));
+
+	cache_get_stats(rc, &st);
+	BUG_ON(st.capacity != 4);
+
+	BUG_ON(cache_lookup(rc, 1, 0, 1, &res));
+	cache_insert(rc, 1, 0, 5, 0x1234, 12);
+	BUG_ON(!cache_lookup(rc, 1, 0, 5, &res));
+	BUG_ON(res.move != 0x1234 || res.score != 12 || res.depth != 5);
+	BUG_ON(!cache_lookup(rc, 1, 0, 3, &res) || res.depth != 5);
+	BUG_ON(cache_lookup(rc, 1, 0, 6, &res));
+	BUG_ON(cache_lookup(rc, 1, 1, 1, &res));
+
+	/* A shallower result doesn't replace a deeper one */
+	cache_insert(rc, 1, 0, 4, 0x4321, 0);
+	BUG_ON(!cache_lookup(rc, 1, 0, 5, &res) || res.move != 0x1234);
+
+	/* Fill it up, then use key 1 so key 2 is the least recently used */
+	for (k = 2; k <= 4; k++)
+		cache_insert(rc, k, 0, 1, k, 0);
+
+	BUG_ON(!cache_lookup(rc, 1, 0, 1, &res));
+	cache_insert(rc, 5, 0, 1, 5, 0);
+	BUG_ON(cache_lookup(rc, 2, 0, 1, &res));
+	for (k = 3; k <= 5; k++)
+		BUG_ON(!cache_lookup(rc, k, 0, 1, &res) || res.move != k);
+	BUG_ON(!cache_lookup(rc, 1, 0, 1, &res));
+
+	cache_get_stats(rc, &st);
+	BUG_ON(st.hits != 8 || st.misses != 4 || st.evictions != 1 || st.entries != 4);
+	cache_close(rc);
+}
+
+/*
+ * Validate the resumable search finds the same move and score as the
+ * recursive one at every depth, however finely it is sliced. Without a
+ * transposition table, an iteration doesn't depend on the ones before it.
+ */
+static void test_search_task(void)
+{
+	static const char *const fens[] = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		"r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+		"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R b KQkq - 0 1",
+	};
+	struct search_task *s = search_task_alloc(4);
+	struct search_stats want, got;
+	struct chessboard *c;
+	unsigned int i, mv;
+	int depth, color;
+
+	configure_search(NULL, 1, SEARCH_SERIAL);
+	for (i = 0; i < sizeof(fens) / sizeof(*fens); i++) {
+		c = get_fen_board(fens[i]);
+		BUG_ON(!c);
+		color = side_to_move(c);
+
+		for (depth = 1; depth <= 4; depth++) {
+			mv = calculate_move_stats(c, color, depth, &want);
+
+			search_task_start(s, NULL, c, color, depth, ULONG_MAX);
+			while (!search_task_step(s, 100))
+				;
+
+			BUG_ON(search_task_result(s, &got) != mv);
+			BUG_ON(got.score != want.score || got.depth != depth);
+		}
+
+		free(c);
+	}
+
+	search_task_free(s);
+}
+
 static void (*const tests[])(void) = {
 	test_starting_consistency,
+	test_board_header,
+	test_perft,
+	test_position_output,
+	test_pgn,
+	test_static_exchange,
+	test_board_hash,
+	test_nnue,
+	test_batched_heuristic,
+	test_trace,
+	test_time_manager,
+	test_result_cache,
+	test_search_task,
 };
 
 int main(void)
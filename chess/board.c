@@ -17,159 +17,379 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BOARD_X86
+#endif
+
 #include "common.h"
 #include "list.h"
+#include "eval-params.h"
 
 /*
- * Squares on the chess board are represented as an 8x8 matxix of 8-bit
- * integers, each of which is divided into: a 3-bit type, 4-bit ID, and 1-bit
- * color flad. Two pieces of each ID occur on the board (ID is unique including
- * color). Empty squares are zeros.
+ * Squares on the chess board are represented as an array of 64 8-bit piece
+ * codes indexed by (y << 3 | x), each of which is divided into: a 3-bit type
+ * in the low bits, a 4-bit ID, and the color in the top bit. Two pieces of
+ * each ID occur on the board (ID is unique including color). Empty squares
+ * are zeros.
+ *
+ * The current square of each piece on the board is also maintained in an
+ * array indexed by (color << 4 | id), which is just the piece code shifted
+ * right by three. NO_SQUARE is used to represent a captured piece.
+ *
+ * The header holds the side to move, the castling rights, and the en passant
+ * target square (or NO_SQUARE), all of which execute_raw_move() maintains.
  *
- * The current (x,y) position of each piece on the board is also maintained in
- * an array of pairs of 4-bit integers indexed by (color << 4 | id). The (x,y)
- * value (15,15) is used to represent a captured piece.
+ * Everything is naturally sized, so no access needs more than one shift and
+ * mask, and the whole board fits in exactly two cache lines.
  */
 
-struct piece {
-	unsigned char type:3;
-	unsigned char color:1;
-	unsigned char id:4;
-};
+#define NO_SQUARE 0xff
 
-struct position {
-	unsigned char x:4;
-	unsigned char y:4;
-};
+#define CASTLE_WHITE_KING	0x1
+#define CASTLE_WHITE_QUEEN	0x2
+#define CASTLE_BLACK_KING	0x4
+#define CASTLE_BLACK_QUEEN	0x8
 
 struct chessboard {
-	struct piece b[8][8]; /* [y][x] */
-	struct position p[32];
-};
+	unsigned char sq[64];
+	unsigned char pos[32];
+	unsigned char side;
+	unsigned char castling;
+	unsigned char ep;
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct chessboard) == 128,
+	       "struct chessboard must fit in two cache lines");
 
 /*
  * Viewed here as though you are sitting as black looking at the board, so the
  * rows at the top are white's pieces.
  */
 
-#define P(t, c, n) (struct piece){.type = t, .color = c, .id = n, }
-#define B(_x, _y) (struct position){.x = _x, .y = _y, }
+#define P(t, c, n) ((c) << 7 | (n) << 3 | (t))
 
 static const struct chessboard starting_board = {
-	.b = {	{ P(2,0,0x0),P(3,0,0x1),P(4,0,0x2),P(5,0,0x3),P(6,0,0x4),P(4,0,0x5),P(3,0,0x6),P(2,0,0x7) },
-		{ P(1,0,0x8),P(1,0,0x9),P(1,0,0xa),P(1,0,0xb),P(1,0,0xc),P(1,0,0xd),P(1,0,0xe),P(1,0,0xf) },
-		{ P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0) },
-		{ P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0) },
-		{ P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0) },
-		{ P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0),P(0,0,0x0) },
-		{ P(1,1,0x8),P(1,1,0x9),P(1,1,0xa),P(1,1,0xb),P(1,1,0xc),P(1,1,0xd),P(1,1,0xe),P(1,1,0xf) },
-		{ P(2,1,0x0),P(3,1,0x1),P(4,1,0x2),P(5,1,0x3),P(6,1,0x4),P(4,1,0x5),P(3,1,0x6),P(2,1,0x7) }},
-	.p = {	B(0,0),B(1,0),B(2,0),B(3,0),B(4,0),B(5,0),B(6,0),B(7,0),B(0,1),B(1,1),B(2,1),B(3,1),B(4,1),B(5,1),B(6,1),B(7,1),
-		B(0,7),B(1,7),B(2,7),B(3,7),B(4,7),B(5,7),B(6,7),B(7,7),B(0,6),B(1,6),B(2,6),B(3,6),B(4,6),B(5,6),B(6,6),B(7,6)}
+	.sq = {	P(2,0,0x0),P(3,0,0x1),P(4,0,0x2),P(5,0,0x3),P(6,0,0x4),P(4,0,0x5),P(3,0,0x6),P(2,0,0x7),
+		P(1,0,0x8),P(1,0,0x9),P(1,0,0xa),P(1,0,0xb),P(1,0,0xc),P(1,0,0xd),P(1,0,0xe),P(1,0,0xf),
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		P(1,1,0x8),P(1,1,0x9),P(1,1,0xa),P(1,1,0xb),P(1,1,0xc),P(1,1,0xd),P(1,1,0xe),P(1,1,0xf),
+		P(2,1,0x0),P(3,1,0x1),P(4,1,0x2),P(5,1,0x3),P(6,1,0x4),P(4,1,0x5),P(3,1,0x6),P(2,1,0x7) },
+	.pos = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		56, 57, 58, 59, 60, 61, 62, 63, 48, 49, 50, 51, 52, 53, 54, 55},
+	.side = WHITE,
+	.castling = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN |
+		    CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN,
+	.ep = NO_SQUARE,
 };
 
 static const struct chessboard zero_board = {
-	.b = {{0}},
-	.p = {
-		B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),
-		B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),
-		B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),
-		B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),B(15,15),
-		B(15,15),B(15,15),B(15,15),B(15,15),
+	.sq = {0},
+	.pos = {
+		NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE,
+		NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE,
+		NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE,
+		NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE,
+		NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE, NO_SQUARE,
+		NO_SQUARE, NO_SQUARE,
 	},
+	.side = WHITE,
+	.ep = NO_SQUARE,
+};
+
+/*
+ * Moving a piece from or to one of these squares clears these castling rights
+ */
+static const unsigned char castling_lost[64] = {
+	[SQUARE(0, 0)] = CASTLE_WHITE_QUEEN,
+	[SQUARE(4, 0)] = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN,
+	[SQUARE(7, 0)] = CASTLE_WHITE_KING,
+	[SQUARE(0, 7)] = CASTLE_BLACK_QUEEN,
+	[SQUARE(4, 7)] = CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN,
+	[SQUARE(7, 7)] = CASTLE_BLACK_KING,
 };
 
-static int __p_id(enum piece_color color, enum piece_id id)
+static inline int max(int a, int b)
 {
-	return color << 4 | id;
+	return a > b ? a : b;
+}
+
+static inline int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static inline int pc_type(unsigned char p)
+{
+	return p & 7;
+}
+
+static inline int pc_color(unsigned char p)
+{
+	return p >> 7;
 }
 
-static int p_id(struct piece piece)
+static inline int p_id(unsigned char p)
 {
-	return __p_id(piece.color, piece.id);
+	return p >> 3;
 }
 
-static struct piece *__piece(struct chessboard *c, int x, int y)
+static inline int __p_id(enum piece_color color, enum piece_id id)
+{
+	return color << 4 | id;
+}
+
+static inline unsigned char *__piece(struct chessboard *c, int x, int y)
 {
 	BUG_ON(x < 0 || y < 0 || x > 7 || y > 7);
-	return &c->b[y][x];
+	return &c->sq[SQUARE(x, y)];
 }
 
-static struct position *__pos(struct chessboard *c, int nr)
+static inline unsigned char *__pos(struct chessboard *c, int nr)
 {
 	BUG_ON(nr < 0 || nr > 31);
-	return &c->p[nr];
+	return &c->pos[nr];
 }
 
-static struct piece get_piece(struct chessboard *c, int x, int y)
+static inline unsigned char get_piece(struct chessboard *c, int x, int y)
 {
 	return *__piece(c, x, y);
 }
 
-static struct position get_pos(struct chessboard *c, struct piece piece)
+static inline int pos_empty(struct chessboard *c, int x, int y)
 {
-	return *__pos(c, p_id(piece));
+	return !get_piece(c, x, y);
 }
 
-static int pos_empty(struct chessboard *c, int x, int y)
+#define for_each_position(_c, _p) \
+	for (_p = _c->pos; _p != _c->pos + 32; _p++)
+
+/*
+ * Returns (color << 3 | type) for the piece at (x,y), or zero if it's empty.
+ */
+int square_contents(struct chessboard *c, int x, int y)
 {
-	return __piece(c, x, y)->type == EMPTY;
+	unsigned char p = get_piece(c, x, y);
+
+	return pc_color(p) << 3 | pc_type(p);
 }
 
-#define for_each_position(_c, _p) \
-	for (_p = _c->p; _p != _c->p + 32; _p++)
+static void move_piece(struct chessboard *c, int from, int to)
+{
+	unsigned char src = c->sq[from], dst = c->sq[to];
+
+	if (dst)
+		c->pos[p_id(dst)] = NO_SQUARE;
+
+	c->pos[p_id(src)] = to;
+	c->sq[to] = src;
+	c->sq[from] = 0;
+}
+
+enum piece_color side_to_move(const struct chessboard *c)
+{
+	return c->side;
+}
+
+/*
+ * Make a move without checking it is legal: besides moving the piece, this
+ * takes the pawn captured en passant, moves the rook when castling, promotes
+ * pawns reaching the last rank, and updates the header.
+ */
+void execute_raw_move(struct chessboard *c, struct move m)
+{
+	int from = move_from(m), to = move_to(m), cap;
+	unsigned char src = c->sq[from];
+
+	switch (pc_type(src)) {
+	case PAWN:
+		cap = (from & ~7) | (to & 7);
+		if (to == c->ep && cap != from) {
+			BUG_ON(pc_type(c->sq[cap]) != PAWN);
+			c->pos[p_id(c->sq[cap])] = NO_SQUARE;
+			c->sq[cap] = 0;
+		}
+
+		if (to >> 3 == 0 || to >> 3 == 7)
+			c->sq[from] = (src & ~7) | move_promotion(m);
+		break;
+	case KING:
+		if (to - from == 2)
+			move_piece(c, to + 1, to - 1);
+		else if (from - to == 2)
+			move_piece(c, to - 2, to + 1);
+		break;
+	}
+
+	move_piece(c, from, to);
+
+	c->castling &= ~(castling_lost[from] | castling_lost[to]);
+	c->ep = NO_SQUARE;
+	if (pc_type(src) == PAWN && (from ^ to) == 16)
+		c->ep = (from + to) >> 1;
+
+	c->side = !pc_color(src);
+}
+
+/*
+ * ATTACKS
+ *
+ * Attack sets are 32-bit masks indexed by p_id(), computed against a 64-bit
+ * occupancy mask of the squares which block sliding pieces.
+ */
+
+#define SQ_BIT(x, y) (1ULL << ((y) << 3 | (x)))
+#define COLOR_MASK(color) ((color) ? 0xffff0000U : 0x0000ffffU)
+
+static unsigned long long board_occupancy(struct chessboard *c)
+{
+	unsigned long long occ = 0;
+	unsigned char *pos;
+
+	for_each_position(c, pos)
+		if (*pos != NO_SQUARE)
+			occ |= 1ULL << *pos;
+
+	return occ;
+}
+
+static const signed char knight_offsets[8][2] = {
+	{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2},
+};
 
-struct piece_iterator {
-	int off;
+static const signed char ray_offsets[8][2] = {
+	{0, 1}, {0, -1}, {1, 0}, {-1, 0}, /* Orthogonal */
+	{1, 1}, {1, -1}, {-1, 1}, {-1, -1}, /* Diagonal */
 };
 
-const struct piece *iterate_color(struct chessboard *c,
-				  struct piece_iterator **i,
-				  enum piece_color color)
+static unsigned int attackers_to(struct chessboard *c, int x, int y,
+				 unsigned long long occ)
 {
-	if (!*i) {
-		*i = calloc(1, sizeof(**i));
-		if (!*i)
-			fatal("Can't allocate iterator?\n");
+	unsigned int ret = 0;
+	unsigned char p;
+	int i, tx, ty, dist;
+
+	for (i = 0; i < 8; i++) {
+		tx = x + knight_offsets[i][0];
+		ty = y + knight_offsets[i][1];
+		if (tx < 0 || tx > 7 || ty < 0 || ty > 7)
+			continue;
+
+		if (!(occ & SQ_BIT(tx, ty)))
+			continue;
 
-		(*i)->off = color << 4;
+		p = get_piece(c, tx, ty);
+		if (pc_type(p) == KNIGHT)
+			ret |= 1U << p_id(p);
 	}
 
-	while (1) {
-		struct position p;
+	for (i = 0; i < 8; i++) {
+		tx = x;
+		ty = y;
+		dist = 0;
 
-		if ((*i)->off < 0 || (*i)->off > ((signed)(color << 4) + 15))
-			break;
+		while (1) {
+			tx += ray_offsets[i][0];
+			ty += ray_offsets[i][1];
+			dist++;
 
-		p = *__pos(c, (*i)->off++);
-		if (p.x == 15)
+			if (tx < 0 || tx > 7 || ty < 0 || ty > 7)
+				break;
+
+			if (occ & SQ_BIT(tx, ty))
+				break;
+		}
+
+		if (tx < 0 || tx > 7 || ty < 0 || ty > 7)
 			continue;
 
-		return __piece(c, p.x, p.y);
+		p = get_piece(c, tx, ty);
+		switch (pc_type(p)) {
+		case QUEEN:
+			break;
+		case ROOK:
+			if (i >= 4)
+				continue;
+			break;
+		case BISHOP:
+			if (i < 4)
+				continue;
+			break;
+		case KING:
+			if (dist != 1)
+				continue;
+			break;
+		case PAWN:
+			/* White pawns attack upwards, black pawns downwards */
+			if (dist != 1 || i < 4)
+				continue;
+			if (ray_offsets[i][1] != (pc_color(p) == WHITE ? -1 : 1))
+				continue;
+			break;
+		default:
+			continue;
+		}
 
+		ret |= 1U << p_id(p);
 	}
 
-	free(*i);
-	return NULL;
+	return ret;
 }
 
-void execute_raw_move(struct chessboard *c, struct move m)
+static int square_attacked(struct chessboard *c, int x, int y,
+			   enum piece_color by)
 {
-	struct piece dst, src;
+	return !!(attackers_to(c, x, y, board_occupancy(c)) & COLOR_MASK(by));
+}
 
-	dst = get_piece(c, m.dx, m.dy);
-	if (dst.type != EMPTY)
-		*__pos(c, p_id(dst)) = B(15, 15);
+/*
+ * Returns nonzero if the king of @color is attacked. Boards without one, as in
+ * some of the tests, are never in check.
+ */
+int in_check(struct chessboard *c, enum piece_color color)
+{
+	int sq = c->pos[__p_id(color, K_KING)];
 
-	src = get_piece(c, m.sx, m.sy);
-	*__pos(c, p_id(src)) = B(m.dx, m.dy);
+	if (sq == NO_SQUARE)
+		return 0;
 
-	*__piece(c, m.dx, m.dy) = src;
-	*__piece(c, m.sx, m.sy) = P(0, 0, 0x0);
+	return square_attacked(c, sq & 7, sq >> 3, !color);
+}
+
+/*
+ * The castling rights are cleared whenever the king or rook involved moves or
+ * the rook is captured, so if the right is held both are on their starting
+ * squares. Castling to (@dx,y) also requires the squares between them to be
+ * empty, and the king must not be in check or pass through or land on an
+ * attacked square.
+ */
+static int can_castle(struct chessboard *c, enum piece_color color, int dx)
+{
+	int x, y = color == WHITE ? 0 : 7;
+	int lo = dx == 6 ? 5 : 1, hi = dx == 6 ? 6 : 3;
+	unsigned int right;
+
+	right = (dx == 6 ? CASTLE_WHITE_KING : CASTLE_WHITE_QUEEN) << (color << 1);
+	if (!(c->castling & right))
+		return 0;
+
+	for (x = lo; x <= hi; x++)
+		if (!pos_empty(c, x, y))
+			return 0;
+
+	for (x = min(dx, 4); x <= max(dx, 4); x++)
+		if (square_attacked(c, x, y, !color))
+			return 0;
+
+	return 1;
 }
 
 /*
@@ -190,7 +410,7 @@ static int validate_pawn_move(struct chessboard *c, int sx, int sy, int dx, int
 	/*
 	 * Black pawn, or white pawn?
 	 */
-	if (get_piece(c, sx, sy).color == WHITE) {
+	if (pc_color(get_piece(c, sx, sy)) == WHITE) {
 		dist = dy - sy;
 		starting_rank = 1;
 		direction = 1;
@@ -235,8 +455,8 @@ static int validate_pawn_move(struct chessboard *c, int sx, int sy, int dx, int
 		if (dx != (sx + 1) && dx != (sx - 1))
 			return -EINVAL;
 
-		/* Pawns can only move diagonally to capture */
-		if (pos_empty(c, dx, dy))
+		/* Pawns can only move diagonally to capture, or en passant */
+		if (pos_empty(c, dx, dy) && SQUARE(dx, dy) != c->ep)
 			return -EINVAL;
 
 		return 0;
@@ -313,13 +533,21 @@ static int validate_queen_move(struct chessboard *c, int sx, int sy, int dx, int
 	return -EEXIST;
 }
 
-static int validate_king_move(struct chessboard *c __unused, int sx, int sy, int dx, int dy)
+static int validate_king_move(struct chessboard *c, int sx, int sy, int dx, int dy)
 {
 	int mvx, mvy;
 
 	mvx = dx - sx;
 	mvy = dy - sy;
 
+	/* Castling is the only way the king can move two files */
+	if (abs(mvx) == 2 && mvy == 0 && sx == 4) {
+		if (!can_castle(c, pc_color(get_piece(c, sx, sy)), dx))
+			return -EINVAL;
+
+		return 0;
+	}
+
 	if (!(abs(mvx) <= 1 && abs(mvy) <= 1))
 		return -EINVAL;
 
@@ -341,51 +569,39 @@ static int (*const val_funcs[8])(struct chessboard *, int, int, int, int) = {
  * Execute a chess move. Returns 0 if successful, a negative error code if not.
  */
 
-static int do_execute_move(struct chessboard *c, struct move m)
+int execute_move(struct chessboard *c, int sx, int sy, int dx, int dy)
 {
-	struct piece sp, tmp;
+	unsigned char sp, tmp;
 	int v;
 
 	/* Cannot move a piece off the board */
-	if (m.sx > 7 || m.sy > 7 || m.dx > 7 || m.dy > 7)
+	if ((unsigned)sx > 7 || (unsigned)sy > 7 || (unsigned)dx > 7 || (unsigned)dy > 7)
 		return -ERANGE;
 
 	/* Cannot move piece to it's current location */
-	if ((m.sx == m.dx) && (m.sy == m.dy))
+	if ((sx == dx) && (sy == dy))
 		return -EFAULT;
 
 	/* The piece we are moving must exist */
-	sp = get_piece(c, m.sx, m.sy);
-	if (sp.type == EMPTY)
+	sp = get_piece(c, sx, sy);
+	if (pc_type(sp) == EMPTY)
 		return -ENOENT;
 
 	/* Make sure the move is legal for this particular piece */
-	v = (*val_funcs[sp.type])(c, m.sx, m.sy, m.dx, m.dy);
+	v = (*val_funcs[pc_type(sp)])(c, sx, sy, dx, dy);
 	if (v)
 		return v;
 
 	/* Cannot capture pieces of the same color */
-	tmp = get_piece(c, m.dx, m.dy);
-	if (tmp.type != EMPTY && !(tmp.color ^ sp.color))
+	tmp = get_piece(c, dx, dy);
+	if (pc_type(tmp) != EMPTY && !(pc_color(tmp) ^ pc_color(sp)))
 		return -EACCES;
 
 	/* Move is valid, do it */
-	execute_raw_move(c, m);
+	execute_raw_move(c, new_move(sx, sy, dx, dy));
 	return 0;
 }
 
-int execute_move(struct chessboard *c, int sx, int sy, int dx, int dy)
-{
-	struct move m = {
-		.sx = sx,
-		.sy = sy,
-		.dx = dx,
-		.dy = dy,
-	};
-
-	return do_execute_move(c, m);
-}
-
 /*
  * ENUMERATION FUNCTIONS
  *
@@ -401,11 +617,28 @@ int execute_move(struct chessboard *c, int sx, int sy, int dx, int dy)
  * These are much less elegant than the validation functions. Oh well...
  */
 
+/*
+ * Pawns can never stand on the last rank, so moving to it always promotes.
+ * The queen goes first, since it's almost always the best choice.
+ */
+static void push_pawn_move(struct move_list *l, int sx, int sy, int dx, int dy)
+{
+	if (dy != 0 && dy != 7) {
+		push_move(l, sx, sy, dx, dy);
+		return;
+	}
+
+	l->m[l->n++] = new_promotion(sx, sy, dx, dy, QUEEN);
+	l->m[l->n++] = new_promotion(sx, sy, dx, dy, KNIGHT);
+	l->m[l->n++] = new_promotion(sx, sy, dx, dy, ROOK);
+	l->m[l->n++] = new_promotion(sx, sy, dx, dy, BISHOP);
+}
+
 static void enumerate_pawn_moves(struct chessboard *c, int sx, int sy, struct move_list *l)
 {
 	int color, ending_rank, starting_rank, direction;
 
-	if (get_piece(c, sx, sy).color == WHITE) {
+	if (pc_color(get_piece(c, sx, sy)) == WHITE) {
 		ending_rank = 7;
 		starting_rank = 1;
 		direction = 1;
@@ -417,26 +650,31 @@ static void enumerate_pawn_moves(struct chessboard *c, int sx, int sy, struct mo
 		color = 1;
 	}
 
-	if (sy != ending_rank && pos_empty(c, sx, sy + direction))
-		push_move(l, sx, sy, sx, sy + direction);
+	if (sy != ending_rank && pos_empty(c, sx, sy + direction)) {
+		push_pawn_move(l, sx, sy, sx, sy + direction);
 
-	if (sy == starting_rank && pos_empty(c, sx, sy + direction + direction))
-		push_move(l, sx, sy, sx, sy + direction + direction);
+		if (sy == starting_rank && pos_empty(c, sx, sy + direction + direction))
+			push_move(l, sx, sy, sx, sy + direction + direction);
+	}
 
 	if (sx != 0 && sy != ending_rank)
-		if (!pos_empty(c, sx - 1, sy + direction) && color ^ get_piece(c, sx - 1, sy + direction).color)
-			push_move(l, sx, sy, sx - 1, sy + direction);
+		if (!pos_empty(c, sx - 1, sy + direction) && color ^ pc_color(get_piece(c, sx - 1, sy + direction)))
+			push_pawn_move(l, sx, sy, sx - 1, sy + direction);
 
 	if (sx != 7 && sy != ending_rank)
-		if (!pos_empty(c, sx + 1, sy + direction) && color ^ get_piece(c, sx + 1, sy + direction).color)
-			push_move(l, sx, sy, sx + 1, sy + direction);
+		if (!pos_empty(c, sx + 1, sy + direction) && color ^ pc_color(get_piece(c, sx + 1, sy + direction)))
+			push_pawn_move(l, sx, sy, sx + 1, sy + direction);
+
+	/* The en passant square is the one the pawn skipped over */
+	if (c->ep != NO_SQUARE && c->ep >> 3 == sy + direction && abs((c->ep & 7) - sx) == 1)
+		push_move(l, sx, sy, c->ep & 7, sy + direction);
 }
 
 static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct move_list *l)
 {
 	int tdx, tdy, color;
 
-	color = get_piece(c, sx, sy).color;
+	color = pc_color(get_piece(c, sx, sy));
 
 	/* Walk North */
 	tdy = sy;
@@ -444,7 +682,7 @@ static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct mo
 		if (pos_empty(c, sx, tdy)) {
 			push_move(l, sx, sy, sx, tdy);
 		} else {
-			if (get_piece(c, sx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, sx, tdy)) ^ color) {
 				push_move(l, sx, sy, sx, tdy);
 			}
 
@@ -458,7 +696,7 @@ static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct mo
 		if (pos_empty(c, sx, tdy)) {
 			push_move(l, sx, sy, sx, tdy);
 		} else {
-			if (get_piece(c, sx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, sx, tdy)) ^ color) {
 				push_move(l, sx, sy, sx, tdy);
 			}
 
@@ -472,7 +710,7 @@ static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct mo
 		if (pos_empty(c, tdx, sy)) {
 			push_move(l, sx, sy, tdx, sy);
 		} else {
-			if (get_piece(c, tdx, sy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, sy)) ^ color) {
 				push_move(l, sx, sy, tdx, sy);
 			}
 
@@ -486,7 +724,7 @@ static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct mo
 		if (pos_empty(c, tdx, sy)) {
 			push_move(l, sx, sy, tdx, sy);
 		} else {
-			if (get_piece(c, tdx, sy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, sy)) ^ color) {
 				push_move(l, sx, sy, tdx, sy);
 			}
 
@@ -497,56 +735,56 @@ static void enumerate_rook_moves(struct chessboard *c, int sx, int sy, struct mo
 
 static void enumerate_knight_moves(struct chessboard *c, int sx, int sy, struct move_list *l)
 {
-	struct piece tmp;
+	unsigned char tmp;
 	int color;
 
-	color = get_piece(c, sx, sy).color;
+	color = pc_color(get_piece(c, sx, sy));
 
 	if (sx <= 6 && sy <= 5) {
 		tmp = get_piece(c, sx + 1, sy + 2);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx + 1, sy + 2);
 	}
 
 	if (sx <= 5 && sy <= 6) {
 		tmp = get_piece(c, sx + 2, sy + 1);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx + 2, sy + 1);
 	}
 
 	if (sx <= 5 && sy >= 1) {
 		tmp = get_piece(c, sx + 2, sy - 1);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx + 2, sy - 1);
 	}
 
 	if (sx <= 6 && sy >= 2) {
 		tmp = get_piece(c, sx + 1, sy - 2);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx + 1, sy - 2);
 	}
 
 	if (sx >= 1 && sy >= 2) {
 		tmp = get_piece(c, sx - 1, sy - 2);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx - 1, sy - 2);
 	}
 
 	if (sx >= 2 && sy >= 1) {
 		tmp = get_piece(c, sx - 2, sy - 1);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx - 2, sy - 1);
 	}
 
 	if (sx >= 2 && sy <= 6) {
 		tmp = get_piece(c, sx - 2, sy + 1);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx - 2, sy + 1);
 	}
 
 	if (sx >= 1 && sy <= 5) {
 		tmp = get_piece(c, sx - 1, sy + 2);
-		if (tmp.type == EMPTY || tmp.color ^ color)
+		if (pc_type(tmp) == EMPTY || pc_color(tmp) ^ color)
 			push_move(l, sx, sy, sx - 1, sy + 2);
 	}
 }
@@ -555,7 +793,7 @@ static void enumerate_bishop_moves(struct chessboard *c, int sx, int sy, struct
 {
 	int tdx, tdy, color;
 
-	color = get_piece(c, sx, sy).color;
+	color = pc_color(get_piece(c, sx, sy));
 
 	/* Walk Northeast */
 	tdx = sx;
@@ -564,7 +802,7 @@ static void enumerate_bishop_moves(struct chessboard *c, int sx, int sy, struct
 		if (pos_empty(c, tdx, tdy)) {
 			push_move(l, sx, sy, tdx, tdy);
 		} else {
-			if (get_piece(c, tdx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, tdy)) ^ color) {
 				push_move(l, sx, sy, tdx, tdy);
 			}
 
@@ -579,7 +817,7 @@ static void enumerate_bishop_moves(struct chessboard *c, int sx, int sy, struct
 		if (pos_empty(c, tdx, tdy)) {
 			push_move(l, sx, sy, tdx, tdy);
 		} else {
-			if (get_piece(c, tdx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, tdy)) ^ color) {
 				push_move(l, sx, sy, tdx, tdy);
 			}
 
@@ -594,7 +832,7 @@ static void enumerate_bishop_moves(struct chessboard *c, int sx, int sy, struct
 		if (pos_empty(c, tdx, tdy)) {
 			push_move(l, sx, sy, tdx, tdy);
 		} else {
-			if (get_piece(c, tdx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, tdy)) ^ color) {
 				push_move(l, sx, sy, tdx, tdy);
 			}
 
@@ -609,7 +847,7 @@ static void enumerate_bishop_moves(struct chessboard *c, int sx, int sy, struct
 		if (pos_empty(c, tdx, tdy)) {
 			push_move(l, sx, sy, tdx, tdy);
 		} else {
-			if (get_piece(c, tdx, tdy).color ^ color) {
+			if (pc_color(get_piece(c, tdx, tdy)) ^ color) {
 				push_move(l, sx, sy, tdx, tdy);
 			}
 
@@ -627,15 +865,15 @@ static void enumerate_queen_moves(struct chessboard *c, int sx, int sy, struct m
 /* This one is extra shitty */
 static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct move_list *l)
 {
-	struct piece tmp;
+	unsigned char tmp;
 	int color;
 
-	color = get_piece(c, sx, sy).color;
+	color = pc_color(get_piece(c, sx, sy));
 
 	if (sx != 0) {
 		tmp = get_piece(c, sx - 1, sy);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx - 1, sy);
 			}
 		} else {
@@ -645,8 +883,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sx != 7) {
 		tmp = get_piece(c, sx + 1, sy);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx + 1, sy);
 			}
 		} else {
@@ -656,8 +894,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sy != 0) {
 		tmp = get_piece(c, sx, sy - 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx, sy - 1);
 			}
 		} else {
@@ -667,8 +905,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sy != 7) {
 		tmp = get_piece(c, sx, sy + 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx, sy + 1);
 			}
 		} else {
@@ -678,8 +916,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sx != 7 && sy != 7) {
 		tmp = get_piece(c, sx + 1, sy + 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx + 1, sy + 1);
 			}
 		} else {
@@ -689,8 +927,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sx != 7 && sy != 0) {
 		tmp = get_piece(c, sx + 1, sy - 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx + 1, sy - 1);
 			}
 		} else {
@@ -700,8 +938,8 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sx != 0 && sy != 7) {
 		tmp = get_piece(c, sx - 1, sy + 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx - 1, sy + 1);
 			}
 		} else {
@@ -711,14 +949,20 @@ static void enumerate_king_moves(struct chessboard *c, int sx, int sy, struct mo
 
 	if (sx != 0 && sy != 0) {
 		tmp = get_piece(c, sx - 1, sy - 1);
-		if (tmp.type != EMPTY) {
-			if (tmp.color ^ color) {
+		if (pc_type(tmp) != EMPTY) {
+			if (pc_color(tmp) ^ color) {
 				push_move(l, sx, sy, sx - 1, sy - 1);
 			}
 		} else {
 			push_move(l, sx, sy, sx - 1, sy - 1);
 		}
 	}
+
+	if (sx == 4 && can_castle(c, color, 6))
+		push_move(l, sx, sy, 6, sy);
+
+	if (sx == 4 && can_castle(c, color, 2))
+		push_move(l, sx, sy, 2, sy);
 }
 
 static void enumerate_empty(struct chessboard *c __unused, int sx, int sy,
@@ -745,22 +989,69 @@ static void (*const enum_funcs[8])(struct chessboard *, int, int, struct move_li
 };
 
 /*
- * Enumerate all possible moves for a given piece. The piece_number must includ
- * the color bit.
+ * Enumerate all possible moves for every piece of the given color, in the
+ * order of the pieces' IDs, appending them to @l. Returns the length of @l.
  */
-int enumerate_moves(struct chessboard *c, const struct piece *piece,
+int enumerate_moves(struct chessboard *c, enum piece_color color,
 		    struct move_list *l)
 {
-	struct position pos;
+	unsigned char *pos;
+	int sq;
+
+	for (pos = &c->pos[color << 4]; pos != &c->pos[(color << 4) + 16]; pos++) {
+		sq = *pos;
+		if (sq == NO_SQUARE)
+			continue;
+
+		(*enum_funcs[pc_type(c->sq[sq])])(c, sq & 7, sq >> 3, l);
+	}
 
-	pos = get_pos(c, *piece);
-	(*enum_funcs[piece->type])(c, pos.x, pos.y, l);
-	return move_list_length(l);
+	return l->n;
+}
+
+/*
+ * Count the leaf nodes of the tree of legal moves @depth plies deep, starting
+ * with the side to move. Comparing this against published results for a few
+ * positions validates the move generator, and it makes a fair benchmark too.
+ */
+unsigned long long perft(struct chessboard *c, int depth)
+{
+	unsigned long long ret = 0;
+	struct chessboard tmp;
+	struct move_list l;
+	int i;
+
+	if (depth == 0)
+		return 1;
+
+	l.n = 0;
+	enumerate_moves(c, c->side, &l);
+
+	for (i = 0; i < l.n; i++) {
+		tmp = *c;
+		execute_raw_move(&tmp, l.m[i]);
+		if (in_check(&tmp, c->side))
+			continue;
+
+		ret += perft(&tmp, depth - 1);
+	}
+
+	return ret;
+}
+
+void copy_board_into(struct chessboard *dst, const struct chessboard *src)
+{
+	memcpy(dst, src, sizeof(*dst));
+}
+
+size_t board_size(void)
+{
+	return sizeof(struct chessboard);
 }
 
 struct chessboard *copy_board(const struct chessboard *c)
 {
-	void *ret = malloc(sizeof(struct chessboard));
+	void *ret = aligned_alloc(64, sizeof(struct chessboard));
 
 	if (!ret)
 		fatal("-ENOMEM allocating chessboard struct\n");
@@ -779,33 +1070,563 @@ struct chessboard *get_zero_board(void)
 	return copy_board(&zero_board);
 }
 
+/*
+ * FEN PARSING
+ *
+ * Pieces are given the IDs they'd have on the starting board where possible,
+ * but anything can go in any free slot, except that only a king can have the
+ * king's ID. That leaves room for all fifteen other pieces of each color,
+ * however many pawns have been promoted.
+ */
+
+static int fen_piece_id(unsigned int used, enum piece_type type)
+{
+	unsigned int avail = ~used & 0xffff & ~(1U << K_KING);
+
+	if (type == KING)
+		return used & (1U << K_KING) ? -1 : K_KING;
+
+	if (type == PAWN && (avail & 0xff00))
+		avail &= 0xff00;
+
+	return avail ? __builtin_ctz(avail) : -1;
+}
+
+static int fen_castling_ok(struct chessboard *c, int right)
+{
+	int color = right & (CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN) ? BLACK : WHITE;
+	int y = color == WHITE ? 0 : 7;
+	int x = right & (CASTLE_WHITE_KING | CASTLE_BLACK_KING) ? 7 : 0;
+
+	return get_piece(c, 4, y) == P(KING, color, K_KING) &&
+	       pc_type(get_piece(c, x, y)) == ROOK &&
+	       pc_color(get_piece(c, x, y)) == color;
+}
+
+/*
+ * Returns a new board set up from the placement, side to move, castling, and
+ * en passant fields of @fen (the move counters are ignored), or NULL if it
+ * can't be parsed.
+ */
+struct chessboard *get_fen_board(const char *fen)
+{
+	static const char types[] = "?prnbqk";
+	static const char rights[] = "KQkq";
+	struct chessboard *c = get_zero_board();
+	unsigned int used[2] = {0, 0};
+	int x = 0, y = 7, color, type, id;
+	const char *p;
+
+	for (; *fen && *fen != ' '; fen++) {
+		if (*fen == '/') {
+			if (x != 8 || y == 0)
+				goto err;
+
+			x = 0;
+			y--;
+		} else if (*fen >= '1' && *fen <= '8') {
+			x += *fen - '0';
+			if (x > 8)
+				goto err;
+		} else {
+			p = strchr(types + 1, tolower(*fen));
+			if (!p || x > 7)
+				goto err;
+
+			type = p - types;
+			color = islower(*fen) ? BLACK : WHITE;
+			id = fen_piece_id(used[color], type);
+			if (id < 0)
+				goto err;
+
+			used[color] |= 1U << id;
+			*__piece(c, x, y) = P(type, color, id);
+			*__pos(c, __p_id(color, id)) = SQUARE(x, y);
+			x++;
+		}
+	}
+
+	if (x != 8 || y != 0 || !(used[WHITE] & used[BLACK] & (1U << K_KING)))
+		goto err;
+
+	if (fen[0] != ' ' || (fen[1] != 'w' && fen[1] != 'b'))
+		goto err;
+
+	c->side = fen[1] == 'w' ? WHITE : BLACK;
+	fen += 2;
+
+	if (*fen++ != ' ')
+		goto err;
+
+	if (*fen == '-') {
+		fen++;
+	} else {
+		for (; *fen && *fen != ' '; fen++) {
+			p = strchr(rights, *fen);
+			if (!p)
+				goto err;
+
+			/* Quietly drop rights the pieces aren't in place for */
+			if (fen_castling_ok(c, 1 << (p - rights)))
+				c->castling |= 1 << (p - rights);
+		}
+	}
+
+	if (*fen++ != ' ')
+		goto err;
+
+	if (*fen != '-') {
+		if (fen[0] < 'a' || fen[0] > 'h' || (fen[1] != '3' && fen[1] != '6'))
+			goto err;
+
+		c->ep = SQUARE(fen[0] - 'a', fen[1] - '1');
+	}
+
+	return c;
+
+err:
+	free(c);
+	return NULL;
+}
+
+/*
+ * Write the placement, side to move, castling, and en passant fields of the
+ * FEN for @c into @buf, which must hold at least EPD_MAX bytes. The en passant
+ * square is given after every double pawn push, as the FEN standard has it.
+ * Returns the length of the string.
+ */
+int board_epd(const struct chessboard *c, char *buf)
+{
+	static const char types[2][8] = {"?PRNBQK?", "?prnbqk?"};
+	static const char rights[] = "KQkq";
+	char *p = buf;
+	int x, y, i, empty;
+
+	for (y = 7; y >= 0; y--) {
+		empty = 0;
+		for (x = 0; x < 8; x++) {
+			unsigned char pc = c->sq[SQUARE(x, y)];
+
+			if (!pc) {
+				empty++;
+				continue;
+			}
+
+			if (empty)
+				*p++ = '0' + empty;
+
+			*p++ = types[pc_color(pc)][pc_type(pc)];
+			empty = 0;
+		}
+
+		if (empty)
+			*p++ = '0' + empty;
+
+		if (y)
+			*p++ = '/';
+	}
+
+	*p++ = ' ';
+	*p++ = c->side == WHITE ? 'w' : 'b';
+	*p++ = ' ';
+
+	if (!c->castling)
+		*p++ = '-';
+
+	for (i = 0; i < 4; i++)
+		if (c->castling & (1 << i))
+			*p++ = rights[i];
+
+	*p++ = ' ';
+	if (c->ep == NO_SQUARE) {
+		*p++ = '-';
+	} else {
+		*p++ = 'a' + (c->ep & 7);
+		*p++ = '1' + (c->ep >> 3);
+	}
+
+	*p = '\0';
+	return p - buf;
+}
+
+/*
+ * PACKED POSITIONS
+ *
+ * Squares are packed two to a byte, the even square in the low nibble, each as
+ * color << 3 | type. Piece IDs aren't kept, so unpacking hands them out the
+ * same way FEN parsing does: a position round trips exactly if it came from a
+ * FEN, and is otherwise the same position with the pieces renamed.
+ */
+
+void pack_board(const struct chessboard *c, struct packed_position *p)
+{
+	int i;
+
+	memset(p, 0, sizeof(*p));
+	for (i = 0; i < 64; i++) {
+		unsigned char pc = c->sq[i];
+
+		if (pc)
+			p->sq[i >> 1] |= (pc_color(pc) << 3 | pc_type(pc)) << ((i & 1) << 2);
+	}
+
+	p->flags = c->side << 7 | c->castling;
+	p->ep = c->ep;
+	p->result = PACKED_NO_RESULT;
+}
+
+/*
+ * Returns a new board for @p, or NULL if it doesn't hold a valid position.
+ */
+struct chessboard *unpack_board(const struct packed_position *p)
+{
+	struct chessboard *c = get_zero_board();
+	unsigned int used[2] = {0, 0};
+	int x, y, v, color, type, id;
+
+	/* Same order as FEN parsing, so the IDs come out the same */
+	for (y = 7; y >= 0; y--) {
+		for (x = 0; x < 8; x++) {
+			v = p->sq[SQUARE(x, y) >> 1] >> ((x & 1) << 2) & 15;
+			if (!v)
+				continue;
+
+			color = v >> 3;
+			type = v & 7;
+			if (type == EMPTY || type > KING)
+				goto err;
+
+			id = fen_piece_id(used[color], type);
+			if (id < 0)
+				goto err;
+
+			used[color] |= 1U << id;
+			*__piece(c, x, y) = P(type, color, id);
+			*__pos(c, __p_id(color, id)) = SQUARE(x, y);
+		}
+	}
+
+	if (!(used[WHITE] & used[BLACK] & (1U << K_KING)))
+		goto err;
+
+	if (p->ep != NO_SQUARE && (p->ep > 63 || (p->ep >> 3 != 2 && p->ep >> 3 != 5)))
+		goto err;
+
+	c->side = p->flags >> 7;
+	c->castling = p->flags & 15;
+	c->ep = p->ep;
+	return c;
+
+err:
+	free(c);
+	return NULL;
+}
+
+/*
+ * ZOBRIST HASHING
+ *
+ * The keys are generated from a fixed seed, so hashes are stable between runs
+ * and can be saved to disk along with the transposition table.
+ */
+
+static unsigned long long zobrist_keys[2][8][64];
+static unsigned long long zobrist_black_to_move;
+static unsigned long long zobrist_castling[16];
+static unsigned long long zobrist_ep[8];
+
+static unsigned long long splitmix64(unsigned long long *state)
+{
+	unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void __attribute__((constructor)) init_zobrist_keys(void)
+{
+	unsigned long long state = 0x636865737321ULL;
+	int i, j, k;
+
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 8; j++)
+			for (k = 0; k < 64; k++)
+				zobrist_keys[i][j][k] = splitmix64(&state);
+
+	zobrist_black_to_move = splitmix64(&state);
+
+	for (i = 1; i < 16; i++)
+		zobrist_castling[i] = splitmix64(&state);
+
+	for (i = 0; i < 8; i++)
+		zobrist_ep[i] = splitmix64(&state);
+}
+
+unsigned long long board_hash(struct chessboard *c, enum piece_color color)
+{
+	unsigned long long ret = color == BLACK ? zobrist_black_to_move : 0;
+	unsigned char *pos, piece;
+
+	for_each_position(c, pos) {
+		if (*pos == NO_SQUARE)
+			continue;
+
+		piece = c->sq[*pos];
+		ret ^= zobrist_keys[pc_color(piece)][pc_type(piece)][*pos];
+	}
+
+	ret ^= zobrist_castling[c->castling];
+	if (c->ep != NO_SQUARE)
+		ret ^= zobrist_ep[c->ep & 7];
+
+	return ret;
+}
+
 /*
  * Always returns a heuristic such that higher is better for white and lower is
- * better for black.
+ * better for black. The piece values come from eval-params.h.
  */
-static const int piece_values[8] = {0, 12, 60, 36, 36, 108, 240, 0};
 
 int calculate_board_heuristic(struct chessboard *c)
 {
-	struct position *pos;
-	struct piece piece;
+	unsigned char *pos, piece;
 	int white_h = 0;
 	int black_h = 0;
 
 	for_each_position(c, pos) {
-		if (pos->x == 15)
+		if (*pos == NO_SQUARE)
 			continue;
 
-		piece = get_piece(c, pos->x, pos->y);
-		if (piece.color == WHITE)
-			white_h += piece_values[piece.type];
+		piece = c->sq[*pos];
+		if (pc_color(piece) == WHITE)
+			white_h += piece_values[pc_type(piece)];
 		else
-			black_h += piece_values[piece.type];
+			black_h += piece_values[pc_type(piece)];
 	}
 
 	return white_h - black_h;
 }
 
+/*
+ * BATCHED EVALUATION
+ *
+ * Evaluate @n boards at once, storing the results in @scores. The boards are
+ * first transposed into a structure-of-arrays layout, with one row per piece
+ * slot in the position array and one column per board, holding the type of
+ * that piece on that board (or zero if it has been captured). The first 16
+ * rows are white's pieces, the rest are black's.
+ *
+ * That lets us score sixteen boards per instruction: all the piece values fit
+ * in a byte, so pshufb can look up a whole row of types at once, and then
+ * it's just a matter of summing the rows as 16-bit integers.
+ */
+
+static unsigned char (*transpose_boards(struct chessboard *const *c, int n))[HEURISTIC_BATCH]
+{
+	static __thread unsigned char types[32][HEURISTIC_BATCH] __attribute__((aligned(16)));
+	int i, k, sq;
+
+	BUG_ON(n > HEURISTIC_BATCH);
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < 32; k++) {
+			sq = c[i]->pos[k];
+			types[k][i] = sq == NO_SQUARE ? EMPTY : pc_type(c[i]->sq[sq]);
+		}
+	}
+
+	/* Pad out the last vector so it doesn't contain garbage */
+	for (k = 0; k < 32; k++)
+		memset(&types[k][n], 0, (-n & 15));
+
+	return types;
+}
+
+static void material_scalar(unsigned char (*types)[HEURISTIC_BATCH], int n, int *scores)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		scores[i] = 0;
+		for (k = 0; k < 16; k++)
+			scores[i] += piece_values[types[k][i]];
+		for (k = 16; k < 32; k++)
+			scores[i] -= piece_values[types[k][i]];
+	}
+}
+
+#ifdef BOARD_X86
+
+__attribute__((target("ssse3")))
+static void material_ssse3(unsigned char (*types)[HEURISTIC_BATCH], int n, int *scores)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i tbl, v, lo, hi, w[2], b[2];
+	unsigned char bytes[16] = {0};
+	int i, k;
+
+	for (k = 0; k < 8; k++)
+		bytes[k] = piece_values[k];
+
+	tbl = _mm_loadu_si128((const __m128i *)bytes);
+
+	for (i = 0; i < n; i += 16) {
+		w[0] = w[1] = b[0] = b[1] = zero;
+
+		for (k = 0; k < 32; k++) {
+			v = _mm_load_si128((const __m128i *)&types[k][i]);
+			v = _mm_shuffle_epi8(tbl, v);
+			lo = _mm_unpacklo_epi8(v, zero);
+			hi = _mm_unpackhi_epi8(v, zero);
+
+			if (k < 16) {
+				w[0] = _mm_add_epi16(w[0], lo);
+				w[1] = _mm_add_epi16(w[1], hi);
+			} else {
+				b[0] = _mm_add_epi16(b[0], lo);
+				b[1] = _mm_add_epi16(b[1], hi);
+			}
+		}
+
+		lo = _mm_sub_epi16(w[0], b[0]);
+		hi = _mm_sub_epi16(w[1], b[1]);
+
+		/* Sign extend to 32 bits: the batch is padded, so this is safe */
+		_mm_storeu_si128((__m128i *)&scores[i + 0], _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16));
+		_mm_storeu_si128((__m128i *)&scores[i + 4], _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16));
+		_mm_storeu_si128((__m128i *)&scores[i + 8], _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+		_mm_storeu_si128((__m128i *)&scores[i + 12], _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16));
+	}
+}
+
+static int use_ssse3(void)
+{
+	int k;
+
+	/* The lookup table is bytes, and sixteen kings must fit in a short */
+	for (k = 0; k < 8; k++)
+		if (piece_values[k] < 0 || piece_values[k] > 255)
+			return 0;
+
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+#endif
+
+/*
+ * @scores must have room for @n rounded up to a multiple of 16.
+ */
+void calculate_board_heuristics(struct chessboard *const *c, int n, int *scores)
+{
+	unsigned char (*types)[HEURISTIC_BATCH] = transpose_boards(c, n);
+
+#ifdef BOARD_X86
+	static int ssse3 = -1;
+
+	if (__atomic_load_n(&ssse3, __ATOMIC_RELAXED) == -1)
+		__atomic_store_n(&ssse3, use_ssse3(), __ATOMIC_RELAXED);
+
+	if (ssse3) {
+		material_ssse3(types, n, scores);
+		return;
+	}
+#endif
+
+	material_scalar(types, n, scores);
+}
+
+/*
+ * STATIC EXCHANGE EVALUATION
+ *
+ * Resolve the entire sequence of captures on a single square, assuming each
+ * side always recaptures with its least valuable attacker and may stop
+ * capturing whenever continuing would lose material. The result is the net
+ * material gain (in piece_values[] units) for the side making the move.
+ *
+ * Pieces are "lifted" off the board by clearing their bit in the occupancy
+ * passed to attackers_to(), which naturally uncovers x-ray attackers behind
+ * them.
+ */
+
+static int least_valuable(struct chessboard *c, unsigned int set)
+{
+	int nr, v, ret = -1, best = INT_MAX;
+
+	while (set) {
+		nr = __builtin_ctz(set);
+		set &= set - 1;
+
+		v = piece_values[pc_type(c->sq[*__pos(c, nr)])];
+		if (v < best) {
+			best = v;
+			ret = nr;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * A pawn moving diagonally onto the en passant square captures the pawn beside
+ * it, even though the square it lands on is empty.
+ */
+static int is_en_passant(struct chessboard *c, struct move m)
+{
+	return move_to(m) == c->ep && pc_type(c->sq[move_from(m)]) == PAWN &&
+	       (move_from(m) & 7) != (move_to(m) & 7);
+}
+
+int move_is_capture(struct chessboard *c, struct move m)
+{
+	return c->sq[move_to(m)] != 0 || is_en_passant(c, m);
+}
+
+int static_exchange_eval(struct chessboard *c, struct move m)
+{
+	int gain[32], d = 0, nr, color, sq, dx = move_dx(m), dy = move_dy(m);
+	unsigned long long occ;
+	unsigned int attackers, side;
+	unsigned char p;
+
+	p = c->sq[move_from(m)];
+	color = pc_color(p);
+
+	gain[0] = piece_values[pc_type(c->sq[move_to(m)])];
+	occ = board_occupancy(c) & ~(1ULL << move_from(m));
+	if (is_en_passant(c, m)) {
+		gain[0] = piece_values[PAWN];
+		occ &= ~(1ULL << ((move_from(m) & ~7) | (move_to(m) & 7)));
+	}
+	attackers = attackers_to(c, dx, dy, occ);
+
+	while (1) {
+		/* Speculatively assume the piece on the square is recaptured */
+		d++;
+		gain[d] = piece_values[pc_type(p)] - gain[d - 1];
+
+		/* Neither side can gain by continuing the exchange */
+		if (max(-gain[d - 1], gain[d]) < 0)
+			break;
+
+		color = !color;
+		side = attackers & COLOR_MASK(color);
+		if (!side)
+			break;
+
+		nr = least_valuable(c, side);
+		sq = *__pos(c, nr);
+		p = c->sq[sq];
+
+		occ &= ~(1ULL << sq);
+		attackers = attackers_to(c, dx, dy, occ);
+	}
+
+	while (--d)
+		gain[d - 1] = -max(-gain[d - 1], gain[d]);
+
+	return gain[0];
+}
+
 static const char *asciiart_board_skel = "\
 -----------------\n\
 |          |          |          |          |          |          |          |          |\n\
@@ -850,12 +1671,8 @@ void print_chessboard(const struct chessboard *c)
 {
 	int r;
 	char *tmp, *board = strdup(asciiart_board_skel);
-	struct piece p;
-
 	for (int i = 0, j = 63; i < 64; i++, j = 63 - i) {
-		p = c->b[j >> 3][j & 0x7];
-		r = (p.color << 7) | (p.id << 3) | p.type;
-
+		r = c->sq[j];
 		r = (r & 0x7) | ((r & 0x80) >> 4);
 		tmp = &board[18 + ((i >> 3) * 18) + (90 * (i >> 3)) + ((7 - (i & 0x7)) * 11) + 1];
 		memcpy(tmp, ansi_chess_colors[(r >> 3) & 1], 10);
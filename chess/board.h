@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #include "list.h"
 
 enum piece_type {
@@ -36,23 +38,79 @@ enum piece_id {
 	K_ROOK_PAWN	= 15,
 };
 
-struct piece;
-struct position;
+static inline struct move new_promotion(int sx, int sy, int dx, int dy,
+					enum piece_type type)
+{
+	return (struct move){
+		.from = SQUARE(sx, sy),
+		.to = (QUEEN - type) << 6 | SQUARE(dx, dy),
+	};
+}
+
+static inline enum piece_type move_promotion(struct move m)
+{
+	return QUEEN - (m.to >> 6);
+}
+
 struct chessboard;
 
+/*
+ * The four FEN fields EPD shares with it, plus the terminating NUL
+ */
+#define EPD_MAX 88
+
+/*
+ * A position in 36 bytes, for writing to disk: see pack_board(). The result is
+ * from white's point of view, and the halfmove clock is clamped at 255. Files
+ * of them begin with a header like a trace file's.
+ */
+#define PACKED_MAGIC "CHESSPOS"
+#define PACKED_VERSION 1
+#define PACKED_NO_RESULT -128
+
+struct packed_position {
+	unsigned char sq[32];
+	unsigned char flags;
+	unsigned char ep;
+	signed char result;
+	unsigned char halfmove;
+};
+
+struct packed_file_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+};
+
+
 extern struct chessboard *get_new_board(void);
 extern struct chessboard *get_zero_board(void);
+extern struct chessboard *get_fen_board(const char *fen);
+extern int board_epd(const struct chessboard *c, char *buf);
+extern void pack_board(const struct chessboard *c, struct packed_position *p);
+extern struct chessboard *unpack_board(const struct packed_position *p);
 extern struct chessboard *copy_board(const struct chessboard *c);
+extern void copy_board_into(struct chessboard *dst, const struct chessboard *src);
+extern size_t board_size(void);
 extern void print_chessboard(const struct chessboard *c);
 
-struct piece_iterator;
-const struct piece *iterate_color(struct chessboard *c,
-				  struct piece_iterator **i,
-				  enum piece_color color);
-
+extern int square_contents(struct chessboard *c, int x, int y);
+extern enum piece_color side_to_move(const struct chessboard *c);
 extern void execute_raw_move(struct chessboard *c, struct move m);
 extern int execute_move(struct chessboard *c, int sx, int sy, int dx, int dy);
-extern int enumerate_moves(struct chessboard *c, const struct piece *p,
+extern int enumerate_moves(struct chessboard *c, enum piece_color color,
 			   struct move_list *l);
+extern int in_check(struct chessboard *c, enum piece_color color);
+extern unsigned long long perft(struct chessboard *c, int depth);
+
+extern int move_is_capture(struct chessboard *c, struct move m);
+extern int static_exchange_eval(struct chessboard *c, struct move m);
+
+extern unsigned long long board_hash(struct chessboard *c,
+				     enum piece_color color);
+
+#define HEURISTIC_BATCH 256
 
 extern int calculate_board_heuristic(struct chessboard *c);
+extern void calculate_board_heuristics(struct chessboard *const *c, int n,
+				       int *scores);
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "common.h"
+
+/*
+ * RESULT CACHE
+ *
+ * Remembers the final answer of whole searches, so a position which is asked
+ * about again doesn't need to be searched again. Unlike the transposition
+ * table, which holds every interior node of a search and can lose any of
+ * them at any time, this holds only the root results, and keeps the ones used
+ * most recently.
+ *
+ * Results are keyed by the position's Zobrist hash (which covers the side to
+ * move, castling, and en passant) plus a word describing everything else that
+ * affects the answer. A result is good enough for any search to its depth or
+ * shallower, so a hit may well return a deeper result than was asked for.
+ *
+ * Everything is allocated up front to fit in the given number of bytes: a
+ * power of two array of hash buckets, and as many entries as fit in the rest.
+ * Past CACHE_MAX_BUCKETS buckets, the rest all goes to entries: the chains
+ * just get a little longer.
+ * Entries are chained from the buckets, and kept on a doubly linked list in
+ * order of use; once they are all in use, the least recently used entry is
+ * evicted to make room. Entries are referred to by their index, so the links
+ * are only four bytes. One lock protects everything, which is fine: a lookup
+ * is a few dozen instructions.
+ */
+
+#define NIL (-1)
+#define CACHE_MAX_BUCKETS (1UL << 26)
+
+struct cache_entry {
+	unsigned long long key;
+	unsigned int params;
+	unsigned int move;
+	int score;
+	int depth;
+	int chain;
+	int prev;
+	int next;
+};
+
+struct result_cache {
+	pthread_mutex_t lock;
+	struct cache_entry *entries;
+	int *buckets;
+	unsigned int bucket_mask;
+	int nr_entries;
+	int nr_used;
+
+	/* Most recently used first */
+	int lru_head;
+	int lru_tail;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+static int *cache_bucket(struct result_cache *rc, unsigned long long key,
+			 unsigned int params)
+{
+	key ^= params * 0x9e3779b97f4a7c15ULL;
+	return &rc->buckets[(key ^ key >> 32) & rc->bucket_mask];
+}
+
+static int cache_find(struct result_cache *rc, unsigned long long key,
+		      unsigned int params)
+{
+	int i = *cache_bucket(rc, key, params);
+
+	while (i != NIL && (rc->entries[i].key != key || rc->entries[i].params != params))
+		i = rc->entries[i].chain;
+
+	return i;
+}
+
+static void lru_unlink(struct result_cache *rc, int i)
+{
+	struct cache_entry *e = &rc->entries[i];
+
+	if (e->prev != NIL)
+		rc->entries[e->prev].next = e->next;
+	else
+		rc->lru_head = e->next;
+
+	if (e->next != NIL)
+		rc->entries[e->next].prev = e->prev;
+	else
+		rc->lru_tail = e->prev;
+}
+
+static void lru_push(struct result_cache *rc, int i)
+{
+	struct cache_entry *e = &rc->entries[i];
+
+	e->prev = NIL;
+	e->next = rc->lru_head;
+	if (rc->lru_head != NIL)
+		rc->entries[rc->lru_head].prev = i;
+	else
+		rc->lru_tail = i;
+
+	rc->lru_head = i;
+}
+
+static void chain_unlink(struct result_cache *rc, int i)
+{
+	struct cache_entry *e = &rc->entries[i];
+	int *p = cache_bucket(rc, e->key, e->params);
+
+	while (*p != i)
+		p = &rc->entries[*p].chain;
+
+	*p = e->chain;
+}
+
+/*
+ * Returns nonzero and fills in @res if there's a result for @key and @params
+ * from a search at least @depth deep.
+ */
+int cache_lookup(struct result_cache *rc, unsigned long long key,
+		 unsigned int params, int depth, struct cache_result *res)
+{
+	struct cache_entry *e;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&rc->lock);
+	i = cache_find(rc, key, params);
+	if (i != NIL && rc->entries[i].depth >= depth) {
+		e = &rc->entries[i];
+		res->move = e->move;
+		res->score = e->score;
+		res->depth = e->depth;
+
+		lru_unlink(rc, i);
+		lru_push(rc, i);
+		rc->hits++;
+		ret = 1;
+	} else {
+		rc->misses++;
+	}
+
+	pthread_mutex_unlock(&rc->lock);
+	return ret;
+}
+
+/*
+ * Remember a result, unless there's already one at least as deep for the same
+ * position and parameters.
+ */
+void cache_insert(struct result_cache *rc, unsigned long long key,
+		  unsigned int params, int depth, unsigned int move, int score)
+{
+	struct cache_entry *e;
+	int i, *bucket;
+
+	pthread_mutex_lock(&rc->lock);
+	i = cache_find(rc, key, params);
+	if (i != NIL) {
+		lru_unlink(rc, i);
+	} else {
+		if (rc->nr_used < rc->nr_entries) {
+			i = rc->nr_used++;
+		} else {
+			i = rc->lru_tail;
+			lru_unlink(rc, i);
+			chain_unlink(rc, i);
+			rc->evictions++;
+		}
+
+		e = &rc->entries[i];
+		bucket = cache_bucket(rc, key, params);
+		e->key = key;
+		e->params = params;
+		e->depth = -1;
+		e->chain = *bucket;
+		*bucket = i;
+	}
+
+	e = &rc->entries[i];
+	if (depth >= e->depth) {
+		e->move = move;
+		e->score = score;
+		e->depth = depth;
+	}
+
+	lru_push(rc, i);
+	pthread_mutex_unlock(&rc->lock);
+}
+
+void cache_get_stats(struct result_cache *rc, struct cache_stats *st)
+{
+	pthread_mutex_lock(&rc->lock);
+	st->hits = rc->hits;
+	st->misses = rc->misses;
+	st->evictions = rc->evictions;
+	st->entries = rc->nr_used;
+	st->capacity = rc->nr_entries;
+	pthread_mutex_unlock(&rc->lock);
+}
+
+/*
+ * Set up a cache using at most @bytes of memory. Returns 0 on success, or a
+ * negative error code.
+ */
+int cache_init(struct result_cache **ret, unsigned long bytes)
+{
+	struct result_cache *rc;
+	unsigned long nr_buckets = 1, nr_entries;
+	int i;
+
+	/* About one bucket per entry */
+	while (nr_buckets < CACHE_MAX_BUCKETS &&
+	       nr_buckets * 2 * (sizeof(int) + sizeof(struct cache_entry)) <= bytes)
+		nr_buckets *= 2;
+
+	if (bytes < nr_buckets * sizeof(int) + sizeof(struct cache_entry))
+		return -EINVAL;
+
+	/* Entries are referred to by int indices */
+	nr_entries = (bytes - nr_buckets * sizeof(int)) / sizeof(struct cache_entry);
+	if (nr_entries > INT_MAX)
+		nr_entries = INT_MAX;
+
+	rc = calloc(1, sizeof(*rc));
+	if (!rc)
+		return -ENOMEM;
+
+	rc->nr_entries = nr_entries;
+	rc->bucket_mask = nr_buckets - 1;
+	rc->buckets = malloc(nr_buckets * sizeof(int));
+	rc->entries = malloc(rc->nr_entries * sizeof(struct cache_entry));
+	if (!rc->buckets || !rc->entries) {
+		free(rc->buckets);
+		free(rc->entries);
+		free(rc);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (int)nr_buckets; i++)
+		rc->buckets[i] = NIL;
+
+	pthread_mutex_init(&rc->lock, NULL);
+	rc->lru_head = NIL;
+	rc->lru_tail = NIL;
+	*ret = rc;
+	return 0;
+}
+
+void cache_close(struct result_cache *rc)
+{
+	pthread_mutex_destroy(&rc->lock);
+	free(rc->buckets);
+	free(rc->entries);
+	free(rc);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+struct cache_result {
+	unsigned int move;
+	int score;
+	int depth;
+};
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long entries;
+	unsigned long capacity;
+};
+
+struct result_cache;
+
+extern int cache_init(struct result_cache **ret, unsigned long bytes);
+extern void cache_close(struct result_cache *rc);
+
+extern int cache_lookup(struct result_cache *rc, unsigned long long key,
+			unsigned int params, int depth, struct cache_result *res);
+extern void cache_insert(struct result_cache *rc, unsigned long long key,
+			 unsigned int params, int depth, unsigned int move,
+			 int score);
+extern void cache_get_stats(struct result_cache *rc, struct cache_stats *st);
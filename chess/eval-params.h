@@ -0,0 +1,8 @@
+/*
+ * Evaluation parameters, indexed by enum piece_type.
+ *
+ * chess-tune regenerates this file from a set of labelled positions.
+ */
+#pragma once
+
+static const int piece_values[8] = {0, 12, 60, 36, 36, 108, 240, 0};
@@ -1,17 +1,84 @@
 #pragma once
 
+/*
+ * MOVES
+ *
+ * A move is 16 bits: the source and destination squares, each as an index
+ * (y << 3 | x) into the board. The top two bits of the destination select
+ * the piece a pawn reaching the last rank promotes to, counting down from a
+ * queen, so the default is a queen. The top two bits of the source are
+ * reserved.
+ *
+ * Castling is a king moving two files, and en passant a pawn capturing onto
+ * the en passant square: neither needs any more bits.
+ */
+
 struct move {
-	unsigned char sx;
-	unsigned char sy;
-	unsigned char dx;
-	unsigned char dy;
+	unsigned char from;
+	unsigned char to;
 };
 
-struct move_list;
+#define SQUARE(x, y) ((y) << 3 | (x))
+
+static inline struct move new_move(int sx, int sy, int dx, int dy)
+{
+	return (struct move){
+		.from = SQUARE(sx, sy),
+		.to = SQUARE(dx, dy),
+	};
+}
+
+static inline int move_from(struct move m)
+{
+	return m.from & 63;
+}
+
+static inline int move_to(struct move m)
+{
+	return m.to & 63;
+}
+
+static inline int move_sx(struct move m)
+{
+	return m.from & 7;
+}
+
+static inline int move_sy(struct move m)
+{
+	return m.from >> 3 & 7;
+}
 
-extern struct move_list *allocate_move_list(void);
-extern void free_move_list(struct move_list *l);
-extern int move_list_length(struct move_list *l);
+static inline int move_dx(struct move m)
+{
+	return m.to & 7;
+}
+
+static inline int move_dy(struct move m)
+{
+	return m.to >> 3 & 7;
+}
+
+static inline int same_move(struct move a, struct move b)
+{
+	return a.from == b.from && a.to == b.to;
+}
+
+/*
+ * MOVE LISTS
+ *
+ * These hold all the moves enumerated for one side in a position. There can
+ * never be more than 218 legal moves, so MAX_MOVES leaves plenty of room for
+ * the pseudo-legal ones.
+ */
+
+#define MAX_MOVES 256
+
+struct move_list {
+	int n;
+	struct move m[MAX_MOVES];
+};
 
-extern struct move pop_move(struct move_list *l);
-extern void push_move(struct move_list *l, int sx, int sy, int dx, int dy);
+static inline void push_move(struct move_list *l, int sx, int sy, int dx, int dy)
+{
+	l->m[l->n++] = new_move(sx, sy, dx, dy);
+}
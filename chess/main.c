@@ -15,10 +15,19 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include "common.h"
 #include "board.h"
 #include "negamax.h"
+#include "tt.h"
+#include "nnue.h"
+#include "perf.h"
+#include "trace.h"
+#include "timeman.h"
+#include "cache.h"
 
 #define MOVE_DEPTH 5
 
@@ -37,15 +46,230 @@ static char *get_error_string(int error_code)
 	}
 }
 
-int main(void)
+/*
+ * Count the legal move tree from @fen (or the starting position) to each depth
+ * up to @depth, for comparing against published perft results.
+ */
+static int run_perft(int depth, const char *fen)
+{
+	struct chessboard *c = fen ? get_fen_board(fen) : get_new_board();
+	struct timespec start, end;
+	unsigned long long nodes;
+	double secs;
+	int i;
+
+	if (!c) {
+		fprintf(stderr, "Can't parse FEN '%s'\n", fen);
+		return 1;
+	}
+
+	for (i = 1; i <= depth; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		nodes = perft(c, i);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("perft(%d) = %llu in %.3fs (%.0f nodes/sec)\n", i, nodes,
+		       secs, secs > 0 ? nodes / secs : 0);
+	}
+
+	free(c);
+	return 0;
+}
+
+/*
+ * Print the best @nr_lines lines from @fen (or the starting position) at each
+ * depth up to MOVE_DEPTH.
+ */
+static int run_multipv(int nr_lines, const char *fen)
+{
+	struct chessboard *c = fen ? get_fen_board(fen) : get_new_board();
+	struct pv_line *lines;
+
+	if (!c) {
+		fprintf(stderr, "Can't parse FEN '%s'\n", fen);
+		return 1;
+	}
+
+	if (nr_lines < 1) {
+		fprintf(stderr, "Need at least one line\n");
+		free(c);
+		return 1;
+	}
+
+	lines = calloc(nr_lines, sizeof(*lines));
+	if (!lines)
+		fatal("-ENOMEM allocating PV lines\n");
+
+	calculate_multipv(c, side_to_move(c), MOVE_DEPTH, nr_lines, lines);
+	free(lines);
+	free(c);
+	return 0;
+}
+
+static unsigned int search_move(struct result_cache *rc, struct chessboard *c,
+				int color)
+{
+	struct search_stats st;
+	unsigned int ret;
+
+	if (!rc)
+		return calculate_move(c, color, MOVE_DEPTH);
+
+	ret = calculate_move_cached(rc, c, color, MOVE_DEPTH, &st);
+	if (st.evaluated_moves)
+		printf("Searched %lu moves (score %d)\n", st.evaluated_moves, st.score);
+	else
+		printf("Cached result from depth %d (score %d)\n", st.depth, st.score);
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-t tt_file | -s shm_name] [-m tt_megabytes] [-j threads [-d | -y]] [-n nnue_file] [-P] [-T trace_file] [-c ms[+inc]] [-R megabytes]\n", name);
+	printf("       %s -p depth [fen]\n", name);
+	printf("       %s [search options] -M lines [fen]\n", name);
+	printf("\t-t: Save the transposition table to this file on exit, and\n");
+	printf("\t    reload it from there at startup if it is valid\n");
+	printf("\t-s: Share the transposition table with other processes\n");
+	printf("\t    through this POSIX shared memory segment (e.g. /chess)\n");
+	printf("\t-m: Size of the transposition table in megabytes\n");
+	printf("\t-j: Split the search across this many threads\n");
+	printf("\t-d: Make the threaded search deterministic, so every run\n");
+	printf("\t    produces exactly the same result (but slower)\n");
+	printf("\t-y: Use Young Brothers Wait to split the threaded search at\n");
+	printf("\t    interior nodes, rather than only at the root\n");
+	printf("\t-n: Evaluate positions with this NNUE network\n");
+	printf("\t-P: Report hardware performance counters for each search\n");
+	printf("\t-T: Trace every node searched to this file, which can be\n");
+	printf("\t    read with chess-trace-dump\n");
+	printf("\t-c: Give the computer a clock with this many milliseconds,\n");
+	printf("\t    plus an increment per move, rather than a fixed depth\n");
+	printf("\t-R: Remember the result of every search in a cache this\n");
+	printf("\t    many megabytes in size, and reuse it for the same position\n");
+	printf("\t-p: Just run perft to this depth from the starting position\n");
+	printf("\t    or the given FEN, and exit\n");
+	printf("\t-M: Just print this many of the best lines from the starting\n");
+	printf("\t    position or the given FEN at each depth, and exit\n");
+}
+
+int main(int argc, char **argv)
 {
 	struct chessboard *c = get_new_board();
-	int tmp, sx, sy, dx, dy;
+	int tmp, sx, sy, dx, dy, nr_threads = 1, deterministic = 0, ybwc = 0, profile = 0;
+	int multipv = 0, ret = 0;
+	unsigned long cache_mbytes = 0;
+	struct result_cache *rc = NULL;
+	struct cache_stats cs;
+	enum search_mode mode = SEARCH_SERIAL;
+	unsigned long tt_mbytes = 0;
+	struct tt *tt;
+	const char *tt_file = NULL;
+	const char *tt_shm = NULL;
+	const char *nnue_file = NULL;
+	const char *trace_file = NULL;
+	unsigned long clock_ms = 0, increment_ms = 0, elapsed;
+	struct time_manager tm;
+	struct search_stats st;
+	char *end;
+
+	while ((tmp = getopt(argc, argv, "t:s:m:j:dyn:PT:c:R:p:M:h")) != -1) {
+		switch (tmp) {
+		case 't':
+			tt_file = optarg;
+			break;
+		case 's':
+			tt_shm = optarg;
+			break;
+		case 'm':
+			tt_mbytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'd':
+			deterministic = 1;
+			break;
+		case 'y':
+			ybwc = 1;
+			break;
+		case 'n':
+			nnue_file = optarg;
+			break;
+		case 'P':
+			profile = 1;
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'c':
+			clock_ms = strtoul(optarg, &end, 10);
+			if (*end == '+')
+				increment_ms = strtoul(end + 1, NULL, 10);
+			break;
+		case 'R':
+			cache_mbytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			free(c);
+			return run_perft(atoi(optarg), optind < argc ? argv[optind] : NULL);
+		case 'M':
+			multipv = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (nnue_file) {
+		tmp = nnue_load(nnue_file);
+		if (tmp)
+			fatal("Can't load NNUE network: %s\n", strerror(-tmp));
+	}
+
+	tmp = tt_init(&tt, tt_file, tt_shm, tt_mbytes);
+	if (tmp)
+		fatal("Can't set up transposition table: %s\n", strerror(-tmp));
+
+	if (deterministic && ybwc)
+		fatal("-d and -y are mutually exclusive\n");
+
+	if (deterministic)
+		mode = SEARCH_DETERMINISTIC;
+	else if (ybwc)
+		mode = SEARCH_YBWC;
+	else if (nr_threads > 1)
+		mode = SEARCH_ROOT_SPLIT;
+
+	if (trace_file) {
+		tmp = trace_start(trace_file, nr_threads > 1 ? nr_threads : 1);
+		if (tmp)
+			fatal("Can't open trace file: %s\n", strerror(-tmp));
+	}
+
+	configure_search(tt, nr_threads, mode);
+
+	if (cache_mbytes) {
+		tmp = cache_init(&rc, cache_mbytes << 20);
+		if (tmp)
+			fatal("Can't set up result cache: %s\n", strerror(-tmp));
+	}
+
+	if (profile)
+		perf_init();
+
+	if (multipv) {
+		ret = run_multipv(multipv, optind < argc ? argv[optind] : NULL);
+		goto out;
+	}
 
 	while (1) {
+		tt_new_search(tt);
 		print_chessboard(c);
 		/* Calcluate white's suggested move */
-		tmp = calculate_move(c, 0, MOVE_DEPTH);
+		tmp = search_move(rc, c, 0);
 		sx = tmp & 0xff;
 		sy = (tmp & 0xff00) >> 8;
 		dx = (tmp & 0xff0000) >> 16;
@@ -55,11 +279,13 @@ int main(void)
 no_clear:
 		printf("Enter move: ");
 		tmp = scanf("%d %d %d %d", &sx, &sy, &dx, &dy);
+		if (tmp == EOF)
+			break;
 		if (tmp != 4)
 			goto no_clear;
 
 		if (sx == -1)
-			return 0;
+			break;
 
 		tmp = execute_move(c, sx, sy, dx, dy);
 		if (tmp) {
@@ -70,7 +296,18 @@ no_clear:
 		}
 
 		/* Calcluate black's move */
-		tmp = calculate_move(c, 1, MOVE_DEPTH);
+		if (clock_ms) {
+			tm_start_clock(&tm, clock_ms, increment_ms, 0);
+			tmp = calculate_move_timed(c, 1, &tm, &st);
+			elapsed = tm_elapsed_ms(&tm);
+
+			clock_ms = clock_ms > elapsed ? clock_ms - elapsed : 0;
+			clock_ms += increment_ms;
+			printf("Searched to depth %d (score %d) in %lums, %lums left\n",
+			       st.depth, st.score, elapsed, clock_ms);
+		} else {
+			tmp = search_move(rc, c, 1);
+		}
 		sx = tmp & 0xff;
 		sy = (tmp & 0xff00) >> 8;
 		dx = (tmp & 0xff0000) >> 16;
@@ -81,5 +318,18 @@ no_clear:
 			fatal("Computer tried to make an illegal move: %s\n", get_error_string(tmp));
 	}
 
-	return 0;
+out:
+	if (rc) {
+		cache_get_stats(rc, &cs);
+		printf("Result cache: %lu hits, %lu misses, %lu evictions, %lu/%lu entries\n",
+		       cs.hits, cs.misses, cs.evictions, cs.entries, cs.capacity);
+		cache_close(rc);
+	}
+
+	tt_close(tt);
+	nnue_unload();
+	perf_exit();
+	trace_stop();
+	free(c);
+	return ret;
 }
@@ -16,71 +16,862 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "common.h"
 #include "board.h"
 #include "list.h"
+#include "tt.h"
+#include "nnue.h"
+#include "perf.h"
+#include "trace.h"
+#include "timeman.h"
+#include "cache.h"
 
-static unsigned long expanded_moves;
-static unsigned long evaluated_moves;
+/*
+ * SEARCH THREADS
+ *
+ * The search can split the root moves across several threads, in one of two
+ * ways:
+ *
+ *	SEARCH_ROOT_SPLIT: Threads take the next unsearched root move as they
+ *	become free, and share a single alpha bound and transposition table.
+ *	This is fast, but what gets pruned depends on thread timing.
+ *
+ *	SEARCH_DETERMINISTIC: Root move i is always searched by thread i % N,
+ *	each thread keeps its own alpha bound, and each thread has its own
+ *	private transposition table which is cleared before every search. The
+ *	per-thread results are merged in a fixed order, so given the same
+ *	position and thread count, the result and node counts are identical
+ *	on every run.
+ *
+ *	SEARCH_YBWC: The root moves are searched one at a time, but any
+ *	interior node can be split between threads once its first move has
+ *	been searched ("Young Brothers Wait"). See below.
+ *
+ * SEARCH_SERIAL is just SEARCH_ROOT_SPLIT with one thread.
+ */
+
+#define DETERMINISTIC_TT_MB 16
+#define YBWC_MIN_DEPTH 2
+#define YBWC_MAX_SPLITS 64
+
+struct search_thread;
+
+struct split_point {
+	pthread_mutex_t lock;
+	struct split_point *parent;
+	struct chessboard *c;
+	struct nnue_accumulator *acc;
+	struct ordered_move *moves;
+	int nr_moves;
+	int next_move;
+	int color;
+	int depth;
+	int alpha;
+	int beta;
+	int best_val;
+	struct move best_move;
+	int cutoff;
+	int nr_helpers;
+};
+
+struct work_deque {
+	pthread_mutex_t lock;
+	struct split_point *sp[YBWC_MAX_SPLITS];
+	int head;
+	int tail;
+};
+
+struct root_split {
+	struct chessboard *c;
+	struct ordered_move *moves;
+	int *scores;
+	int nr_moves;
+	int color;
+	int depth;
+
+	/* Only used by SEARCH_ROOT_SPLIT */
+	int next_move;
+	int alpha;
+};
+
+struct search_thread {
+	pthread_t thread;
+	struct root_split *rs;
+	struct tt *tt;
+	struct nnue_accumulator *acc;
+	int id;
+
+	int best_idx;
+	int best_val;
+
+	unsigned long expanded_moves;
+	unsigned long evaluated_moves;
+	unsigned long hash_hits;
+
+	/* Scratch boards for search_leaves(), carved out of @leaf_mem */
+	struct chessboard *leaves[MAX_MOVES];
+	void *leaf_mem;
+
+	/* Only used by SEARCH_YBWC */
+	struct work_deque deque;
+	struct split_point *cur_sp;
+
+	/* Only used when tracing */
+	struct trace_ring *trace;
+	struct move last_move;
+};
+
+static struct tt *search_tt;
+static enum search_mode search_mode = SEARCH_SERIAL;
+static int nr_search_threads = 1;
+static struct search_thread *search_threads;
+static int nr_idle_threads;
+static int search_done;
+static unsigned long node_limit;
 
 static inline int max(int a, int b)
 {
 	return a > b ? a : b;
 }
 
-/* Enumeration of moves is batched by piece. Since we have the oppurtunity to
- * prune after the evaluation of each potential move, it's possible that we
- * end up not examining moves that we wasted time enumerating.
+static inline int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ * MOVE ORDERING
  *
- * Typically this overhead appears to be < 1%, which is probably less than the
- * overhead of the extra logic that would be required to evaluate between the
- * enumeration of each move. However, it can be as great as 10% with certain
- * board setups, so I need to think about this more...
+ * All the moves for a node are enumerated up front so they can be ordered:
+ * the best move from the transposition table comes first, then captures which
+ * win or break even according to static_exchange_eval(), then quiet moves, and
+ * captures which lose material come last. Within each class, moves are
+ * ordered by their exchange value.
  *
- * (I originally batched them by board, which resulted in waste overheads of
- * as high as 75%... so this is still a gigantic improvement.)
+ * This costs us the ability to prune between pieces before enumerating the
+ * rest of them (which used to save ~1% of enumerations), but trying good
+ * captures first produces cutoffs much earlier in tactical positions.
  */
 
-static int negamax_algo(struct chessboard *c, int color, int depth, int alpha, int beta)
+#define KEY_HASH 100000
+#define KEY_WINNING 1000
+#define KEY_LOSING -1000
+
+struct ordered_move {
+	struct move m;
+	int key;
+};
+
+static int enumerate_ordered_moves(struct chessboard *c, int color,
+				   struct ordered_move *moves,
+				   const struct move *hash_move)
 {
-	struct chessboard *cb;
-	const struct piece *p;
-	struct piece_iterator *i = NULL;
-	struct move_list *l;
+	struct move_list l;
 	struct move m;
-	int n, j, val, best_val = INT_MIN;
+	int j, see;
 
-	if (!depth)
-		return !color ? calculate_board_heuristic(c) : -calculate_board_heuristic(c);
+	l.n = 0;
+	enumerate_moves(c, color, &l);
 
-	while ((p = iterate_color(c, &i, color))) {
-		l = allocate_move_list();
-		n = enumerate_moves(c, p, l);
-		expanded_moves += n;
+	for (j = 0; j < l.n; j++) {
+		m = l.m[j];
+		moves[j].m = m;
+		moves[j].key = 0;
 
-		for (j = 0; j < n; j++) {
-			m = pop_move(l);
-			cb = copy_board(c);
+		if (hash_move && same_move(m, *hash_move)) {
+			moves[j].key = KEY_HASH;
+		} else if (move_is_capture(c, m)) {
+			see = static_exchange_eval(c, m);
+			moves[j].key = see + (see < 0 ? KEY_LOSING : KEY_WINNING);
+		}
+	}
 
-			execute_raw_move(cb, m);
-			evaluated_moves++;
+	return l.n;
+}
 
-			val = -negamax_algo(cb, !color, depth - 1, -beta, -alpha);
+/*
+ * Selection sort, one move at a time: most nodes cut off after the first few
+ * moves, so there's no point in sorting the whole list. The move picked is
+ * rotated into place rather than swapped, so the order is always the same as
+ * sort_ordered_moves() gives.
+ */
+static struct move next_ordered_move(struct ordered_move *moves, int nr, int j)
+{
+	struct ordered_move tmp;
+	int k, best = j;
 
-			free(cb);
+	for (k = j + 1; k < nr; k++)
+		if (moves[k].key > moves[best].key)
+			best = k;
+
+	tmp = moves[best];
+	memmove(&moves[j + 1], &moves[j], (best - j) * sizeof(*moves));
+	moves[j] = tmp;
+	return moves[j].m;
+}
+
+/*
+ * Stable insertion sort, for when every move will be looked at anyway. Most
+ * keys are zero, so this is close to linear.
+ */
+static void sort_ordered_moves(struct ordered_move *moves, int nr)
+{
+	struct ordered_move tmp;
+	int i, j;
+
+	for (j = 1; j < nr; j++) {
+		tmp = moves[j];
+		for (i = j; i > 0 && moves[i - 1].key < tmp.key; i--)
+			moves[i] = moves[i - 1];
+
+		moves[i] = tmp;
+	}
+}
+
+static void ybwc_split(struct search_thread *t, struct chessboard *c,
+		       struct nnue_accumulator *acc, int color, int depth,
+		       struct ordered_move *moves, int n, int alpha, int beta,
+		       int *best_val, struct move *best_move);
+
+/*
+ * When an NNUE network is loaded, each thread keeps a stack of accumulators
+ * alongside the search: @acc is the one for the position @c, and the child
+ * positions use the next one up the stack. Otherwise @acc is NULL.
+ */
+static int evaluate(struct chessboard *c, int color, struct nnue_accumulator *acc)
+{
+	int ret = acc ? nnue_evaluate(acc) : calculate_board_heuristic(c);
+
+	return !color ? ret : -ret;
+}
+
+static void make_move(struct search_thread *t, struct chessboard *cb,
+		      struct chessboard *c, struct nnue_accumulator *acc,
+		      struct move m)
+{
+	if (acc)
+		nnue_update(acc + 1, acc, c, m);
+
+	execute_raw_move(cb, m);
+	t->evaluated_moves++;
+	t->last_move = m;
+}
+
+/*
+ * Nodes are traced as they are exited, with the move that led to them and the
+ * window they were searched with.
+ */
+static void trace_node(struct search_thread *t, int depth, struct move m,
+		       int alpha, int beta, int score, enum trace_reason reason)
+{
+	if (t->trace)
+		trace_emit(t->trace, t->rs->depth - depth, m, alpha, beta,
+			   score, reason);
+}
+
+/*
+ * Stop searches once they have evaluated @max_nodes leaves and interior nodes
+ * between all their threads, or never if it is zero. A search which hits the
+ * limit is aborted just like one which runs out of time.
+ */
+void search_node_limit(unsigned long max_nodes)
+{
+	node_limit = max_nodes;
+}
+
+static int search_limit_hit(void)
+{
+	unsigned long nodes = 0;
+	int i;
+
+	if (tm_hard_limit_hit())
+		return 1;
+
+	if (!node_limit)
+		return 0;
+
+	for (i = 0; i < nr_search_threads; i++)
+		nodes += __atomic_load_n(&search_threads[i].evaluated_moves,
+					 __ATOMIC_RELAXED);
+
+	return nodes >= node_limit;
+}
+
+/*
+ * When another thread cuts off a split point, everybody searching beneath it
+ * abandons their work: the score they return is garbage, and must not be
+ * stored in the transposition table. The same goes for everybody when the
+ * time manager's hard limit passes or the node limit is reached.
+ */
+static int search_aborted(struct search_thread *t)
+{
+	struct split_point *sp;
+
+	if (search_limit_hit())
+		return 1;
+
+	for (sp = t->cur_sp; sp; sp = sp->parent)
+		if (__atomic_load_n(&sp->cutoff, __ATOMIC_RELAXED))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * At the last ply, evaluate all the leaves at once with the batched SIMD
+ * heuristic, then walk the scores in the order the moves would have been
+ * searched, applying exactly the same cutoff logic. The result is identical
+ * to searching them one at a time: the only cost is evaluating the leaves
+ * past a cutoff, which is cheaper than the branchy one-at-a-time loop.
+ */
+static int search_leaves(struct search_thread *t, struct chessboard *c,
+			 int color, struct ordered_move *moves, int n,
+			 int alpha, int beta, struct move *best_move)
+{
+	int scores[MAX_MOVES];
+	int j, val, best_val = -INT_MAX;
+
+	sort_ordered_moves(moves, n);
+	for (j = 0; j < n; j++) {
+		copy_board_into(t->leaves[j], c);
+		execute_raw_move(t->leaves[j], moves[j].m);
+	}
+
+	calculate_board_heuristics(t->leaves, n, scores);
+	t->evaluated_moves += n;
+
+	for (j = 0; j < n && alpha < beta; j++) {
+		val = !color ? scores[j] : -scores[j];
+		trace_node(t, 0, moves[j].m, -beta, -alpha, -val, TRACE_LEAF);
+		if (val > best_val) {
+			best_val = val;
+			*best_move = moves[j].m;
+		}
+
+		alpha = max(alpha, val);
+	}
+
+	return best_val;
+}
+
+/*
+ * Results for every interior node are recorded in the transposition table.
+ * Leaves aren't worth it: evaluating them is cheaper than hashing them.
+ */
+static int negamax_algo(struct search_thread *t, struct chessboard *c,
+			struct nnue_accumulator *acc, int color, int depth,
+			int alpha, int beta)
+{
+	struct ordered_move moves[MAX_MOVES];
+	struct chessboard *cb;
+	struct move m, best_move = {0}, here = t->last_move;
+	struct tt_hit hit;
+	unsigned long long key;
+	int n, j, val, hashed, best_val = -INT_MAX;
+	int orig_alpha = alpha, orig_beta = beta;
+	enum tt_bound bound;
+
+	if (!depth) {
+		val = evaluate(c, color, acc);
+		trace_node(t, depth, here, alpha, beta, val, TRACE_LEAF);
+		return val;
+	}
+
+	if (search_aborted(t)) {
+		trace_node(t, depth, here, alpha, beta, 0, TRACE_ABORT);
+		return 0;
+	}
+
+	key = board_hash(c, color);
+	hashed = tt_probe(t->tt, key, &hit);
+	if (hashed) {
+		if (hit.depth >= depth) {
+			t->hash_hits++;
+			if (hit.bound == TT_EXACT)
+				goto hash_out;
+			else if (hit.bound == TT_LOWER)
+				alpha = max(alpha, hit.score);
+			else
+				beta = min(beta, hit.score);
 
-			best_val = max(best_val, val);
-			alpha = max(alpha, val);
 			if (alpha >= beta)
-				break;
+				goto hash_out;
+		}
+	}
+
+	n = enumerate_ordered_moves(c, color, moves, hashed ? &hit.m : NULL);
+	t->expanded_moves += n;
+
+	if (depth == 1 && !acc) {
+		best_val = search_leaves(t, c, color, moves, n, alpha, beta, &best_move);
+		goto out;
+	}
+
+	for (j = 0; j < n; j++) {
+		if (j == 1 && search_mode == SEARCH_YBWC && depth >= YBWC_MIN_DEPTH &&
+		    n > 2 && __atomic_load_n(&nr_idle_threads, __ATOMIC_RELAXED)) {
+			ybwc_split(t, c, acc, color, depth, moves, n, alpha, beta,
+				   &best_val, &best_move);
+			break;
+		}
+
+		m = next_ordered_move(moves, n, j);
+		cb = copy_board(c);
+		make_move(t, cb, c, acc, m);
+
+		val = -negamax_algo(t, cb, acc ? acc + 1 : NULL, !color, depth - 1, -beta, -alpha);
+
+		free(cb);
+
+		if (val > best_val) {
+			best_val = val;
+			best_move = m;
 		}
 
-		free_move_list(l);
+		alpha = max(alpha, val);
+		if (alpha >= beta)
+			break;
+	}
+
+out:
+	if (best_val <= orig_alpha)
+		bound = TT_UPPER;
+	else if (best_val >= beta)
+		bound = TT_LOWER;
+	else
+		bound = TT_EXACT;
+
+	if (search_aborted(t)) {
+		trace_node(t, depth, here, orig_alpha, orig_beta, best_val, TRACE_ABORT);
+		return best_val;
 	}
 
+	trace_node(t, depth, here, orig_alpha, orig_beta, best_val,
+		   bound == TT_UPPER ? TRACE_FAIL_LOW :
+		   bound == TT_LOWER ? TRACE_CUTOFF : TRACE_EXACT);
+
+	tt_store(t->tt, key, depth, best_val, bound, best_move);
 	return best_val;
+
+hash_out:
+	trace_node(t, depth, here, orig_alpha, orig_beta, hit.score, TRACE_HASH);
+	return hit.score;
+}
+
+/*
+ * YOUNG BROTHERS WAIT
+ *
+ * Once the eldest brother (the first move) at a node has been searched, its
+ * remaining younger brothers are published as a split point on the owning
+ * thread's work deque. The owner pushes and pops split points at the tail of
+ * its deque as it recurses; idle threads look for the deque with the most
+ * split points on it, and join the oldest one at its head (which is the one
+ * nearest the root, and so has the most work beneath it).
+ *
+ * Any number of threads can help at a split point: they take the next move
+ * under the split point's lock, search it, and merge the result back. The
+ * owner searches moves alongside them until there are none left, and removes
+ * the split point from its deque so nobody else can join. It can't return
+ * until the helpers are finished, but rather than sit idle it helps them in
+ * turn: any split point the helpers have made beneath its own is work that
+ * it would otherwise be waiting on ("helpful master").
+ */
+
+static void search_split_moves(struct search_thread *t, struct split_point *sp,
+			       struct nnue_accumulator *acc)
+{
+	struct chessboard *cb;
+	struct move m;
+	int alpha, val;
+
+	while (1) {
+		pthread_mutex_lock(&sp->lock);
+		if (sp->cutoff || sp->next_move >= sp->nr_moves) {
+			pthread_mutex_unlock(&sp->lock);
+			break;
+		}
+
+		m = sp->moves[sp->next_move].m;
+		__atomic_store_n(&sp->next_move, sp->next_move + 1, __ATOMIC_RELAXED);
+		alpha = sp->alpha;
+		pthread_mutex_unlock(&sp->lock);
+
+		cb = copy_board(sp->c);
+		make_move(t, cb, sp->c, acc, m);
+
+		val = -negamax_algo(t, cb, acc ? acc + 1 : NULL, !sp->color,
+				    sp->depth - 1, -sp->beta, -alpha);
+		free(cb);
+
+		pthread_mutex_lock(&sp->lock);
+		if (!search_aborted(t)) {
+			if (val > sp->best_val) {
+				sp->best_val = val;
+				sp->best_move = m;
+			}
+
+			sp->alpha = max(sp->alpha, val);
+			if (sp->alpha >= sp->beta)
+				__atomic_store_n(&sp->cutoff, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&sp->lock);
+	}
+}
+
+static int split_point_has_work(struct split_point *sp)
+{
+	return !__atomic_load_n(&sp->cutoff, __ATOMIC_RELAXED) &&
+	       __atomic_load_n(&sp->next_move, __ATOMIC_RELAXED) < sp->nr_moves;
+}
+
+/*
+ * Search moves at somebody else's split point @sp, which the caller has
+ * already been counted as a helper of. The owner's accumulator stack isn't
+ * ours to write to, so @acc is where our own stack starts.
+ */
+static void help_split_point(struct search_thread *t, struct split_point *sp,
+			     struct nnue_accumulator *acc)
+{
+	struct split_point *prev = t->cur_sp;
+
+	t->cur_sp = sp;
+	if (sp->acc)
+		acc[0] = *sp->acc;
+
+	search_split_moves(t, sp, sp->acc ? acc : NULL);
+	t->cur_sp = prev;
+	__atomic_fetch_sub(&sp->nr_helpers, 1, __ATOMIC_RELEASE);
+}
+
+static int split_point_below(struct split_point *sp, struct split_point *ancestor)
+{
+	for (; sp; sp = sp->parent)
+		if (sp == ancestor)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Find a split point with work beneath @ancestor on another thread's deque,
+ * and join it. The parents of everything on a deque are kept alive by their
+ * helpers, so the chain is safe to walk while the deque is locked.
+ */
+static struct split_point *steal_split_point_below(struct search_thread *t,
+						   struct split_point *ancestor)
+{
+	struct split_point *sp = NULL;
+	struct work_deque *d;
+	int i, k;
+
+	for (i = 0; i < nr_search_threads && !sp; i++) {
+		d = &search_threads[i].deque;
+		if (i == t->id || __atomic_load_n(&d->tail, __ATOMIC_RELAXED) ==
+				  __atomic_load_n(&d->head, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_mutex_lock(&d->lock);
+		for (k = d->head; k < d->tail; k++) {
+			if (split_point_has_work(d->sp[k]) &&
+			    split_point_below(d->sp[k], ancestor)) {
+				sp = d->sp[k];
+				__atomic_fetch_add(&sp->nr_helpers, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return sp;
+}
+
+static void ybwc_split(struct search_thread *t, struct chessboard *c,
+		       struct nnue_accumulator *acc, int color, int depth,
+		       struct ordered_move *moves, int n, int alpha, int beta,
+		       int *best_val, struct move *best_move)
+{
+	struct work_deque *d = &t->deque;
+	struct split_point sp = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.parent = t->cur_sp,
+		.c = c,
+		.acc = acc,
+		.moves = moves,
+		.nr_moves = n,
+		.next_move = 1,
+		.color = color,
+		.depth = depth,
+		.alpha = alpha,
+		.beta = beta,
+		.best_val = *best_val,
+		.best_move = *best_move,
+	};
+	struct split_point *child;
+
+	/* Helpers take moves in order, so finish sorting them now */
+	sort_ordered_moves(moves + 1, n - 1);
+
+	pthread_mutex_lock(&d->lock);
+	BUG_ON(d->tail == YBWC_MAX_SPLITS);
+	d->sp[d->tail] = &sp;
+	__atomic_store_n(&d->tail, d->tail + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&d->lock);
+
+	t->cur_sp = &sp;
+	search_split_moves(t, &sp, acc);
+
+	pthread_mutex_lock(&d->lock);
+	BUG_ON(d->sp[d->tail - 1] != &sp);
+	__atomic_store_n(&d->tail, d->tail - 1, __ATOMIC_RELAXED);
+	if (d->head > d->tail)
+		__atomic_store_n(&d->head, d->tail, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&d->lock);
+
+	/* Nothing above @acc on our stack is in use until we return */
+	while (__atomic_load_n(&sp.nr_helpers, __ATOMIC_ACQUIRE)) {
+		child = steal_split_point_below(t, &sp);
+		if (child)
+			help_split_point(t, child, acc ? acc + 1 : NULL);
+		else
+			sched_yield();
+	}
+
+	t->cur_sp = sp.parent;
+	*best_val = sp.best_val;
+	*best_move = sp.best_move;
+}
+
+static struct split_point *steal_split_point(struct search_thread *t)
+{
+	struct split_point *sp = NULL;
+	struct work_deque *d;
+	int i, len, victim = -1, busiest = 0;
+
+	for (i = 0; i < nr_search_threads; i++) {
+		if (i == t->id)
+			continue;
+
+		d = &search_threads[i].deque;
+		len = __atomic_load_n(&d->tail, __ATOMIC_RELAXED) -
+		      __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+		if (len > busiest) {
+			busiest = len;
+			victim = i;
+		}
+	}
+
+	if (victim == -1)
+		return NULL;
+
+	d = &search_threads[victim].deque;
+	pthread_mutex_lock(&d->lock);
+
+	/* Split points which have run out of moves are no use to anybody */
+	while (d->head < d->tail && !split_point_has_work(d->sp[d->head]))
+		__atomic_store_n(&d->head, d->head + 1, __ATOMIC_RELAXED);
+
+	if (d->head < d->tail) {
+		sp = d->sp[d->head];
+		__atomic_fetch_add(&sp->nr_helpers, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&d->lock);
+	return sp;
+}
+
+static void *ybwc_helper_thread(void *arg)
+{
+	struct search_thread *t = arg;
+	struct split_point *sp;
+
+	while (!__atomic_load_n(&search_done, __ATOMIC_RELAXED)) {
+		sp = steal_split_point(t);
+		if (!sp) {
+			sched_yield();
+			continue;
+		}
+
+		__atomic_fetch_sub(&nr_idle_threads, 1, __ATOMIC_RELAXED);
+		help_split_point(t, sp, t->acc);
+		__atomic_fetch_add(&nr_idle_threads, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static int next_root_move(struct search_thread *t, int prev)
+{
+	if (search_mode == SEARCH_DETERMINISTIC)
+		return prev < 0 ? t->id : prev + nr_search_threads;
+
+	return __atomic_fetch_add(&t->rs->next_move, 1, __ATOMIC_RELAXED);
+}
+
+static void publish_alpha(struct root_split *rs, int val)
+{
+	int cur = __atomic_load_n(&rs->alpha, __ATOMIC_RELAXED);
+
+	while (val > cur)
+		if (__atomic_compare_exchange_n(&rs->alpha, &cur, val, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+}
+
+/*
+ * Only a move which raised the alpha bound it was searched with has an exact
+ * score: anything else is merely an upper bound, so it can't be the best move.
+ */
+static void *root_search_thread(void *arg)
+{
+	struct search_thread *t = arg;
+	struct root_split *rs = t->rs;
+	struct nnue_accumulator *acc = NULL;
+	struct chessboard *cb;
+	int j = -1, val, alpha = -INT_MAX;
+
+	t->best_idx = -1;
+	t->best_val = -INT_MAX;
+
+	if (nnue_enabled()) {
+		acc = t->acc;
+		nnue_refresh(acc, rs->c);
+	}
+
+	while ((j = next_root_move(t, j)) < rs->nr_moves) {
+		if (search_mode != SEARCH_DETERMINISTIC)
+			alpha = __atomic_load_n(&rs->alpha, __ATOMIC_RELAXED);
+
+		cb = copy_board(rs->c);
+		make_move(t, cb, rs->c, acc, rs->moves[j].m);
+
+		val = -negamax_algo(t, cb, acc ? acc + 1 : NULL, !rs->color,
+				    rs->depth - 1, -INT_MAX, -alpha);
+		rs->scores[j] = val;
+		free(cb);
+
+		if (search_limit_hit())
+			break;
+
+		if (val > alpha && val > t->best_val) {
+			t->best_val = val;
+			t->best_idx = j;
+		}
+
+		alpha = max(alpha, val);
+		if (search_mode != SEARCH_DETERMINISTIC)
+			publish_alpha(rs, val);
+	}
+
+	trace_node(t, rs->depth, (struct move){0}, -INT_MAX, INT_MAX,
+		   t->best_val, TRACE_ROOT);
+	return NULL;
+}
+
+/*
+ * SEARCH CONFIGURATIONS
+ *
+ * A configuration is a set of search threads, with their scratch space and
+ * any private tables, for a given mode, thread count, and shared table. It is
+ * allocated once and can then be switched in and out cheaply, so a program
+ * playing two differently configured engines against each other doesn't pay
+ * for reallocating everything on every move. configure_search() is the simple
+ * interface for programs that only ever need one.
+ */
+
+struct search_config {
+	struct tt *tt;
+	enum search_mode mode;
+	int nr_threads;
+	struct search_thread *threads;
+};
+
+static struct search_config *default_config;
+
+struct search_config *search_config_alloc(struct tt *tt, int nr_threads,
+					  enum search_mode mode)
+{
+	struct search_config *cfg;
+	struct search_thread *t;
+	int i, j;
+
+	cfg = calloc(1, sizeof(*cfg));
+	if (!cfg)
+		fatal("Can't allocate search configuration\n");
+
+	cfg->tt = tt;
+	cfg->mode = mode;
+	cfg->nr_threads = mode == SEARCH_SERIAL ? 1 : max(nr_threads, 1);
+
+	cfg->threads = calloc(cfg->nr_threads, sizeof(*cfg->threads));
+	if (!cfg->threads)
+		fatal("Can't allocate search threads\n");
+
+	for (i = 0; i < cfg->nr_threads; i++) {
+		t = &cfg->threads[i];
+		t->id = i;
+		t->tt = tt;
+		t->trace = trace_ring(i);
+		pthread_mutex_init(&t->deque.lock, NULL);
+
+		t->leaf_mem = aligned_alloc(64, MAX_MOVES * board_size());
+		if (!t->leaf_mem)
+			fatal("Can't allocate leaf boards\n");
+
+		for (j = 0; j < MAX_MOVES; j++)
+			t->leaves[j] = t->leaf_mem + j * board_size();
+
+		t->acc = aligned_alloc(64, NNUE_MAX_PLY *
+				       sizeof(struct nnue_accumulator));
+		if (!t->acc)
+			fatal("Can't allocate accumulator stack\n");
+
+		if (mode == SEARCH_DETERMINISTIC &&
+		    tt_init(&t->tt, NULL, NULL, DETERMINISTIC_TT_MB))
+			fatal("Can't allocate private transposition table\n");
+	}
+
+	return cfg;
+}
+
+void search_config_free(struct search_config *cfg)
+{
+	int i;
+
+	if (search_threads == cfg->threads)
+		search_threads = NULL;
+
+	for (i = 0; i < cfg->nr_threads; i++) {
+		if (cfg->threads[i].tt != cfg->tt)
+			tt_close(cfg->threads[i].tt);
+
+		free(cfg->threads[i].acc);
+		free(cfg->threads[i].leaf_mem);
+	}
+
+	free(cfg->threads);
+	free(cfg);
+}
+
+void use_search_config(struct search_config *cfg)
+{
+	search_tt = cfg->tt;
+	search_mode = cfg->mode;
+	nr_search_threads = cfg->nr_threads;
+	search_threads = cfg->threads;
+}
+
+void configure_search(struct tt *tt, int nr_threads, enum search_mode mode)
+{
+	if (default_config)
+		search_config_free(default_config);
+
+	default_config = search_config_alloc(tt, nr_threads, mode);
+	use_search_config(default_config);
 }
 
 /* Returns sx|sy|dx|dy in an integer byte-by-byte from least to most
@@ -88,51 +879,690 @@ static int negamax_algo(struct chessboard *c, int color, int depth, int alpha, i
  *
  * We seperate the initial iteration of negamax out like this to track the
  * actual move associated with the best score. Doing so during the
- * deeper iterations is a waste of time. */
+ * deeper iterations is a waste of time.
+ *
+ * The root moves are fully sorted before any thread starts, so that a root
+ * move's index means the same thing to every thread.
+ *
+ * If performance counters are enabled, they are reported separately for
+ * ordering the root moves and for searching them.
+ *
+ * Scores are kept within [-INT_MAX,INT_MAX] so they can always be negated.
+ *
+ * If @stats is given, the search is silent and its statistics are returned
+ * there instead of being printed. */
+unsigned int calculate_move_stats(struct chessboard *c, int color, int depth,
+				  struct search_stats *stats)
+{
+	struct ordered_move moves[MAX_MOVES];
+	int scores[MAX_MOVES];
+	struct root_split rs = {
+		.c = c,
+		.moves = moves,
+		.scores = scores,
+		.color = color,
+		.depth = depth,
+		.alpha = -INT_MAX,
+	};
+	unsigned long expanded_moves = 0, evaluated_moves = 0, hash_hits = 0;
+	struct perf_sample ps[3];
+	struct search_thread *t;
+	struct move best_move = {0};
+	struct tt_hit hit;
+	unsigned long long key;
+	int i, j, n, aborted, best_idx = -1, best_val = -INT_MAX;
+	int fbsx = -1, fbsy = -1, fbdx = -1, fbdy = -1;
+
+	if (!search_threads)
+		configure_search(NULL, 1, SEARCH_SERIAL);
+
+	BUG_ON(depth >= NNUE_MAX_PLY);
+
+	if (perf_enabled())
+		perf_sample(&ps[0]);
+
+	/* The deterministic search can't depend on what's in the shared table */
+	key = board_hash(c, color);
+	if (search_mode == SEARCH_DETERMINISTIC || !tt_probe(search_tt, key, &hit))
+		n = enumerate_ordered_moves(c, color, moves, NULL);
+	else
+		n = enumerate_ordered_moves(c, color, moves, &hit.m);
+
+	sort_ordered_moves(moves, n);
+
+	if (perf_enabled())
+		perf_sample(&ps[1]);
+
+	if (trace_ring(0))
+		trace_new_search();
+
+	rs.nr_moves = n;
+	search_done = 0;
+	nr_idle_threads = nr_search_threads - 1;
+	for (i = 0; i < nr_search_threads; i++) {
+		t = &search_threads[i];
+		t->rs = &rs;
+		t->best_idx = -1;
+		t->expanded_moves = 0;
+		t->evaluated_moves = 0;
+		t->hash_hits = 0;
+
+		if (search_mode == SEARCH_DETERMINISTIC)
+			tt_clear(t->tt);
+
+		if (i && pthread_create(&t->thread, NULL, search_mode == SEARCH_YBWC ?
+				   ybwc_helper_thread : root_search_thread, t))
+			fatal("Can't create search thread\n");
+	}
+
+	root_search_thread(&search_threads[0]);
+	__atomic_store_n(&search_done, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nr_search_threads; i++) {
+		t = &search_threads[i];
+		if (i)
+			pthread_join(t->thread, NULL);
+
+		expanded_moves += t->expanded_moves;
+		evaluated_moves += t->evaluated_moves;
+		hash_hits += t->hash_hits;
+
+		if (t->best_idx == -1)
+			continue;
+
+		if (t->best_val > best_val || (t->best_val == best_val && t->best_idx < best_idx)) {
+			best_val = t->best_val;
+			best_idx = t->best_idx;
+		}
+	}
+
+	if (perf_enabled())
+		perf_sample(&ps[2]);
+
+	aborted = search_limit_hit();
+	expanded_moves += n;
+	for (j = 0; j < n && !stats; j++) {
+		struct move m = moves[j].m;
+
+		printf("Move %d/%d (%d,%d) => (%d,%d) has heuristic value %d\n", j + 1, n, move_sx(m), move_sy(m), move_dx(m), move_dy(m), scores[j]);
+	}
+
+	if (best_idx != -1) {
+		best_move = moves[best_idx].m;
+		fbsx = move_sx(best_move);
+		fbsy = move_sy(best_move);
+		fbdx = move_dx(best_move);
+		fbdy = move_dy(best_move);
+
+		if (!aborted)
+			tt_store(search_tt, key, depth, best_val, TT_EXACT, best_move);
+	}
+
+	if (stats) {
+		stats->expanded_moves = expanded_moves;
+		stats->evaluated_moves = evaluated_moves;
+		stats->hash_hits = hash_hits;
+		stats->score = best_val;
+		stats->depth = depth;
+		stats->aborted = aborted;
+	} else {
+		printf("Evaluated %lu/%lu expanded moves, %lu hash hits\n", evaluated_moves, expanded_moves, hash_hits);
+	}
+
+	if (perf_enabled()) {
+		perf_report("order", &ps[0], &ps[1], n);
+		perf_report("search", &ps[1], &ps[2], evaluated_moves);
+		perf_report("total", &ps[0], &ps[2], evaluated_moves);
+	}
+
+	return (fbsx) | (fbsy << 8) | (fbdx << 16) | (fbdy << 24);
+}
+
 unsigned int calculate_move(struct chessboard *c, int color, int depth)
 {
+	return calculate_move_stats(c, color, depth, NULL);
+}
+
+/*
+ * Like calculate_move_stats(), but answer from @rc if it holds a result from a
+ * search of this position at least @depth deep with the same configuration,
+ * and remember the result otherwise. On a hit, @stats has the cached depth and
+ * score, and no nodes.
+ */
+unsigned int calculate_move_cached(struct result_cache *rc, struct chessboard *c,
+				   int color, int depth, struct search_stats *stats)
+{
+	unsigned long long key = board_hash(c, color);
+	unsigned int mv, params = search_mode << 1 | nnue_enabled();
+	struct cache_result res;
+
+	if (cache_lookup(rc, key, params, depth, &res)) {
+		memset(stats, 0, sizeof(*stats));
+		stats->score = res.score;
+		stats->depth = res.depth;
+		return res.move;
+	}
+
+	mv = calculate_move_stats(c, color, depth, stats);
+	if (!stats->aborted)
+		cache_insert(rc, key, params, depth, mv, stats->score);
+
+	return mv;
+}
+
+/*
+ * Deepen one ply at a time until the time manager says to stop, and return
+ * the best move from the last iteration which wasn't interrupted. @stats
+ * covers all the iterations, and its depth is the last completed one.
+ *
+ * If the hard limit is so short that even the first iteration doesn't
+ * finish, it is searched again without one: some move must be returned.
+ */
+unsigned int calculate_move_timed(struct chessboard *c, int color,
+				  struct time_manager *tm,
+				  struct search_stats *stats)
+{
+	struct search_stats st;
+	unsigned int mv, best = -1;
+	int depth;
+
+	memset(stats, 0, sizeof(*stats));
+	for (depth = 1; depth < NNUE_MAX_PLY; depth++) {
+		mv = calculate_move_stats(c, color, depth, &st);
+		stats->expanded_moves += st.expanded_moves;
+		stats->evaluated_moves += st.evaluated_moves;
+		stats->hash_hits += st.hash_hits;
+
+		if (st.aborted) {
+			if (depth > 1)
+				break;
+
+			tm_stop(tm);
+			mv = calculate_move_stats(c, color, depth, &st);
+		}
+
+		best = mv;
+		stats->score = st.score;
+		stats->depth = depth;
+
+		/* No moves */
+		if ((mv & 0xff) == 0xff)
+			break;
+
+		if (!tm_next_iteration(tm, mv, st.score))
+			break;
+	}
+
+	tm_stop(tm);
+	return best;
+}
+
+/*
+ * MULTI-PV
+ *
+ * Iterative deepening which finds exact scores for the best @nr_lines root
+ * moves, rather than just the best one. Each root move is searched with alpha
+ * at the score of the worst line kept so far at that depth, so only moves
+ * which displace a line get exact scores: the rest fail low just as cheaply
+ * as they would in a normal search.
+ *
+ * All the lines share the transposition table, within an iteration and from
+ * one iteration to the next, and the root moves are re-sorted by score after
+ * each iteration so the previous lines are searched first and set the bar
+ * high straight away. The PV of each line is read back out of the table as
+ * soon as its move has been searched.
+ *
+ * The root moves are searched one at a time on the first search thread, so
+ * YBWC never splits and root splitting doesn't apply. The lines are printed
+ * after every iteration, and the ones from the last are left in @lines, best
+ * first. Returns the number of lines, which is less than @nr_lines if there
+ * aren't that many moves.
+ */
+
+static int extract_pv(struct search_thread *t, struct chessboard *c, int color,
+		      struct move first, int depth, struct move *pv)
+{
+	struct chessboard *cb = copy_board(c);
+	struct tt_hit hit;
+	struct move m = first;
+	int n = 0, contents;
+
+	while (1) {
+		pv[n++] = m;
+		execute_raw_move(cb, m);
+		color = !color;
+
+		if (n == depth || n == MAX_PV)
+			break;
+
+		if (!tt_probe(t->tt, board_hash(cb, color), &hit))
+			break;
+
+		/* The entry could be a collision, so sanity check the move */
+		m = hit.m;
+		contents = square_contents(cb, move_sx(m), move_sy(m));
+		if (!contents || contents >> 3 != color || same_move(m, (struct move){0}))
+			break;
+	}
+
+	free(cb);
+	return n;
+}
+
+static void print_pv_line(int depth, int nr, const struct pv_line *l)
+{
+	int i;
+
+	printf("Depth %d line %d score %d pv", depth, nr + 1, l->score);
+	for (i = 0; i < l->len; i++)
+		printf(" (%d,%d)=>(%d,%d)", move_sx(l->pv[i]), move_sy(l->pv[i]),
+		       move_dx(l->pv[i]), move_dy(l->pv[i]));
+
+	printf("\n");
+}
+
+int calculate_multipv(struct chessboard *c, int color, int depth, int nr_lines,
+		      struct pv_line *lines)
+{
+	struct ordered_move moves[MAX_MOVES], tmp;
+	int scores[MAX_MOVES];
+	struct root_split rs = {
+		.c = c,
+		.moves = moves,
+		.scores = scores,
+		.color = color,
+	};
+	struct nnue_accumulator *acc = NULL;
+	struct search_thread *t;
 	struct chessboard *cb;
-	const struct piece *p;
-	struct piece_iterator *i = NULL;
-	struct move_list *l;
-	int j, n = 0, fbsx = -1, fbsy = -1, fbdx = -1, fbdy = -1;
-	int val, best_val = INT_MIN, alpha = INT_MIN, beta = INT_MAX;
-	struct move m;
+	int d, i, j, n, nr = 0, val, alpha;
+
+	if (!search_threads)
+		configure_search(NULL, 1, SEARCH_SERIAL);
+
+	BUG_ON(depth >= NNUE_MAX_PLY || nr_lines < 1);
+
+	t = &search_threads[0];
+	t->rs = &rs;
+	t->expanded_moves = 0;
+	t->evaluated_moves = 0;
+	t->hash_hits = 0;
+	nr_idle_threads = 0;
+
+	if (search_mode == SEARCH_DETERMINISTIC)
+		tt_clear(t->tt);
+
+	if (nnue_enabled()) {
+		acc = t->acc;
+		nnue_refresh(acc, c);
+	}
+
+	n = enumerate_ordered_moves(c, color, moves, NULL);
+	sort_ordered_moves(moves, n);
 
-	expanded_moves = 0;
-	evaluated_moves = 0;
+	nr_lines = min(nr_lines, n);
+	t->expanded_moves += n;
 
-	while ((p = iterate_color(c, &i, color))) {
-		l = allocate_move_list();
-		n = enumerate_moves(c, p, l);
-		expanded_moves += n;
+	for (d = 1; d <= depth; d++) {
+		if (trace_ring(0))
+			trace_new_search();
+
+		rs.depth = d;
+		nr = 0;
 
 		for (j = 0; j < n; j++) {
-			m = pop_move(l);
+			alpha = nr < nr_lines ? -INT_MAX : lines[nr - 1].score;
+
 			cb = copy_board(c);
+			make_move(t, cb, c, acc, moves[j].m);
+			val = -negamax_algo(t, cb, acc ? acc + 1 : NULL, !color,
+					    d - 1, -INT_MAX, -alpha);
+			free(cb);
 
-			execute_raw_move(cb, m);
-			evaluated_moves++;
+			/* Fail lows are upper bounds below every line's score */
+			scores[j] = val;
+			if (val <= alpha)
+				continue;
 
-			val = -negamax_algo(cb, !color, depth - 1, -beta, -alpha);
+			for (i = min(nr, nr_lines - 1); i > 0 && lines[i - 1].score < val; i--)
+				lines[i] = lines[i - 1];
 
-			alpha = max(alpha, val);
-			if (val > best_val) {
-				best_val = val;
-				fbsx = m.sx;
-				fbsy = m.sy;
-				fbdx = m.dx;
-				fbdy = m.dy;
+			lines[i].score = val;
+			lines[i].len = extract_pv(t, c, color, moves[j].m, d,
+						  lines[i].pv);
+			nr = min(nr + 1, nr_lines);
+		}
+
+		trace_node(t, d, (struct move){0}, -INT_MAX, INT_MAX,
+			   nr ? lines[0].score : -INT_MAX, TRACE_ROOT);
+
+		/* Insertion sort, so equal scores keep their previous order */
+		for (j = 1; j < n; j++) {
+			tmp = moves[j];
+			val = scores[j];
+			for (i = j; i > 0 && scores[i - 1] < val; i--) {
+				moves[i] = moves[i - 1];
+				scores[i] = scores[i - 1];
 			}
 
-			printf("Move %d/%d for piece %016lx (%d,%d) => (%d,%d) has heuristic value %d\n", j + 1, n, (unsigned long)p, m.sx, m.sy, m.dx, m.dy, val);
-			free(cb);
+			moves[i] = tmp;
+			scores[i] = val;
 		}
 
-		free_move_list(l);
+		printf("Depth %d: evaluated %lu/%lu expanded moves, %lu hash hits\n",
+		       d, t->evaluated_moves, t->expanded_moves, t->hash_hits);
+		for (i = 0; i < nr; i++)
+			print_pv_line(d, i, &lines[i]);
 	}
-	expanded_moves += n;
-	printf("Evaluated %luM/%luM expanded moves\n", evaluated_moves / 1000000, expanded_moves / 1000000);
 
-	return (fbsx) | (fbsy << 8) | (fbdx << 16) | (fbdy << 24);
+	return nr;
+}
+
+/*
+ * RESUMABLE SEARCH
+ *
+ * The same alpha-beta search as negamax_algo(), with the recursion unrolled
+ * onto an explicit stack of frames so it can be suspended after any number of
+ * nodes and resumed later, on any thread. A task owns everything it needs: a
+ * frame for every ply, each with its own board and move list, all allocated
+ * up front for the deepest search it will ever be asked to do. So the memory
+ * used by a task is fixed, and a scheduler can juggle thousands of them on a
+ * handful of threads (see pool.c).
+ *
+ * A task deepens one ply at a time until it reaches its depth limit or has
+ * searched its node budget. The iteration in progress when the budget runs
+ * out is abandoned, and the best move from the last complete one is the
+ * result: the first iteration always completes, so there's always a move if
+ * there are any moves at all. Given the same table contents, an iteration
+ * finds the same move and score as calculate_move() does at that depth in
+ * serial mode (board-tests.c checks this), and visits interior nodes in the
+ * same order. The node counts differ, though: here the leaves are evaluated
+ * one at a time and cutoffs skip the rest, while calculate_move() evaluates
+ * every leaf at the last ply at once (see search_leaves()).
+ *
+ * There are no threads, NNUE, or tracing here, but the transposition table
+ * can be shared with other tasks and searches.
+ */
+
+enum frame_state {
+	FRAME_ENTER,
+	FRAME_NEXT_MOVE,
+};
+
+struct search_frame {
+	struct chessboard *c;
+	struct ordered_move moves[MAX_MOVES];
+	struct move best_move;
+	unsigned long long key;
+	enum frame_state state;
+	int nr_moves;
+	int next_move;
+	int color;
+	int depth;
+	int alpha;
+	int beta;
+	int orig_alpha;
+	int best_val;
+};
+
+struct search_task {
+	struct tt *tt;
+	struct search_frame *frames;
+	int nr_frames;
+	int max_depth;
+	int sp;
+	int depth;
+	int done;
+	unsigned long nodes;
+	unsigned long max_nodes;
+	unsigned long expanded_moves;
+	unsigned long hash_hits;
+
+	/* The result of the last complete iteration */
+	struct move best_move;
+	int best_val;
+	int best_depth;
+	int nr_moves;
+};
+
+/*
+ * Frame @max_depth is never entered: the frames at depth one make the leaves
+ * in its board.
+ */
+struct search_task *search_task_alloc(int max_depth)
+{
+	struct search_task *s;
+	int i;
+
+	BUG_ON(max_depth < 1);
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		fatal("-ENOMEM allocating search task\n");
+
+	s->frames = calloc(max_depth + 1, sizeof(*s->frames));
+	if (!s->frames)
+		fatal("-ENOMEM allocating search frames\n");
+
+	for (i = 0; i <= max_depth; i++)
+		s->frames[i].c = get_zero_board();
+
+	s->nr_frames = max_depth + 1;
+	s->done = 1;
+	return s;
+}
+
+void search_task_free(struct search_task *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_frames; i++)
+		free(s->frames[i].c);
+
+	free(s->frames);
+	free(s);
+}
+
+size_t search_task_size(int max_depth)
+{
+	return sizeof(struct search_task) + (max_depth + 1) *
+	       (sizeof(struct search_frame) + board_size());
+}
+
+static void task_enter_frame(struct search_frame *f, int depth, int alpha,
+			     int beta)
+{
+	f->state = FRAME_ENTER;
+	f->depth = depth;
+	f->alpha = alpha;
+	f->orig_alpha = alpha;
+	f->beta = beta;
+	f->best_val = -INT_MAX;
+	f->best_move = (struct move){0};
+}
+
+static void task_start_iteration(struct search_task *s, int depth)
+{
+	s->depth = depth;
+	s->sp = 0;
+	task_enter_frame(&s->frames[0], depth, -INT_MAX, INT_MAX);
+}
+
+/*
+ * Begin searching @c for @color to move. @c is copied, so the caller can do
+ * what it likes with it while the task runs.
+ */
+void search_task_start(struct search_task *s, struct tt *tt,
+		       struct chessboard *c, int color, int max_depth,
+		       unsigned long max_nodes)
+{
+	BUG_ON(max_depth < 1 || max_depth >= s->nr_frames);
+
+	copy_board_into(s->frames[0].c, c);
+	s->frames[0].color = color;
+	s->tt = tt;
+	s->max_depth = max_depth;
+	s->max_nodes = max_nodes;
+	s->nodes = 0;
+	s->expanded_moves = 0;
+	s->hash_hits = 0;
+	s->best_depth = 0;
+	s->done = 0;
+	task_start_iteration(s, 1);
+}
+
+static void task_iteration_done(struct search_task *s)
+{
+	struct search_frame *f = &s->frames[0];
+
+	s->best_move = f->best_move;
+	s->best_val = f->best_val;
+	s->best_depth = s->depth;
+	s->nr_moves = f->nr_moves;
+
+	if (s->depth == s->max_depth || s->nodes >= s->max_nodes || !f->nr_moves) {
+		s->done = 1;
+		return;
+	}
+
+	task_start_iteration(s, s->depth + 1);
+}
+
+static void frame_child_result(struct search_frame *f, int val)
+{
+	struct move m = f->moves[f->next_move++].m;
+
+	if (val > f->best_val) {
+		f->best_val = val;
+		f->best_move = m;
+	}
+
+	f->alpha = max(f->alpha, val);
+}
+
+static void task_return(struct search_task *s, int val)
+{
+	if (!s->sp) {
+		task_iteration_done(s);
+		return;
+	}
+
+	frame_child_result(&s->frames[--s->sp], -val);
+}
+
+static void task_exit_frame(struct search_task *s, struct search_frame *f)
+{
+	enum tt_bound bound;
+
+	if (f->best_val <= f->orig_alpha)
+		bound = TT_UPPER;
+	else if (f->best_val >= f->beta)
+		bound = TT_LOWER;
+	else
+		bound = TT_EXACT;
+
+	tt_store(s->tt, f->key, f->depth, f->best_val, bound, f->best_move);
+	task_return(s, f->best_val);
+}
+
+/*
+ * Returns nonzero if the hash hit settles the node. The root never takes a
+ * hash cutoff, since it has to come up with a move.
+ */
+static int frame_probe(struct search_task *s, struct search_frame *f,
+		       struct tt_hit *hit)
+{
+	if (!s->sp || hit->depth < f->depth)
+		return 0;
+
+	s->hash_hits++;
+	if (hit->bound == TT_EXACT)
+		return 1;
+	else if (hit->bound == TT_LOWER)
+		f->alpha = max(f->alpha, hit->score);
+	else
+		f->beta = min(f->beta, hit->score);
+
+	return f->alpha >= f->beta;
+}
+
+/*
+ * Search at most @nr_nodes more nodes. Returns nonzero once the search is
+ * finished, after which search_task_result() has the answer.
+ */
+int search_task_step(struct search_task *s, unsigned long nr_nodes)
+{
+	unsigned long stop = s->nodes + nr_nodes;
+	struct search_frame *f, *child;
+	struct tt_hit hit;
+	struct move m;
+	int hashed;
+
+	while (!s->done && s->nodes < stop) {
+		if (s->nodes >= s->max_nodes && s->depth > 1) {
+			s->done = 1;
+			break;
+		}
+
+		f = &s->frames[s->sp];
+		if (f->state == FRAME_ENTER) {
+			f->key = board_hash(f->c, f->color);
+			hashed = tt_probe(s->tt, f->key, &hit);
+			if (hashed && frame_probe(s, f, &hit)) {
+				task_return(s, hit.score);
+				continue;
+			}
+
+			f->nr_moves = enumerate_ordered_moves(f->c, f->color, f->moves,
+							      hashed ? &hit.m : NULL);
+			f->next_move = 0;
+			f->state = FRAME_NEXT_MOVE;
+			s->expanded_moves += f->nr_moves;
+		}
+
+		if (f->next_move == f->nr_moves || f->alpha >= f->beta) {
+			task_exit_frame(s, f);
+			continue;
+		}
+
+		m = next_ordered_move(f->moves, f->nr_moves, f->next_move);
+		child = f + 1;
+		copy_board_into(child->c, f->c);
+		execute_raw_move(child->c, m);
+		s->nodes++;
+
+		if (f->depth == 1) {
+			frame_child_result(f, -evaluate(child->c, !f->color, NULL));
+			continue;
+		}
+
+		child->color = !f->color;
+		task_enter_frame(child, f->depth - 1, -f->beta, -f->alpha);
+		s->sp++;
+	}
+
+	return s->done;
+}
+
+/*
+ * Returns the move from the last complete iteration like calculate_move(),
+ * and fills in @stats if it is given.
+ */
+unsigned int search_task_result(struct search_task *s, struct search_stats *stats)
+{
+	struct move m = s->best_move;
+
+	if (stats) {
+		stats->expanded_moves = s->expanded_moves;
+		stats->evaluated_moves = s->nodes;
+		stats->hash_hits = s->hash_hits;
+		stats->score = s->best_val;
+		stats->depth = s->best_depth;
+		stats->aborted = s->best_depth != s->depth;
+	}
+
+	if (!s->nr_moves)
+		return -1;
+
+	return move_sx(m) | move_sy(m) << 8 | move_dx(m) << 16 | move_dy(m) << 24;
 }
@@ -2,4 +2,60 @@
 
 #include "board.h"
 
+enum search_mode {
+	SEARCH_SERIAL		= 0,
+	SEARCH_ROOT_SPLIT	= 1,
+	SEARCH_DETERMINISTIC	= 2,
+	SEARCH_YBWC		= 3,
+};
+
+struct tt;
+struct time_manager;
+struct result_cache;
+
+struct search_stats {
+	unsigned long expanded_moves;
+	unsigned long evaluated_moves;
+	unsigned long hash_hits;
+	int score;
+	int depth;
+	int aborted;
+};
+
+#define MAX_PV 32
+
+struct pv_line {
+	int score;
+	int len;
+	struct move pv[MAX_PV];
+};
+
+struct search_config;
+
+struct search_config *search_config_alloc(struct tt *tt, int nr_threads,
+					  enum search_mode mode);
+void search_config_free(struct search_config *cfg);
+void use_search_config(struct search_config *cfg);
+void configure_search(struct tt *tt, int nr_threads, enum search_mode mode);
+void search_node_limit(unsigned long max_nodes);
 unsigned int calculate_move(struct chessboard *c, int color, int depth);
+unsigned int calculate_move_stats(struct chessboard *c, int color, int depth,
+				  struct search_stats *stats);
+unsigned int calculate_move_cached(struct result_cache *rc, struct chessboard *c,
+				   int color, int depth, struct search_stats *stats);
+unsigned int calculate_move_timed(struct chessboard *c, int color,
+				  struct time_manager *tm,
+				  struct search_stats *stats);
+int calculate_multipv(struct chessboard *c, int color, int depth, int nr_lines,
+		      struct pv_line *lines);
+
+struct search_task;
+
+struct search_task *search_task_alloc(int max_depth);
+void search_task_free(struct search_task *s);
+size_t search_task_size(int max_depth);
+void search_task_start(struct search_task *s, struct tt *tt,
+		       struct chessboard *c, int color, int max_depth,
+		       unsigned long max_nodes);
+int search_task_step(struct search_task *s, unsigned long nr_nodes);
+unsigned int search_task_result(struct search_task *s, struct search_stats *stats);
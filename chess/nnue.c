@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "nnue.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NNUE_X86
+#endif
+
+#include "common.h"
+
+/*
+ * EFFICIENTLY UPDATABLE NEURAL NETWORK EVALUATION
+ *
+ * The input layer has one feature for each (color, type, square) a piece can
+ * occupy, and its output is the "accumulator": the sum of the weight rows of
+ * every feature present on the board, plus a bias. A move only turns on or
+ * off two or three features, so the accumulator for a child position is
+ * computed from its parent's by adding and subtracting a few rows, rather
+ * than from scratch. The search keeps a stack of them, one per ply.
+ *
+ * The rest of the network is small: the clipped accumulator feeds a 32-wide
+ * hidden layer, whose clipped output feeds a single output neuron. All the
+ * arithmetic is on 16-bit integers with 32-bit sums, which is what the SSE2
+ * and AVX2 pmaddwd instructions do, so those layers have SIMD kernels. The
+ * best one the CPU supports is chosen when the network is loaded.
+ *
+ * The score is always from white's point of view, in the same units as
+ * calculate_board_heuristic().
+ *
+ * Several networks can be open at once, but only one is in use at a time:
+ * nnue_use() switches between them without touching the files again, and
+ * nnue_load() is the simple interface for programs that only need one.
+ *
+ * The weights are memory mapped directly from a file, which is a 64-byte
+ * header followed by these little-endian arrays, in order:
+ *
+ *	short	l0_weights[NNUE_INPUTS][NNUE_HIDDEN]
+ *	short	l0_bias[NNUE_HIDDEN]
+ *	short	l1_weights[NNUE_L1][NNUE_HIDDEN]
+ *	int	l1_bias[NNUE_L1]
+ *	short	l2_weights[NNUE_L1]
+ *	int	l2_bias
+ */
+
+#define NNUE_MAGIC "CHESSNN"
+#define NNUE_VERSION 1
+#define NNUE_CLIP 127
+#define NNUE_L1_SHIFT 6
+#define NNUE_OUTPUT_SCALE 16
+
+struct nnue_file_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int inputs;
+	unsigned int hidden;
+	unsigned int l1;
+	char pad[40];
+};
+
+struct nnue_net {
+	const short *l0_weights;
+	const short *l0_bias;
+	const short *l1_weights;
+	const int *l1_bias;
+	const short *l2_weights;
+	const int *l2_bias;
+};
+
+struct nnue_network {
+	struct nnue_net net;
+	void *map;
+	size_t map_len;
+};
+
+static struct nnue_net net;
+static void *map;
+static struct nnue_network *loaded;
+
+static int (*forward)(const struct nnue_accumulator *acc);
+
+static inline int clip(int v, int hi)
+{
+	return v < 0 ? 0 : v > hi ? hi : v;
+}
+
+static int forward_scalar(const struct nnue_accumulator *acc)
+{
+	short hidden[NNUE_HIDDEN], l1[NNUE_L1];
+	int i, j, sum;
+
+	for (i = 0; i < NNUE_HIDDEN; i++)
+		hidden[i] = clip(acc->v[i], NNUE_CLIP);
+
+	for (i = 0; i < NNUE_L1; i++) {
+		sum = net.l1_bias[i];
+		for (j = 0; j < NNUE_HIDDEN; j++)
+			sum += hidden[j] * net.l1_weights[i * NNUE_HIDDEN + j];
+
+		l1[i] = clip(sum >> NNUE_L1_SHIFT, NNUE_CLIP);
+	}
+
+	sum = *net.l2_bias;
+	for (i = 0; i < NNUE_L1; i++)
+		sum += l1[i] * net.l2_weights[i];
+
+	return sum / NNUE_OUTPUT_SCALE;
+}
+
+#ifdef NNUE_X86
+
+__attribute__((target("sse2")))
+static int hsum_sse2(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+	return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static int forward_sse2(const struct nnue_accumulator *acc)
+{
+	__m128i hidden[NNUE_HIDDEN / 8], l1[NNUE_L1 / 8];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i hi = _mm_set1_epi16(NNUE_CLIP);
+	int sums[NNUE_L1];
+	__m128i sum;
+	int i, j;
+
+	for (i = 0; i < NNUE_HIDDEN / 8; i++) {
+		hidden[i] = _mm_loadu_si128((const __m128i *)&acc->v[i * 8]);
+		hidden[i] = _mm_min_epi16(_mm_max_epi16(hidden[i], zero), hi);
+	}
+
+	for (i = 0; i < NNUE_L1; i++) {
+		const short *w = &net.l1_weights[i * NNUE_HIDDEN];
+
+		sum = zero;
+		for (j = 0; j < NNUE_HIDDEN / 8; j++)
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(hidden[j],
+					    _mm_loadu_si128((const __m128i *)&w[j * 8])));
+
+		sums[i] = (hsum_sse2(sum) + net.l1_bias[i]) >> NNUE_L1_SHIFT;
+	}
+
+	for (i = 0; i < NNUE_L1 / 8; i++) {
+		l1[i] = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)&sums[i * 8]),
+					_mm_loadu_si128((const __m128i *)&sums[i * 8 + 4]));
+		l1[i] = _mm_min_epi16(_mm_max_epi16(l1[i], zero), hi);
+	}
+
+	sum = zero;
+	for (i = 0; i < NNUE_L1 / 8; i++)
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(l1[i],
+				    _mm_loadu_si128((const __m128i *)&net.l2_weights[i * 8])));
+
+	return (hsum_sse2(sum) + *net.l2_bias) / NNUE_OUTPUT_SCALE;
+}
+
+__attribute__((target("avx2")))
+static int hsum_avx2(__m256i v)
+{
+	__m128i r = _mm_add_epi32(_mm256_castsi256_si128(v),
+				  _mm256_extracti128_si256(v, 1));
+
+	r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0x4e));
+	r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0xb1));
+	return _mm_cvtsi128_si32(r);
+}
+
+__attribute__((target("avx2")))
+static int forward_avx2(const struct nnue_accumulator *acc)
+{
+	__m256i hidden[NNUE_HIDDEN / 16], l1[NNUE_L1 / 16];
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i hi = _mm256_set1_epi16(NNUE_CLIP);
+	int sums[NNUE_L1];
+	__m256i sum;
+	int i, j;
+
+	for (i = 0; i < NNUE_HIDDEN / 16; i++) {
+		hidden[i] = _mm256_load_si256((const __m256i *)&acc->v[i * 16]);
+		hidden[i] = _mm256_min_epi16(_mm256_max_epi16(hidden[i], zero), hi);
+	}
+
+	for (i = 0; i < NNUE_L1; i++) {
+		const short *w = &net.l1_weights[i * NNUE_HIDDEN];
+
+		sum = zero;
+		for (j = 0; j < NNUE_HIDDEN / 16; j++)
+			sum = _mm256_add_epi32(sum, _mm256_madd_epi16(hidden[j],
+					       _mm256_loadu_si256((const __m256i *)&w[j * 16])));
+
+		sums[i] = (hsum_avx2(sum) + net.l1_bias[i]) >> NNUE_L1_SHIFT;
+	}
+
+	/* packs works within 128-bit lanes, hence the permute */
+	for (i = 0; i < NNUE_L1 / 16; i++) {
+		l1[i] = _mm256_packs_epi32(_mm256_loadu_si256((const __m256i *)&sums[i * 16]),
+					   _mm256_loadu_si256((const __m256i *)&sums[i * 16 + 8]));
+		l1[i] = _mm256_permute4x64_epi64(l1[i], 0xd8);
+		l1[i] = _mm256_min_epi16(_mm256_max_epi16(l1[i], zero), hi);
+	}
+
+	sum = zero;
+	for (i = 0; i < NNUE_L1 / 16; i++)
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(l1[i],
+				       _mm256_loadu_si256((const __m256i *)&net.l2_weights[i * 16])));
+
+	return (hsum_avx2(sum) + *net.l2_bias) / NNUE_OUTPUT_SCALE;
+}
+
+static void select_kernel(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		forward = forward_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		forward = forward_sse2;
+	else
+		forward = forward_scalar;
+}
+
+#else
+
+static void select_kernel(void)
+{
+	forward = forward_scalar;
+}
+
+#endif
+
+static int feature(int contents, int x, int y)
+{
+	int color = contents >> 3, type = contents & 7;
+
+	return ((color * 6 + type - 1) << 6) | (y << 3 | x);
+}
+
+static void add_feature(struct nnue_accumulator *acc, int f)
+{
+	const short *w = &net.l0_weights[f * NNUE_HIDDEN];
+	int i;
+
+	for (i = 0; i < NNUE_HIDDEN; i++)
+		acc->v[i] += w[i];
+}
+
+static void sub_feature(struct nnue_accumulator *acc, int f)
+{
+	const short *w = &net.l0_weights[f * NNUE_HIDDEN];
+	int i;
+
+	for (i = 0; i < NNUE_HIDDEN; i++)
+		acc->v[i] -= w[i];
+}
+
+void nnue_refresh(struct nnue_accumulator *acc, struct chessboard *c)
+{
+	int x, y, contents;
+
+	memcpy(acc->v, net.l0_bias, sizeof(acc->v));
+	for (y = 0; y < 8; y++) {
+		for (x = 0; x < 8; x++) {
+			contents = square_contents(c, x, y);
+			if (contents)
+				add_feature(acc, feature(contents, x, y));
+		}
+	}
+}
+
+/*
+ * Compute the accumulator for the position after @m is made on @c, which must
+ * be the position @parent was computed for.
+ */
+void nnue_update(struct nnue_accumulator *child,
+		 const struct nnue_accumulator *parent,
+		 struct chessboard *c, struct move m)
+{
+	int sx = move_sx(m), sy = move_sy(m), dx = move_dx(m), dy = move_dy(m);
+	int src = square_contents(c, sx, sy);
+	int dst = square_contents(c, dx, dy);
+	int rook = (src & 8) | ROOK;
+
+	*child = *parent;
+	sub_feature(child, feature(src, sx, sy));
+	if (dst)
+		sub_feature(child, feature(dst, dx, dy));
+
+	switch (src & 7) {
+	case PAWN:
+		/* A pawn moving diagonally onto an empty square is en passant */
+		if (sx != dx && !dst)
+			sub_feature(child, feature(src ^ 8, dx, sy));
+
+		if (dy == 0 || dy == 7)
+			src = (src & 8) | move_promotion(m);
+		break;
+	case KING:
+		if (dx - sx == 2) {
+			sub_feature(child, feature(rook, 7, sy));
+			add_feature(child, feature(rook, 5, sy));
+		} else if (sx - dx == 2) {
+			sub_feature(child, feature(rook, 0, sy));
+			add_feature(child, feature(rook, 3, sy));
+		}
+		break;
+	}
+
+	add_feature(child, feature(src, dx, dy));
+}
+
+int nnue_evaluate(const struct nnue_accumulator *acc)
+{
+	return forward(acc);
+}
+
+int nnue_enabled(void)
+{
+	return !!map;
+}
+
+/*
+ * Map the network weights from @path. Returns 0 on success, or a negative
+ * error code.
+ */
+int nnue_open(struct nnue_network **ret, const char *path)
+{
+	struct nnue_network *n;
+	const struct nnue_file_header *h;
+	const char *p;
+	struct stat st;
+	size_t len;
+	int fd, err;
+
+	len = sizeof(*h);
+	len += NNUE_INPUTS * NNUE_HIDDEN * sizeof(short);
+	len += NNUE_HIDDEN * sizeof(short);
+	len += NNUE_L1 * NNUE_HIDDEN * sizeof(short);
+	len += NNUE_L1 * sizeof(int);
+	len += NNUE_L1 * sizeof(short);
+	len += sizeof(int);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (st.st_size != (off_t)len) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	err = -errno;
+	close(fd);
+	if (p == MAP_FAILED)
+		return err;
+
+	h = (const void *)p;
+	if (memcmp(h->magic, NNUE_MAGIC, sizeof(NNUE_MAGIC)) ||
+	    h->version != NNUE_VERSION || h->inputs != NNUE_INPUTS ||
+	    h->hidden != NNUE_HIDDEN || h->l1 != NNUE_L1) {
+		munmap((void *)p, len);
+		return -EINVAL;
+	}
+
+	n = calloc(1, sizeof(*n));
+	if (!n) {
+		munmap((void *)p, len);
+		return -ENOMEM;
+	}
+
+	n->map = (void *)p;
+	n->map_len = len;
+
+	p += sizeof(*h);
+	n->net.l0_weights = (const short *)p;
+	p += NNUE_INPUTS * NNUE_HIDDEN * sizeof(short);
+	n->net.l0_bias = (const short *)p;
+	p += NNUE_HIDDEN * sizeof(short);
+	n->net.l1_weights = (const short *)p;
+	p += NNUE_L1 * NNUE_HIDDEN * sizeof(short);
+	n->net.l1_bias = (const int *)p;
+	p += NNUE_L1 * sizeof(int);
+	n->net.l2_weights = (const short *)p;
+	p += NNUE_L1 * sizeof(short);
+	n->net.l2_bias = (const int *)p;
+
+	*ret = n;
+	return 0;
+}
+
+void nnue_close(struct nnue_network *n)
+{
+	if (map == n->map)
+		nnue_use(NULL);
+
+	munmap(n->map, n->map_len);
+	free(n);
+}
+
+/*
+ * Evaluate with @n from now on, or with the heuristic if @n is NULL.
+ */
+void nnue_use(struct nnue_network *n)
+{
+	if (!n) {
+		memset(&net, 0, sizeof(net));
+		map = NULL;
+		return;
+	}
+
+	net = n->net;
+	map = n->map;
+	if (!forward)
+		select_kernel();
+}
+
+int nnue_load(const char *path)
+{
+	int err;
+
+	nnue_unload();
+	err = nnue_open(&loaded, path);
+	if (err)
+		return err;
+
+	nnue_use(loaded);
+	return 0;
+}
+
+void nnue_unload(void)
+{
+	if (!loaded)
+		return;
+
+	nnue_close(loaded);
+	loaded = NULL;
+}
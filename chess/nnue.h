@@ -0,0 +1,27 @@
+#pragma once
+
+#include "board.h"
+
+#define NNUE_INPUTS 768
+#define NNUE_HIDDEN 128
+#define NNUE_L1 32
+#define NNUE_MAX_PLY 64
+
+struct nnue_accumulator {
+	short v[NNUE_HIDDEN];
+} __attribute__((aligned(64)));
+
+struct nnue_network;
+
+extern int nnue_open(struct nnue_network **ret, const char *path);
+extern void nnue_close(struct nnue_network *n);
+extern void nnue_use(struct nnue_network *n);
+extern int nnue_load(const char *path);
+extern void nnue_unload(void);
+extern int nnue_enabled(void);
+
+extern void nnue_refresh(struct nnue_accumulator *acc, struct chessboard *c);
+extern void nnue_update(struct nnue_accumulator *child,
+			const struct nnue_accumulator *parent,
+			struct chessboard *c, struct move m);
+extern int nnue_evaluate(const struct nnue_accumulator *acc);
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "perf.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.h"
+
+/*
+ * HARDWARE PERFORMANCE COUNTERS
+ *
+ * Count user-mode events for this process with perf_event_open(). Counters
+ * are inherited by threads created after they are opened, and a thread's
+ * counts are folded into the parent's when it exits, so reading them after
+ * the search threads are joined covers the whole search.
+ *
+ * Each counter is opened independently, so if the kernel or CPU doesn't
+ * support one of them the rest still work. If the PMU is oversubscribed the
+ * kernel multiplexes the counters, and the counts are scaled up by the
+ * fraction of time each one was actually counting.
+ */
+
+#define CACHE_MISS(cache) \
+	(PERF_COUNT_HW_CACHE_##cache | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+	 PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const struct {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+} counters[NR_PERF_COUNTERS] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{"L1D-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(L1D)},
+	{"LLC-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(LL)},
+	{"dTLB-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(DTLB)},
+};
+
+static int fds[NR_PERF_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+static int nr_open;
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+	return syscall(SYS_perf_event_open, attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * Returns the number of counters which could be opened. If that's zero, the
+ * profiling mode is silently disabled after a warning.
+ */
+int perf_init(void)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counters[i].type;
+		attr.config = counters[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fds[i] = perf_event_open(&attr);
+		if (fds[i] == -1) {
+			printf("WARNING: Can't count %s: %m\n", counters[i].name);
+			continue;
+		}
+
+		nr_open++;
+	}
+
+	if (!nr_open)
+		printf("WARNING: No performance counters available, check "
+		       "/proc/sys/kernel/perf_event_paranoid\n");
+
+	return nr_open;
+}
+
+void perf_exit(void)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (fds[i] != -1)
+			close(fds[i]);
+
+		fds[i] = -1;
+	}
+
+	nr_open = 0;
+}
+
+int perf_enabled(void)
+{
+	return nr_open;
+}
+
+void perf_sample(struct perf_sample *s)
+{
+	unsigned long long buf[3];
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		s->v[i] = 0;
+		if (fds[i] == -1)
+			continue;
+
+		if (read(fds[i], buf, sizeof(buf)) != sizeof(buf))
+			continue;
+
+		/* Scale up for time lost to multiplexing */
+		if (buf[2] && buf[2] < buf[1])
+			s->v[i] = (double)buf[0] * buf[1] / buf[2];
+		else
+			s->v[i] = buf[0];
+	}
+}
+
+/*
+ * Print the counts between two samples, both in total and per node.
+ */
+void perf_report(const char *phase, const struct perf_sample *start,
+		 const struct perf_sample *end, unsigned long nodes)
+{
+	unsigned long long d;
+	int i;
+
+	printf("%-8s %10lu nodes", phase, nodes);
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (fds[i] == -1)
+			continue;
+
+		d = end->v[i] - start->v[i];
+		printf(", %s %llu (%.2f/node)", counters[i].name, d,
+		       nodes ? (double)d / nodes : 0.0);
+	}
+
+	if (fds[0] != -1 && fds[1] != -1 && end->v[0] != start->v[0])
+		printf(", IPC %.2f", (double)(end->v[1] - start->v[1]) /
+				     (end->v[0] - start->v[0]));
+
+	puts("");
+}
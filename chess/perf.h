@@ -0,0 +1,15 @@
+#pragma once
+
+#define NR_PERF_COUNTERS 6
+
+struct perf_sample {
+	unsigned long long v[NR_PERF_COUNTERS];
+};
+
+extern int perf_init(void);
+extern void perf_exit(void);
+extern int perf_enabled(void);
+
+extern void perf_sample(struct perf_sample *s);
+extern void perf_report(const char *phase, const struct perf_sample *start,
+			const struct perf_sample *end, unsigned long nodes);
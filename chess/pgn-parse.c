@@ -0,0 +1,456 @@
+/*
+ * pgn-parse.c: Replay PGN games into positions
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "common.h"
+#include "board.h"
+#include "pgn-parse.h"
+
+/*
+ * PGN PARSING
+ *
+ * Each game is replayed through the move generator, and every position it
+ * reaches (the starting one and the one after every move) is written out.
+ * Comments, variations, NAGs and move numbers are skipped. A game starts from
+ * its FEN tag if it has one, and its result is taken from its Result tag,
+ * which must come before the moves. A game ends at its result token, or at
+ * the next game's tags. One with tags but no moves still counts, but has no
+ * positions. A game with a move that can't be parsed, or which isn't legal,
+ * is abandoned there: the positions before it are kept.
+ */
+
+#define TAG_VALUE_MAX 128
+
+struct pgn_game {
+	struct chessboard *c;
+	struct chessboard *tmp;
+	int started;
+	int tagged;
+	int bad;
+	int plies;
+	int halfmove;
+	int fullmove;
+	int result;
+	char fen[TAG_VALUE_MAX];
+};
+
+/*
+ * OUTPUT
+ */
+
+static const char *result_string(int result)
+{
+	switch (result) {
+	case 1:
+		return "1-0";
+	case 0:
+		return "1/2-1/2";
+	case -1:
+		return "0-1";
+	default:
+		return "*";
+	}
+}
+
+static void emit_position(struct pgn_shard *s, struct pgn_game *g)
+{
+	static const char *const labels[3] = {"[0.0]", "[0.5]", "[1.0]"};
+	struct packed_position pp;
+	char epd[EPD_MAX];
+
+	if (g->plies < s->skip_plies)
+		return;
+
+	s->positions++;
+	switch (s->format) {
+	case OUTPUT_FEN:
+		board_epd(g->c, epd);
+		if (g->result == PACKED_NO_RESULT)
+			fprintf(s->out, "%s %d %d\n", epd, g->halfmove, g->fullmove);
+		else
+			fprintf(s->out, "%s %d %d %s\n", epd, g->halfmove,
+				g->fullmove, labels[g->result + 1]);
+		break;
+	case OUTPUT_EPD:
+		board_epd(g->c, epd);
+		fprintf(s->out, "%s hmvc %d; fmvn %d; c9 \"%s\";\n", epd,
+			g->halfmove, g->fullmove, result_string(g->result));
+		break;
+	case OUTPUT_PACKED:
+		pack_board(g->c, &pp);
+		pp.result = g->result;
+		pp.halfmove = g->halfmove > 255 ? 255 : g->halfmove;
+		fwrite(&pp, sizeof(pp), 1, s->out);
+		break;
+	}
+}
+
+/*
+ * SAN
+ */
+
+static enum piece_type san_piece(char c)
+{
+	switch (c) {
+	case 'N':
+		return KNIGHT;
+	case 'B':
+		return BISHOP;
+	case 'R':
+		return ROOK;
+	case 'Q':
+		return QUEEN;
+	case 'K':
+		return KING;
+	default:
+		return EMPTY;
+	}
+}
+
+/*
+ * Find the legal move the @len byte SAN string @san names in @c, using @tmp as
+ * scratch space. The disambiguation and capture markers are only used to tell
+ * moves apart, so sloppy SAN (e.g. "Ngf3" where "Nf3" would do, or a capture
+ * without an 'x') is accepted as long as it names exactly one move. Returns 0,
+ * or -EINVAL if it names none or more than one.
+ */
+static int parse_san(struct chessboard *c, struct chessboard *tmp,
+		     const char *san, int len, struct move *ret)
+{
+	enum piece_color color = side_to_move(c);
+	enum piece_type type = PAWN, promotion = EMPTY;
+	int i, sx = -1, sy = -1, dx, dy, found = 0;
+	struct move_list l;
+	struct move m;
+
+	while (len && strchr("+#!?", san[len - 1]))
+		len--;
+
+	if ((len == 3 || len == 5) && (san[0] == 'O' || san[0] == '0')) {
+		if (len == 3 && (!memcmp(san, "O-O", 3) || !memcmp(san, "0-0", 3)))
+			dx = 6;
+		else if (len == 5 && (!memcmp(san, "O-O-O", 5) || !memcmp(san, "0-0-0", 5)))
+			dx = 2;
+		else
+			return -EINVAL;
+
+		type = KING;
+		sx = 4;
+		sy = dy = color == WHITE ? 0 : 7;
+		goto search;
+	}
+
+	if (len && san_piece(san[0]) != EMPTY) {
+		type = san_piece(san[0]);
+		san++;
+		len--;
+	}
+
+	if (type == PAWN && len > 2 && san_piece(san[len - 1]) != EMPTY) {
+		promotion = san_piece(san[len - 1]);
+		len -= san[len - 2] == '=' ? 2 : 1;
+	}
+
+	if (len < 2)
+		return -EINVAL;
+
+	dx = san[len - 2] - 'a';
+	dy = san[len - 1] - '1';
+	if (dx < 0 || dx > 7 || dy < 0 || dy > 7)
+		return -EINVAL;
+
+	for (i = 0; i < len - 2; i++) {
+		if (san[i] >= 'a' && san[i] <= 'h')
+			sx = san[i] - 'a';
+		else if (san[i] >= '1' && san[i] <= '8')
+			sy = san[i] - '1';
+		else if (san[i] != 'x' && san[i] != ':' && san[i] != '-')
+			return -EINVAL;
+	}
+
+	if (type == PAWN && (dy == 0 || dy == 7) && promotion == EMPTY)
+		promotion = QUEEN;
+
+search:
+	l.n = 0;
+	enumerate_moves(c, color, &l);
+	for (i = 0; i < l.n; i++) {
+		m = l.m[i];
+		if (move_dx(m) != dx || move_dy(m) != dy)
+			continue;
+
+		if ((square_contents(c, move_sx(m), move_sy(m)) & 7) != type)
+			continue;
+
+		if ((sx != -1 && move_sx(m) != sx) || (sy != -1 && move_sy(m) != sy))
+			continue;
+
+		if (promotion != EMPTY && move_promotion(m) != promotion)
+			continue;
+
+		copy_board_into(tmp, c);
+		execute_raw_move(tmp, m);
+		if (in_check(tmp, color))
+			continue;
+
+		if (found++)
+			return -EINVAL;
+
+		*ret = m;
+	}
+
+	return found ? 0 : -EINVAL;
+}
+
+/*
+ * GAMES
+ */
+
+static void reset_game(struct pgn_game *g)
+{
+	g->started = 0;
+	g->tagged = 0;
+	g->bad = 0;
+	g->plies = 0;
+	g->halfmove = 0;
+	g->fullmove = 1;
+	g->result = PACKED_NO_RESULT;
+	g->fen[0] = '\0';
+}
+
+static void start_game(struct pgn_shard *s, struct pgn_game *g)
+{
+	struct chessboard *c;
+	const char *p;
+	int i;
+
+	g->started = 1;
+	s->games++;
+
+	if (g->fen[0]) {
+		c = get_fen_board(g->fen);
+		if (!c) {
+			g->bad = 1;
+			return;
+		}
+
+		/* The counters are optional, get_fen_board() ignores them */
+		p = g->fen;
+		for (i = 0; i < 4 && p; i++)
+			p = strchr(p + 1, ' ');
+
+		if (p && sscanf(p, "%d %d", &g->halfmove, &g->fullmove) != 2) {
+			g->halfmove = 0;
+			g->fullmove = 1;
+		}
+
+		copy_board_into(g->c, c);
+		free(c);
+	} else {
+		c = get_new_board();
+		copy_board_into(g->c, c);
+		free(c);
+	}
+
+	emit_position(s, g);
+}
+
+static void end_game(struct pgn_shard *s, struct pgn_game *g)
+{
+	if (g->bad)
+		s->bad_games++;
+
+	reset_game(g);
+}
+
+static void play_san(struct pgn_shard *s, struct pgn_game *g, const char *san,
+		     int len)
+{
+	struct move m;
+	int reset;
+
+	if (!g->started)
+		start_game(s, g);
+
+	if (g->bad)
+		return;
+
+	if (parse_san(g->c, g->tmp, san, len, &m)) {
+		g->bad = 1;
+		return;
+	}
+
+	/* Captures and pawn moves reset the fifty move clock */
+	reset = square_contents(g->c, move_dx(m), move_dy(m)) ||
+		(square_contents(g->c, move_sx(m), move_sy(m)) & 7) == PAWN;
+	g->halfmove = reset ? 0 : g->halfmove + 1;
+	if (side_to_move(g->c) == BLACK)
+		g->fullmove++;
+
+	execute_raw_move(g->c, m);
+	g->plies++;
+	emit_position(s, g);
+}
+
+/*
+ * Handle the tag pair at @p, which points at the '['. Returns a pointer to
+ * the end of its line.
+ */
+static const char *parse_tag(struct pgn_game *g, const char *p, const char *end)
+{
+	const char *eol = memchr(p, '\n', end - p), *name, *val, *q;
+	char buf[TAG_VALUE_MAX];
+	int n = 0;
+
+	if (!eol)
+		eol = end;
+
+	name = p + 1;
+	val = memchr(name, '"', eol - name);
+	if (!val)
+		return eol;
+
+	for (q = val + 1; q < eol && *q != '"' && n < TAG_VALUE_MAX - 1; q++) {
+		if (*q == '\\' && q + 1 < eol)
+			q++;
+
+		buf[n++] = *q;
+	}
+	buf[n] = '\0';
+	g->tagged = 1;
+
+	if (!strncmp(name, "FEN ", 4)) {
+		strcpy(g->fen, buf);
+	} else if (!strncmp(name, "Result ", 7)) {
+		if (!strcmp(buf, "1-0"))
+			g->result = 1;
+		else if (!strcmp(buf, "0-1"))
+			g->result = -1;
+		else if (!strcmp(buf, "1/2-1/2"))
+			g->result = 0;
+	}
+
+	return eol;
+}
+
+/*
+ * Skip the variation at @p, which points at the '(': they nest, and can hold
+ * comments with unbalanced parentheses in them.
+ */
+static const char *skip_variation(const char *p, const char *end)
+{
+	int depth = 0;
+
+	for (; p < end; p++) {
+		if (*p == '(') {
+			depth++;
+		} else if (*p == ')') {
+			if (!--depth)
+				return p + 1;
+		} else if (*p == '{') {
+			p = memchr(p, '}', end - p);
+			if (!p)
+				return end;
+		}
+	}
+
+	return end;
+}
+
+static int is_result(const char *p, int len)
+{
+	return (len == 1 && *p == '*') ||
+	       (len == 3 && (!memcmp(p, "1-0", 3) || !memcmp(p, "0-1", 3))) ||
+	       (len == 7 && !memcmp(p, "1/2-1/2", 7));
+}
+
+void *pgn_thread(void *arg)
+{
+	struct pgn_shard *s = arg;
+	const char *p = s->start, *end = s->end, *q;
+	struct pgn_game g;
+
+	g.c = get_zero_board();
+	g.tmp = get_zero_board();
+	reset_game(&g);
+
+	while (p < end) {
+		switch (*p) {
+		case '[':
+			/* Nothing from an unfinished game carries into the next */
+			if (g.started || !strncmp(p + 1, "Event ", 6))
+				end_game(s, &g);
+
+			p = parse_tag(&g, p, end);
+			continue;
+		case '{':
+			q = memchr(p, '}', end - p);
+			p = q ? q + 1 : end;
+			continue;
+		case ';':
+		case '%':
+			q = memchr(p, '\n', end - p);
+			p = q ? q : end;
+			continue;
+		case '(':
+			p = skip_variation(p, end);
+			continue;
+		}
+
+		if (isspace((unsigned char)*p) || *p == ')') {
+			p++;
+			continue;
+		}
+
+		for (q = p; q < end && !isspace((unsigned char)*q) &&
+			    !strchr("{}()[];", *q); q++)
+			;
+
+		if (is_result(p, q - p)) {
+			/*
+			 * A game can end without any moves, e.g. by forfeit:
+			 * it counts, but its starting position was never
+			 * played from, so it isn't worth labelling.
+			 */
+			if (g.tagged && !g.started)
+				s->games++;
+
+			end_game(s, &g);
+		} else if (*p != '$') {
+			/* Move numbers, which may run straight into the move */
+			while (p < q && isdigit((unsigned char)*p))
+				p++;
+			while (p < q && *p == '.')
+				p++;
+
+			if (p < q)
+				play_san(s, &g, p, q - p);
+		}
+
+		p = q;
+	}
+
+	if (g.started)
+		end_game(s, &g);
+
+	free(g.c);
+	free(g.tmp);
+	return NULL;
+}
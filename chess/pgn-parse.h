@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdio.h>
+#include <pthread.h>
+
+enum output_format {
+	OUTPUT_FEN	= 0,
+	OUTPUT_EPD	= 1,
+	OUTPUT_PACKED	= 2,
+};
+
+/*
+ * A run of whole games in a PGN file, starting at an "[Event " tag. Their
+ * positions are written to @out in @format, skipping the first @skip_plies
+ * of every game, and the counts are filled in.
+ */
+struct pgn_shard {
+	const char *start;
+	const char *end;
+	FILE *out;
+	enum output_format format;
+	int skip_plies;
+	pthread_t thread;
+
+	unsigned long games;
+	unsigned long positions;
+	unsigned long bad_games;
+} __attribute__((aligned(64)));
+
+extern void *pgn_thread(void *arg);
@@ -0,0 +1,228 @@
+/*
+ * chess-pgn: Extract positions from PGN game collections
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "board.h"
+#include "pgn-parse.h"
+
+/*
+ * PGN INGEST
+ *
+ * The input is mapped rather than read, and split into one shard per thread.
+ * Shards start at an "[Event " tag at the beginning of a line, so no game is
+ * ever split between two of them. Each thread replays the games in its shard
+ * with pgn_thread(), writing the positions to its own temporary file; once
+ * they're all done, the files are concatenated in order, so the output is the
+ * same however many threads there are.
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+static unsigned long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-j threads] [-f fen|epd|packed] [-s skip_plies] [-o output] games.pgn\n", name);
+	printf("\t-j: Number of threads (default: one per CPU)\n");
+	printf("\t-f: Output format: FEN with a [1.0]-style result, EPD with\n");
+	printf("\t    hmvc/fmvn/c9 opcodes, or packed binary positions\n");
+	printf("\t-s: Skip the first this many plies of every game\n");
+	printf("\t-o: Write the positions here instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct packed_file_header h = {
+		.magic = PACKED_MAGIC,
+		.version = PACKED_VERSION,
+		.record_size = sizeof(struct packed_position),
+	};
+	unsigned long games = 0, positions = 0, bad_games = 0, start, usec;
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *map, *from, *out = NULL;
+	int tmp, i, fd, out_fd = STDOUT_FILENO, skip_plies = 0;
+	enum output_format format = OUTPUT_FEN;
+	struct pgn_shard *shards;
+	struct stat st;
+	ssize_t len;
+	char *buf;
+
+	while ((tmp = getopt(argc, argv, "j:f:s:o:h")) != -1) {
+		switch (tmp) {
+		case 'j':
+			nr_threads = atol(optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "fen"))
+				format = OUTPUT_FEN;
+			else if (!strcmp(optarg, "epd"))
+				format = OUTPUT_EPD;
+			else if (!strcmp(optarg, "packed"))
+				format = OUTPUT_PACKED;
+			else
+				fatal("Unknown output format '%s'\n", optarg);
+			break;
+		case 's':
+			skip_plies = atoi(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (nr_threads < 1 || skip_plies < 0)
+		fatal("Bad arguments\n");
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		fatal("Can't open %s: %m\n", argv[optind]);
+
+	if (fstat(fd, &st))
+		fatal("Can't stat %s: %m\n", argv[optind]);
+
+	if (!st.st_size)
+		fatal("%s is empty\n", argv[optind]);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		fatal("Can't map %s: %m\n", argv[optind]);
+
+	close(fd);
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	if (out) {
+		out_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (out_fd == -1)
+			fatal("Can't open %s: %m\n", out);
+	}
+
+	shards = aligned_alloc(64, nr_threads * sizeof(*shards));
+	buf = malloc(OUTPUT_BUFFER_SIZE);
+	if (!shards || !buf)
+		fatal("-ENOMEM allocating shards\n");
+
+	/*
+	 * Split the file into shards which start at a game. A game can be longer
+	 * than a shard, so a shard can be empty.
+	 */
+	memset(shards, 0, nr_threads * sizeof(*shards));
+	shards[0].start = map;
+	for (i = 1; i < nr_threads; i++) {
+		from = map + st.st_size * i / nr_threads;
+		if (from < shards[i - 1].start)
+			from = shards[i - 1].start;
+
+		shards[i].start = memmem(from, map + st.st_size - from,
+					 "\n[Event ", 8);
+		shards[i].start = shards[i].start ? shards[i].start + 1 : map + st.st_size;
+		shards[i - 1].end = shards[i].start;
+	}
+	shards[nr_threads - 1].end = map + st.st_size;
+
+	start = now_usec();
+	for (i = 0; i < nr_threads; i++) {
+		shards[i].out = tmpfile();
+		if (!shards[i].out)
+			fatal("Can't create temporary file: %m\n");
+
+		shards[i].format = format;
+		shards[i].skip_plies = skip_plies;
+
+		setvbuf(shards[i].out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+		if (pthread_create(&shards[i].thread, NULL, pgn_thread, &shards[i]))
+			fatal("Can't create thread\n");
+	}
+
+	if (format == OUTPUT_PACKED && write_all(out_fd, &h, sizeof(h)))
+		fatal("Can't write output: %m\n");
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(shards[i].thread, NULL);
+		if (fflush(shards[i].out) || lseek(fileno(shards[i].out), 0, SEEK_SET))
+			fatal("Can't rewind temporary file: %m\n");
+
+		while ((len = read(fileno(shards[i].out), buf, OUTPUT_BUFFER_SIZE)) > 0)
+			if (write_all(out_fd, buf, len))
+				fatal("Can't write output: %m\n");
+
+		if (len == -1)
+			fatal("Can't read temporary file: %m\n");
+
+		fclose(shards[i].out);
+		games += shards[i].games;
+		positions += shards[i].positions;
+		bad_games += shards[i].bad_games;
+	}
+
+	usec = now_usec() - start;
+	fprintf(stderr, "%lu games (%lu abandoned), %lu positions in %.2fs: %.0f positions/sec\n",
+		games, bad_games, positions, usec / 1e6,
+		usec ? positions / (usec / 1e6) : 0);
+
+	if (out)
+		close(out_fd);
+
+	munmap((void *)map, st.st_size);
+	free(shards);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ * chess-pool: Play thousands of low-budget games at once on a few threads
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "board.h"
+#include "negamax.h"
+#include "tt.h"
+
+/*
+ * POOL
+ *
+ * Every game has its own resumable search task (see negamax.c), and games
+ * waiting to think sit on a single FIFO run queue. A worker thread takes the
+ * game at the head, searches at most one slice of nodes for it, and then
+ * either makes the move it found and starts the next search, or puts the game
+ * back on the tail of the queue unfinished. So every game gets the same number
+ * of nodes per turn, however many there are, and no game can hold a thread for
+ * longer than a slice. A game's memory is its task and one board, both fixed
+ * when it is created.
+ *
+ * Games begin with a few random moves so they differ, and end when a king is
+ * captured, the side to move has no moves, or at the ply limit. All the games
+ * share one transposition table.
+ */
+
+#define DEFAULT_GAMES 1000
+#define DEFAULT_NODES 2000
+#define DEFAULT_SLICE 256
+#define DEFAULT_DEPTH 6
+#define DEFAULT_MAX_PLIES 200
+#define DEFAULT_RANDOM_PLIES 4
+
+struct game {
+	struct game *next;
+	struct search_task *task;
+	struct chessboard *c;
+	int color;
+	int plies;
+	unsigned long search_start;
+
+	unsigned long moves;
+	unsigned long nodes;
+	unsigned long depths;
+	unsigned long slices;
+	unsigned long usec;
+	unsigned long max_usec;
+};
+
+struct run_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct game *head;
+	struct game *tail;
+	int nr_running;
+};
+
+static struct run_queue runq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct tt *pool_tt;
+static unsigned long move_nodes = DEFAULT_NODES;
+static unsigned long slice_nodes = DEFAULT_SLICE;
+static int max_depth = DEFAULT_DEPTH;
+static int max_plies = DEFAULT_MAX_PLIES;
+
+static unsigned long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void runq_push(struct game *g)
+{
+	pthread_mutex_lock(&runq.lock);
+	g->next = NULL;
+	if (runq.tail)
+		runq.tail->next = g;
+	else
+		runq.head = g;
+
+	runq.tail = g;
+	pthread_cond_signal(&runq.cond);
+	pthread_mutex_unlock(&runq.lock);
+}
+
+/*
+ * Returns NULL once every game is over. A game a worker holds is still
+ * running, so the queue can be empty without the pool being finished.
+ */
+static struct game *runq_pop(void)
+{
+	struct game *g;
+
+	pthread_mutex_lock(&runq.lock);
+	while (!runq.head && runq.nr_running)
+		pthread_cond_wait(&runq.cond, &runq.lock);
+
+	g = runq.head;
+	if (g) {
+		runq.head = g->next;
+		if (!runq.head)
+			runq.tail = NULL;
+	}
+
+	pthread_mutex_unlock(&runq.lock);
+	return g;
+}
+
+static void runq_game_over(void)
+{
+	pthread_mutex_lock(&runq.lock);
+	if (!--runq.nr_running)
+		pthread_cond_broadcast(&runq.cond);
+
+	pthread_mutex_unlock(&runq.lock);
+}
+
+static void start_search(struct game *g)
+{
+	g->search_start = now_usec();
+	search_task_start(g->task, pool_tt, g->c, g->color, max_depth, move_nodes);
+}
+
+/*
+ * Make the move the finished search came up with. Returns nonzero if that
+ * ends the game.
+ */
+static int make_game_move(struct game *g)
+{
+	struct search_stats st;
+	unsigned int mv;
+	unsigned long usec = now_usec() - g->search_start;
+	int sx, sy, dx, dy;
+
+	mv = search_task_result(g->task, &st);
+	g->moves++;
+	g->nodes += st.evaluated_moves;
+	g->depths += st.depth;
+	g->usec += usec;
+	if (usec > g->max_usec)
+		g->max_usec = usec;
+
+	sx = mv & 0xff;
+	sy = (mv >> 8) & 0xff;
+	dx = (mv >> 16) & 0xff;
+	dy = (mv >> 24) & 0xff;
+	if (sx == 0xff)
+		return 1;
+
+	g->plies++;
+	if ((square_contents(g->c, dx, dy) & 7) == KING)
+		return 1;
+
+	if (execute_move(g->c, sx, sy, dx, dy))
+		fatal("Illegal move (%d,%d) => (%d,%d)\n", sx, sy, dx, dy);
+
+	if (g->plies == max_plies)
+		return 1;
+
+	g->color = !g->color;
+	start_search(g);
+	return 0;
+}
+
+static void *pool_worker(void *arg __unused)
+{
+	struct game *g;
+
+	while ((g = runq_pop())) {
+		g->slices++;
+		if (search_task_step(g->task, slice_nodes) && make_game_move(g)) {
+			runq_game_over();
+			continue;
+		}
+
+		runq_push(g);
+	}
+
+	return NULL;
+}
+
+/*
+ * Play @nr random moves which don't leave the mover in check, stopping early
+ * if there aren't any.
+ */
+static int play_random_moves(struct chessboard *c, int nr, unsigned int *seed)
+{
+	struct chessboard *tmp = get_zero_board();
+	struct move_list l;
+	int i, j, color = WHITE;
+
+	for (i = 0; i < nr; i++) {
+		l.n = 0;
+		enumerate_moves(c, color, &l);
+
+		for (j = 0; j < l.n; j++) {
+			copy_board_into(tmp, c);
+			execute_raw_move(tmp, l.m[rand_r(seed) % l.n]);
+			if (!in_check(tmp, color))
+				break;
+		}
+
+		if (j == l.n)
+			break;
+
+		copy_board_into(c, tmp);
+		color = !color;
+	}
+
+	free(tmp);
+	return color;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-g games] [-j threads] [-n nodes] [-s slice] [-d depth] [-p max_plies] [-r random_plies] [-m tt_megabytes]\n", name);
+	printf("\t-g: Number of games to play at once\n");
+	printf("\t-j: Number of worker threads (default: one per CPU)\n");
+	printf("\t-n: Node budget for each move\n");
+	printf("\t-s: Nodes a game may search before it yields its thread\n");
+	printf("\t-d: Depth limit for each move\n");
+	printf("\t-p: End games after this many plies\n");
+	printf("\t-r: Random moves played at the start of each game\n");
+	printf("\t-m: Size of the shared transposition table in megabytes\n");
+}
+
+int main(int argc, char **argv)
+{
+	int tmp, i, nr_games = DEFAULT_GAMES, random_plies = DEFAULT_RANDOM_PLIES;
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long tt_mbytes = 0, start, usec, nodes = 0, depths = 0;
+	unsigned long moves = 0, slices = 0, move_usec = 0, max_usec = 0;
+	unsigned int seed;
+	struct game *games;
+	pthread_t *threads;
+
+	while ((tmp = getopt(argc, argv, "g:j:n:s:d:p:r:m:h")) != -1) {
+		switch (tmp) {
+		case 'g':
+			nr_games = atoi(optarg);
+			break;
+		case 'j':
+			nr_threads = atol(optarg);
+			break;
+		case 'n':
+			move_nodes = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			slice_nodes = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			max_depth = atoi(optarg);
+			break;
+		case 'p':
+			max_plies = atoi(optarg);
+			break;
+		case 'r':
+			random_plies = atoi(optarg);
+			break;
+		case 'm':
+			tt_mbytes = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (nr_games < 1 || nr_threads < 1 || !slice_nodes || max_depth < 1 ||
+	    max_plies < 1 || random_plies < 0)
+		fatal("Bad arguments\n");
+
+	tmp = tt_init(&pool_tt, NULL, NULL, tt_mbytes);
+	if (tmp)
+		fatal("Can't set up transposition table: %s\n", strerror(-tmp));
+
+	games = calloc(nr_games, sizeof(*games));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!games || !threads)
+		fatal("-ENOMEM allocating games\n");
+
+	runq.nr_running = nr_games;
+	for (i = 0; i < nr_games; i++) {
+		seed = i + 1;
+		games[i].c = get_new_board();
+		games[i].color = play_random_moves(games[i].c, random_plies, &seed);
+		games[i].task = search_task_alloc(max_depth);
+		start_search(&games[i]);
+		runq_push(&games[i]);
+	}
+
+	printf("Playing %d games on %ld threads, %lu nodes per move in slices of %lu, %zu bytes per game\n",
+	       nr_games, nr_threads, move_nodes, slice_nodes,
+	       sizeof(struct game) + search_task_size(max_depth) + board_size());
+	fflush(stdout);
+
+	start = now_usec();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, pool_worker, NULL))
+			fatal("Can't create worker thread\n");
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	usec = now_usec() - start;
+
+	for (i = 0; i < nr_games; i++) {
+		nodes += games[i].nodes;
+		depths += games[i].depths;
+		moves += games[i].moves;
+		slices += games[i].slices;
+		move_usec += games[i].usec;
+		if (games[i].max_usec > max_usec)
+			max_usec = games[i].max_usec;
+
+		search_task_free(games[i].task);
+		free(games[i].c);
+	}
+
+	printf("%lu moves in %.2fs: %.0f moves/sec, %.0f nodes/sec, average depth %.1f\n",
+	       moves, usec / 1e6, moves / (usec / 1e6), nodes / (usec / 1e6),
+	       moves ? (double)depths / moves : 0);
+	printf("%lu slices, wall time per move: mean %.2fms max %.2fms\n",
+	       slices, moves ? move_usec / 1e3 / moves : 0, max_usec / 1e3);
+
+	tt_close(pool_tt);
+	free(threads);
+	free(games);
+	return 0;
+}
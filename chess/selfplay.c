@@ -0,0 +1,652 @@
+/*
+ * chess-selfplay: Play the engine against itself
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "board.h"
+#include "negamax.h"
+#include "tt.h"
+#include "nnue.h"
+#include "timeman.h"
+
+/*
+ * SELF-PLAY
+ *
+ * Plays a match between two engine configurations, A and B. Every opening in
+ * the suite is played twice, once with A as white and once with A as black,
+ * and the games are spread across worker processes: the search keeps its
+ * configuration in globals, so each concurrent game needs its own process.
+ *
+ * Games, and the time taken by every move, are recorded in a shared mapping
+ * which the parent summarizes once all the workers have exited.
+ *
+ * A game ends when a king is captured or a side runs out of time, when the
+ * side to move has no moves, on the third repetition of a position, or at the
+ * ply limit (all but the first two are draws).
+ */
+
+#define DEFAULT_MAX_PLIES 300
+#define DEFAULT_DEPTH 5
+#define MAX_DEPTH (NNUE_MAX_PLY - 1)
+
+struct engine_config {
+	const char *spec;
+	int depth;
+	unsigned long nodes;
+	unsigned long time_ms;
+	unsigned long clock_ms;
+	unsigned long increment_ms;
+	int threads;
+	enum search_mode mode;
+	unsigned long tt_mb;
+	const char *nnue;
+};
+
+enum game_end {
+	END_KING_CAPTURED,
+	END_TIME_FORFEIT,
+	END_NO_MOVES,
+	END_REPETITION,
+	END_PLY_LIMIT,
+};
+
+static const char *end_names[] = {
+	[END_KING_CAPTURED]	= "king captured",
+	[END_TIME_FORFEIT]	= "time forfeit",
+	[END_NO_MOVES]		= "no moves",
+	[END_REPETITION]	= "repetition",
+	[END_PLY_LIMIT]		= "ply limit",
+};
+
+struct move_sample {
+	unsigned int usec;
+	unsigned char config;
+	unsigned char depth;
+};
+
+/* @result is from A's point of view: 1 for a win, 0 for a draw, -1 for a loss */
+struct game_result {
+	int done;
+	int opening;
+	int a_white;
+	int result;
+	enum game_end end;
+	int plies;
+	unsigned long nodes[2];
+	unsigned long usec[2];
+};
+
+struct match {
+	int next_game;
+	int nr_games;
+	int max_plies;
+	struct game_result *games;
+	struct move_sample *samples;
+};
+
+static const char *const default_openings[] = {
+	"e2e4 e7e5",
+	"d2d4 d7d5",
+	"c2c4 e7e5",
+	"g1f3 d7d5",
+	"e2e4 c7c5",
+	"e2e4 e7e6",
+	"e2e4 c7c6",
+	"d2d4 g8f6 c2c4 e7e6",
+};
+
+static const char *const *openings = default_openings;
+static int nr_openings = sizeof(default_openings) / sizeof(*default_openings);
+
+static struct engine_config configs[2] = {
+	{ .spec = "depth=" S_(DEFAULT_DEPTH), .depth = DEFAULT_DEPTH, .threads = 1, .tt_mb = 16 },
+	{ .spec = "depth=" S_(DEFAULT_DEPTH), .depth = DEFAULT_DEPTH, .threads = 1, .tt_mb = 16 },
+};
+
+/*
+ * Configurations are a comma separated list of key=value pairs, e.g.
+ * "nodes=50000,threads=2,mode=ybwc". Returns 0 on success, or -EINVAL.
+ */
+static int parse_config(struct engine_config *cfg, char *spec)
+{
+	char *opt, *val, *save;
+	int depth_given = 0;
+
+	cfg->spec = strdup(spec);
+	for (opt = strtok_r(spec, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (!val)
+			return -EINVAL;
+
+		*val++ = '\0';
+		if (!strcmp(opt, "depth")) {
+			cfg->depth = atoi(val);
+			depth_given = 1;
+		} else if (!strcmp(opt, "nodes")) {
+			cfg->nodes = strtoul(val, NULL, 10);
+		} else if (!strcmp(opt, "time")) {
+			cfg->time_ms = strtoul(val, NULL, 10);
+		} else if (!strcmp(opt, "clock")) {
+			cfg->clock_ms = strtoul(val, &val, 10);
+			if (*val == '+')
+				cfg->increment_ms = strtoul(val + 1, NULL, 10);
+		} else if (!strcmp(opt, "threads")) {
+			cfg->threads = atoi(val);
+		} else if (!strcmp(opt, "tt")) {
+			cfg->tt_mb = strtoul(val, NULL, 10);
+		} else if (!strcmp(opt, "nnue")) {
+			cfg->nnue = strdup(val);
+		} else if (!strcmp(opt, "mode")) {
+			if (!strcmp(val, "split"))
+				cfg->mode = SEARCH_ROOT_SPLIT;
+			else if (!strcmp(val, "det"))
+				cfg->mode = SEARCH_DETERMINISTIC;
+			else if (!strcmp(val, "ybwc"))
+				cfg->mode = SEARCH_YBWC;
+			else if (!strcmp(val, "serial"))
+				cfg->mode = SEARCH_SERIAL;
+			else
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	/* With a budget, the depth is only a backstop */
+	if (!depth_given && cfg->nodes)
+		cfg->depth = MAX_DEPTH;
+
+	if (cfg->depth < 1 || cfg->depth > MAX_DEPTH || cfg->threads < 1)
+		return -EINVAL;
+
+	if (cfg->threads > 1 && cfg->mode == SEARCH_SERIAL)
+		cfg->mode = SEARCH_ROOT_SPLIT;
+
+	return 0;
+}
+
+/*
+ * The opening suite file has one opening per line, as a series of moves in
+ * coordinate notation ("e2e4 e7e5 g1f3"). Blank lines and lines starting with
+ * '#' are ignored.
+ */
+static void load_openings(const char *path)
+{
+	char line[1024], **list = NULL;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		fatal("Can't open %s: %m\n", path);
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		list = realloc(list, (n + 1) * sizeof(*list));
+		if (!list)
+			fatal("Can't allocate openings\n");
+
+		list[n++] = strdup(line);
+	}
+
+	fclose(f);
+	if (!n)
+		fatal("No openings in %s\n", path);
+
+	openings = (const char *const *)list;
+	nr_openings = n;
+}
+
+/*
+ * Play the opening's moves on @c, returning the number of plies played.
+ */
+static int play_opening(struct chessboard *c, int nr)
+{
+	const char *p = openings[nr];
+	int n = 0, len;
+
+	while (*p) {
+		len = strspn(p, " \t");
+		p += len;
+		if (!*p)
+			break;
+
+		if (strspn(p, "abcdefgh12345678") < 4 ||
+		    execute_move(c, p[0] - 'a', p[1] - '1', p[2] - 'a', p[3] - '1'))
+			fatal("Bad move in opening %d: '%s'\n", nr, openings[nr]);
+
+		p += 4;
+		n++;
+	}
+
+	return n;
+}
+
+static unsigned long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * With a clock or a fixed time per move, the engine's time manager decides how
+ * deep to go. With a node budget, deepen one ply at a time until the budget
+ * has been spent. Otherwise, this is a fixed depth search.
+ */
+static unsigned int think(const struct engine_config *cfg, struct chessboard *c,
+			  int color, unsigned long remaining_ms,
+			  unsigned long *nodes, int *depth)
+{
+	struct time_manager tm;
+	struct search_stats st;
+	unsigned int mv = -1, next;
+	int d;
+
+	if (cfg->clock_ms || cfg->time_ms) {
+		if (cfg->clock_ms)
+			tm_start_clock(&tm, remaining_ms, cfg->increment_ms, 0);
+		else
+			tm_start_fixed(&tm, cfg->time_ms);
+
+		mv = calculate_move_timed(c, color, &tm, &st);
+		*nodes = st.evaluated_moves;
+		*depth = st.depth;
+		return mv;
+	}
+
+	/*
+	 * The budget is enforced inside the search too, so the last iteration
+	 * can't overshoot it: an iteration cut short by it is thrown away. The
+	 * first always runs to completion, since there has to be a move.
+	 */
+	*nodes = 0;
+	for (d = cfg->nodes ? 1 : cfg->depth; d <= cfg->depth; d++) {
+		search_node_limit(cfg->nodes && d > 1 ? cfg->nodes - *nodes : 0);
+		next = calculate_move_stats(c, color, d, &st);
+		*nodes += st.evaluated_moves;
+		if (st.aborted)
+			break;
+
+		mv = next;
+		*depth = d;
+
+		if ((mv & 0xff) == 0xff)
+			break;
+
+		if (cfg->nodes && *nodes >= cfg->nodes)
+			break;
+	}
+
+	search_node_limit(0);
+	return mv;
+}
+
+/*
+ * Everything an engine searches with is set up once per worker, and switching
+ * sides just points the search at the other engine's.
+ */
+struct engine {
+	struct tt *tt;
+	struct search_config *search;
+	struct nnue_network *net;
+};
+
+static void setup_engines(struct engine *e)
+{
+	const struct engine_config *cfg;
+	int i, err;
+
+	for (i = 0; i < 2; i++) {
+		cfg = &configs[i];
+		if (tt_init(&e[i].tt, NULL, NULL, cfg->tt_mb))
+			fatal("Can't allocate transposition table\n");
+
+		e[i].search = search_config_alloc(e[i].tt, cfg->threads, cfg->mode);
+		e[i].net = NULL;
+
+		if (i && cfg->nnue && configs[0].nnue && !strcmp(cfg->nnue, configs[0].nnue)) {
+			e[i].net = e[0].net;
+		} else if (cfg->nnue) {
+			err = nnue_open(&e[i].net, cfg->nnue);
+			if (err)
+				fatal("Can't load %s: %s\n", cfg->nnue, strerror(-err));
+		}
+	}
+}
+
+static void teardown_engines(struct engine *e)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		search_config_free(e[i].search);
+		tt_close(e[i].tt);
+		if (e[i].net && (!i || e[i].net != e[0].net))
+			nnue_close(e[i].net);
+	}
+}
+
+static void use_engine(struct engine *e)
+{
+	use_search_config(e->search);
+	nnue_use(e->net);
+}
+
+static void play_game(struct match *m, int g, struct engine *e)
+{
+	struct game_result *r = &m->games[g];
+	struct move_sample *s = &m->samples[g * m->max_plies];
+	unsigned long long *history;
+	struct chessboard *c = get_new_board();
+	unsigned long start, nodes, clock[2];
+	unsigned int mv;
+	int ply, color, nr, i, reps, depth = 0, sx, sy, dx, dy;
+
+	history = calloc(m->max_plies + 1, sizeof(*history));
+	if (!history)
+		fatal("Can't allocate game history\n");
+
+	r->opening = g / 2 % nr_openings;
+	r->a_white = !(g & 1);
+	ply = play_opening(c, r->opening);
+
+	tt_clear(e[0].tt);
+	tt_clear(e[1].tt);
+	clock[0] = configs[0].clock_ms;
+	clock[1] = configs[1].clock_ms;
+
+	r->end = END_PLY_LIMIT;
+	for (; ply < m->max_plies; ply++) {
+		color = ply & 1;
+		nr = (color == WHITE) != r->a_white;
+
+		history[ply] = board_hash(c, color);
+		for (i = ply - 2, reps = 1; i >= 0; i -= 2)
+			reps += history[i] == history[ply];
+
+		if (reps >= 3) {
+			r->end = END_REPETITION;
+			break;
+		}
+
+		use_engine(&e[nr]);
+		tt_new_search(e[nr].tt);
+		start = now_usec();
+		mv = think(&configs[nr], c, color, clock[nr], &nodes, &depth);
+
+		s[ply].usec = now_usec() - start;
+		s[ply].config = nr + 1;
+		s[ply].depth = depth;
+		r->nodes[nr] += nodes;
+		r->usec[nr] += s[ply].usec;
+
+		if (configs[nr].clock_ms) {
+			if (s[ply].usec / 1000 > clock[nr]) {
+				r->end = END_TIME_FORFEIT;
+				r->result = nr ? 1 : -1;
+				break;
+			}
+
+			clock[nr] += configs[nr].increment_ms - s[ply].usec / 1000;
+		}
+
+		sx = mv & 0xff;
+		sy = (mv >> 8) & 0xff;
+		dx = (mv >> 16) & 0xff;
+		dy = (mv >> 24) & 0xff;
+		if (sx == 0xff) {
+			r->end = END_NO_MOVES;
+			break;
+		}
+
+		if ((square_contents(c, dx, dy) & 7) == KING) {
+			r->end = END_KING_CAPTURED;
+			r->result = nr ? -1 : 1;
+			ply++;
+			break;
+		}
+
+		if (execute_move(c, sx, sy, dx, dy))
+			fatal("Config %c made an illegal move (%d,%d) => (%d,%d)\n",
+			      'A' + nr, sx, sy, dx, dy);
+	}
+
+	r->plies = ply;
+	__atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+
+	printf("Game %d/%d: opening %d, A plays %s: %s (%s, %d plies)\n", g + 1,
+	       m->nr_games, r->opening + 1, r->a_white ? "white" : "black",
+	       r->result > 0 ? "A wins" : r->result < 0 ? "B wins" : "draw",
+	       end_names[r->end], r->plies);
+	fflush(stdout);
+
+	free(history);
+	free(c);
+}
+
+static void worker(struct match *m)
+{
+	struct engine e[2];
+	int g;
+
+	setup_engines(e);
+	while ((g = __atomic_fetch_add(&m->next_game, 1, __ATOMIC_RELAXED)) < m->nr_games)
+		play_game(m, g, e);
+
+	teardown_engines(e);
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double elo(double score)
+{
+	score = fmin(fmax(score, 0.001), 0.999);
+	return 400.0 * log10(score / (1.0 - score));
+}
+
+/*
+ * The error bars are a 95% confidence interval, from the standard deviation
+ * of the per-game scores (which accounts for the draw rate).
+ */
+static void report_score(struct match *m)
+{
+	int i, n = 0, wins = 0, draws = 0, losses = 0;
+	double x, mean, var = 0, ci;
+
+	for (i = 0; i < m->nr_games; i++) {
+		if (!m->games[i].done)
+			continue;
+
+		n++;
+		wins += m->games[i].result > 0;
+		draws += m->games[i].result == 0;
+		losses += m->games[i].result < 0;
+	}
+
+	if (!n)
+		fatal("No games were completed\n");
+
+	mean = (wins + draws * 0.5) / n;
+	for (i = 0; i < m->nr_games; i++) {
+		if (!m->games[i].done)
+			continue;
+
+		x = (m->games[i].result + 1) * 0.5 - mean;
+		var += x * x;
+	}
+
+	ci = n > 1 ? 1.96 * sqrt(var / (n - 1) / n) : 0.5;
+
+	printf("\nA: %s\nB: %s\n", configs[0].spec, configs[1].spec);
+	printf("Score of A vs B: +%d =%d -%d (%d games)\n", wins, draws, losses, n);
+	printf("A scores %.1f%% +/- %.1f%%, Elo difference %+.0f [%+.0f, %+.0f]\n",
+	       mean * 100, ci * 100, elo(mean), elo(mean - ci), elo(mean + ci));
+}
+
+static void report_config(struct match *m, int nr)
+{
+	unsigned long nodes = 0, usec = 0, depth = 0;
+	unsigned int *t;
+	int i, n = 0;
+
+	t = malloc(m->nr_games * m->max_plies * sizeof(*t));
+	if (!t)
+		fatal("Can't allocate move times\n");
+
+	for (i = 0; i < m->nr_games; i++) {
+		nodes += m->games[i].nodes[nr];
+		usec += m->games[i].usec[nr];
+	}
+
+	for (i = 0; i < m->nr_games * m->max_plies; i++) {
+		if (m->samples[i].config != nr + 1)
+			continue;
+
+		depth += m->samples[i].depth;
+		t[n++] = m->samples[i].usec;
+	}
+
+	if (!n) {
+		free(t);
+		return;
+	}
+
+	qsort(t, n, sizeof(*t), cmp_uint);
+
+	printf("%c: %d moves, %.0f nodes/sec, average depth %.1f\n", 'A' + nr, n,
+	       usec ? nodes * 1e6 / usec : 0.0, (double)depth / n);
+	printf("   ms/move: min %.2f median %.2f p90 %.2f p99 %.2f max %.2f\n",
+	       t[0] / 1e3, t[n / 2] / 1e3, t[n * 90 / 100] / 1e3,
+	       t[n * 99 / 100] / 1e3, t[n - 1] / 1e3);
+
+	free(t);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-A config] [-B config] [-n games] [-j workers] [-o openings] [-p max_plies]\n", name);
+	printf("\t-A, -B: The two engine configurations, as a comma separated\n");
+	printf("\t        list of: depth=N, nodes=N, time=MS, clock=MS+INC,\n");
+	printf("\t        threads=N, mode=serial|split|det|ybwc, tt=MB,\n");
+	printf("\t        nnue=FILE (time and clock override depth)\n");
+	printf("\t-n: Number of games (default: each opening with both colors)\n");
+	printf("\t-j: Number of games to play concurrently\n");
+	printf("\t-o: Opening suite, one line of coordinate moves per opening\n");
+	printf("\t-p: Adjudicate a draw after this many plies\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct match *m;
+	size_t len;
+	int tmp, i, nr_games = 0, nr_workers = 0, max_plies = DEFAULT_MAX_PLIES;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pid_t pid;
+
+	while ((tmp = getopt(argc, argv, "A:B:n:j:o:p:h")) != -1) {
+		switch (tmp) {
+		case 'A':
+		case 'B':
+			if (parse_config(&configs[tmp - 'A'], optarg))
+				fatal("Bad configuration for %c\n", tmp);
+			break;
+		case 'n':
+			nr_games = atoi(optarg);
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			break;
+		case 'o':
+			load_openings(optarg);
+			break;
+		case 'p':
+			max_plies = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!nr_games)
+		nr_games = nr_openings * 2;
+
+	if (max_plies < 1 || nr_games < 1)
+		fatal("Bad game count or ply limit\n");
+
+	if (!nr_workers) {
+		tmp = configs[0].threads > configs[1].threads ?
+		      configs[0].threads : configs[1].threads;
+		nr_workers = cpus / tmp > 1 ? cpus / tmp : 1;
+	}
+
+	if (nr_workers > nr_games)
+		nr_workers = nr_games;
+
+	len = sizeof(*m) + nr_games * sizeof(*m->games) +
+	      (size_t)nr_games * max_plies * sizeof(*m->samples);
+	m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		fatal("Can't map match results: %m\n");
+
+	m->nr_games = nr_games;
+	m->max_plies = max_plies;
+	m->games = (void *)(m + 1);
+	m->samples = (void *)(m->games + nr_games);
+
+	printf("Playing %d games, %d at a time\n", nr_games, nr_workers);
+	fflush(stdout);
+
+	for (i = 0; i < nr_workers; i++) {
+		pid = fork();
+		if (pid == -1)
+			fatal("Can't fork: %m\n");
+
+		if (!pid) {
+			worker(m);
+			exit(0);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		if (wait(&tmp) == -1 || !WIFEXITED(tmp) || WEXITSTATUS(tmp))
+			printf("WARNING: A worker died, its unfinished game is not counted\n");
+
+	report_score(m);
+	report_config(m, 0);
+	report_config(m, 1);
+
+	munmap(m, len);
+	return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "timeman.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include "common.h"
+
+/*
+ * TIME MANAGEMENT
+ *
+ * Each move gets two limits, measured from when the move is started:
+ *
+ *	The soft limit is how long we'd like to spend. It's checked between
+ *	iterations of the deepening loop, and is stretched when the search is
+ *	unsettled (the best move keeps changing, or the score drops sharply)
+ *	and shrunk when it has settled on a move.
+ *
+ *	The hard limit is how long we can afford to spend. A timer sets
+ *	tm_expired when it passes, which the search polls at every node, and
+ *	whatever iteration was in progress is thrown away.
+ *
+ * No iteration is started which probably won't finish before the hard limit:
+ * each iteration is assumed to take at least twice as long as the last.
+ */
+
+/* Kept in reserve, for the overhead of actually making the move */
+#define MOVE_OVERHEAD_MS 20
+#define DEFAULT_MOVES_TO_GO 30
+
+/* The soft limit is scaled by these, in percent */
+#define SCALE_UNSTABLE 150
+#define SCALE_STABLE 60
+#define SCALE_SCORE_DROP 150
+#define SCALE_MAX 250
+
+/* Iterations with the same best move before it's considered settled */
+#define STABLE_ITERATIONS 3
+
+/* A drop of this much (two pawns) from the last iteration is a swing */
+#define SCORE_SWING 24
+
+int tm_expired;
+
+static timer_t hard_timer;
+static int have_timer;
+static unsigned long deadline = ULONG_MAX;
+
+static unsigned long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * The notification can race with the timer being disarmed or rearmed, so it
+ * checks the deadline it's enforcing has really passed.
+ */
+static void hard_limit_expired(union sigval v __unused)
+{
+	if (now_usec() >= __atomic_load_n(&deadline, __ATOMIC_RELAXED))
+		__atomic_store_n(&tm_expired, 1, __ATOMIC_RELAXED);
+}
+
+static void arm_hard_limit(unsigned long usec)
+{
+	struct sigevent sev = {
+		.sigev_notify = SIGEV_THREAD,
+		.sigev_notify_function = hard_limit_expired,
+	};
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = usec / 1000000,
+			.tv_nsec = usec % 1000000 * 1000,
+		},
+	};
+
+	if (!have_timer) {
+		if (timer_create(CLOCK_MONOTONIC, &sev, &hard_timer))
+			fatal("Can't create time limit timer: %m\n");
+
+		have_timer = 1;
+	}
+
+	/* A zero it_value would disarm the timer rather than fire it */
+	if (!usec)
+		its.it_value.tv_nsec = 1;
+
+	__atomic_store_n(&deadline, now_usec() + usec, __ATOMIC_RELAXED);
+	__atomic_store_n(&tm_expired, 0, __ATOMIC_RELAXED);
+	if (timer_settime(hard_timer, 0, &its, NULL))
+		fatal("Can't arm time limit timer: %m\n");
+}
+
+static void start(struct time_manager *tm, unsigned long soft_ms,
+		  unsigned long hard_ms)
+{
+	memset(tm, 0, sizeof(*tm));
+	tm->start = now_usec();
+	tm->soft = soft_ms * 1000;
+	tm->hard = hard_ms * 1000;
+	tm->best = -1;
+	arm_hard_limit(tm->hard);
+}
+
+/*
+ * Budget a move with @remaining_ms left on the clock, @increment_ms added per
+ * move, and @moves_to_go moves until the next time control (or zero if the
+ * rest of the game must be played in the remaining time).
+ */
+void tm_start_clock(struct time_manager *tm, unsigned long remaining_ms,
+		    unsigned long increment_ms, int moves_to_go)
+{
+	unsigned long avail, soft, hard;
+
+	if (moves_to_go <= 0)
+		moves_to_go = DEFAULT_MOVES_TO_GO;
+
+	avail = remaining_ms > MOVE_OVERHEAD_MS ? remaining_ms - MOVE_OVERHEAD_MS : 0;
+	soft = avail / moves_to_go + increment_ms * 3 / 4;
+
+	/* Never bet more than a third of what's left on one move */
+	hard = soft * SCALE_MAX / 100 * 2;
+	if (hard > avail / 3 + increment_ms)
+		hard = avail / 3 + increment_ms;
+	if (hard > avail)
+		hard = avail;
+	if (soft > hard)
+		soft = hard;
+
+	start(tm, soft, hard);
+}
+
+/*
+ * Spend exactly @ms on this move, or a little less.
+ */
+void tm_start_fixed(struct time_manager *tm, unsigned long ms)
+{
+	start(tm, ms, ms);
+}
+
+/*
+ * Record the result of another completed iteration, and return the soft limit
+ * scaled by how settled the search looks now.
+ */
+static unsigned long scaled_soft_limit(struct time_manager *tm,
+				       unsigned int best, int score)
+{
+	unsigned long soft;
+	int scale = 100;
+
+	if (tm->iterations && best == tm->best)
+		tm->stable++;
+	else if (tm->iterations)
+		tm->stable = 0;
+
+	if (tm->iterations && !tm->stable)
+		scale = SCALE_UNSTABLE;
+	else if (tm->stable >= STABLE_ITERATIONS)
+		scale = SCALE_STABLE;
+
+	if (tm->iterations && score < tm->score - SCORE_SWING)
+		scale = scale * SCALE_SCORE_DROP / 100;
+
+	if (scale > SCALE_MAX)
+		scale = SCALE_MAX;
+
+	tm->best = best;
+	tm->score = score;
+	tm->iterations++;
+
+	soft = tm->soft / 100 * scale;
+	return soft > tm->hard ? tm->hard : soft;
+}
+
+/*
+ * Called with the result of each completed iteration: returns non-zero if
+ * there's time for another.
+ */
+int tm_next_iteration(struct time_manager *tm, unsigned int best, int score)
+{
+	unsigned long elapsed = now_usec() - tm->start, iteration, soft;
+
+	iteration = elapsed - tm->last_iteration;
+	tm->last_iteration = elapsed;
+
+	soft = scaled_soft_limit(tm, best, score);
+	return elapsed < soft && elapsed + iteration * 2 <= tm->hard;
+}
+
+unsigned long tm_elapsed_ms(const struct time_manager *tm)
+{
+	return (now_usec() - tm->start) / 1000;
+}
+
+void tm_stop(struct time_manager *tm __unused)
+{
+	struct itimerspec its = {};
+
+	__atomic_store_n(&deadline, ULONG_MAX, __ATOMIC_RELAXED);
+	if (have_timer)
+		timer_settime(hard_timer, 0, &its, NULL);
+
+	__atomic_store_n(&tm_expired, 0, __ATOMIC_RELAXED);
+}
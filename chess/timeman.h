@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Set when the current move's hard time limit has passed: the search polls
+ * this, and unwinds as quickly as it can once it's set.
+ */
+extern int tm_expired;
+
+static inline int tm_hard_limit_hit(void)
+{
+	return __atomic_load_n(&tm_expired, __ATOMIC_RELAXED);
+}
+
+struct time_manager {
+	unsigned long start;
+	unsigned long soft;
+	unsigned long hard;
+
+	unsigned long last_iteration;
+	unsigned int best;
+	int score;
+	int stable;
+	int iterations;
+};
+
+extern void tm_start_clock(struct time_manager *tm, unsigned long remaining_ms,
+			   unsigned long increment_ms, int moves_to_go);
+extern void tm_start_fixed(struct time_manager *tm, unsigned long ms);
+extern int tm_next_iteration(struct time_manager *tm, unsigned int best,
+			     int score);
+extern unsigned long tm_elapsed_ms(const struct time_manager *tm);
+extern void tm_stop(struct time_manager *tm);
@@ -0,0 +1,255 @@
+/*
+ * chess-trace-dump: Print the search trees recorded by chess-engine -T
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define MAX_PLY 256
+
+/*
+ * Each thread's records are in post-order: a node is written after all of its
+ * children. So the tree is rebuilt by keeping a list of finished nodes at each
+ * ply which are still waiting for their parent: when a node at ply p is read,
+ * everything waiting at ply p+1 are its children.
+ *
+ * Anything still waiting when a search ends has no parent in this thread's
+ * stream. That's normal for YBWC helper threads, which join the search
+ * somewhere in the middle of another thread's tree.
+ */
+
+struct node {
+	const struct trace_record *rec;
+	int first_child;
+	int next;
+};
+
+struct pending {
+	int head;
+	int tail;
+};
+
+static const char *reason_names[] = {
+	[TRACE_ROOT]		= "root",
+	[TRACE_LEAF]		= "leaf",
+	[TRACE_EXACT]		= "exact",
+	[TRACE_FAIL_LOW]	= "fail-low",
+	[TRACE_CUTOFF]		= "cutoff",
+	[TRACE_HASH]		= "hash",
+	[TRACE_ABORT]		= "abort",
+};
+
+static int max_depth = INT_MAX;
+
+static void append(struct node *nodes, int *head, int *tail, int i)
+{
+	if (*head == -1)
+		*head = i;
+	else
+		nodes[*tail].next = i;
+
+	*tail = i;
+}
+
+static void print_score(int v)
+{
+	if (v == INT_MAX)
+		printf("+inf");
+	else if (v == -INT_MAX)
+		printf("-inf");
+	else
+		printf("%d", v);
+}
+
+static void print_tree(struct node *nodes, int i, int indent)
+{
+	const struct trace_record *r;
+
+	for (; i != -1; i = nodes[i].next) {
+		r = nodes[i].rec;
+
+		printf("%*s", indent * 2, "");
+		if (r->reason == TRACE_ROOT)
+			printf("root");
+		else
+			printf("(%d,%d) => (%d,%d)", r->move & 7,
+			       (r->move >> 3) & 7, (r->move >> 8) & 7,
+			       (r->move >> 11) & 7);
+
+		printf(" ply %d [", r->ply);
+		print_score(r->alpha);
+		printf(",");
+		print_score(r->beta);
+		printf("] = ");
+		print_score(r->score);
+		printf(" %s\n", r->reason < sizeof(reason_names) / sizeof(reason_names[0]) ?
+		       reason_names[r->reason] : "?");
+
+		if (indent <= max_depth)
+			print_tree(nodes, nodes[i].first_child, indent + 1);
+	}
+}
+
+static void dump_search(const struct trace_record **recs, int n)
+{
+	static struct pending pending[MAX_PLY + 1];
+	struct node *nodes;
+	int i, p;
+
+	nodes = calloc(n, sizeof(*nodes));
+	if (!nodes)
+		fatal("Can't allocate trace nodes\n");
+
+	for (p = 0; p <= MAX_PLY; p++)
+		pending[p].head = pending[p].tail = -1;
+
+	printf("Search %u, thread %u: %d nodes\n", recs[0]->search,
+	       recs[0]->thread, n);
+
+	for (i = 0; i < n; i++) {
+		p = recs[i]->ply;
+
+		nodes[i].rec = recs[i];
+		nodes[i].next = -1;
+		nodes[i].first_child = pending[p + 1].head;
+		pending[p + 1].head = pending[p + 1].tail = -1;
+
+		append(nodes, &pending[p].head, &pending[p].tail, i);
+	}
+
+	for (p = 0; p <= MAX_PLY; p++) {
+		if (pending[p].head == -1)
+			continue;
+
+		if (p)
+			printf("Detached subtrees at ply %d:\n", p);
+
+		print_tree(nodes, pending[p].head, 1);
+	}
+
+	free(nodes);
+}
+
+/*
+ * Sort by thread then search, keeping each thread's records in the order they
+ * were written, since the rings were drained to the file interleaved.
+ */
+static int record_cmp(const void *a, const void *b)
+{
+	const struct trace_record *x = *(const struct trace_record **)a;
+	const struct trace_record *y = *(const struct trace_record **)b;
+
+	if (x->thread != y->thread)
+		return x->thread < y->thread ? -1 : 1;
+	if (x->search != y->search)
+		return x->search < y->search ? -1 : 1;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-d max_depth] [-s search] trace_file\n", name);
+	printf("\t-d: Only print this many plies of each tree\n");
+	printf("\t-s: Only print this search (numbered from 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct trace_file_header *h;
+	const struct trace_record *recs, **sorted;
+	unsigned long search = 0;
+	size_t i, j, n;
+	struct stat st;
+	void *map;
+	int fd, tmp;
+
+	while ((tmp = getopt(argc, argv, "d:s:h")) != -1) {
+		switch (tmp) {
+		case 'd':
+			max_depth = atoi(optarg);
+			break;
+		case 's':
+			search = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		fatal("Can't open %s: %m\n", argv[optind]);
+
+	if (fstat(fd, &st))
+		fatal("Can't stat %s: %m\n", argv[optind]);
+
+	if ((size_t)st.st_size < sizeof(*h))
+		fatal("%s is not a trace file\n", argv[optind]);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		fatal("Can't map %s: %m\n", argv[optind]);
+
+	close(fd);
+
+	h = map;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) ||
+	    h->version != TRACE_VERSION ||
+	    h->record_size != sizeof(struct trace_record))
+		fatal("%s is not a version %d trace file\n", argv[optind],
+		      TRACE_VERSION);
+
+	recs = map + sizeof(*h);
+	n = (st.st_size - sizeof(*h)) / sizeof(*recs);
+
+	sorted = malloc(n * sizeof(*sorted));
+	if (n && !sorted)
+		fatal("Can't allocate %zu records\n", n);
+
+	for (i = 0; i < n; i++)
+		sorted[i] = &recs[i];
+
+	qsort(sorted, n, sizeof(*sorted), record_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; j++)
+			if (sorted[j]->thread != sorted[i]->thread ||
+			    sorted[j]->search != sorted[i]->search)
+				break;
+
+		if (!search || sorted[i]->search == search)
+			dump_search(&sorted[i], j - i);
+	}
+
+	free(sorted);
+	munmap(map, st.st_size);
+	return 0;
+}
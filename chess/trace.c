@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+
+/*
+ * SEARCH TRACING
+ *
+ * Each search thread gets its own single-producer single-consumer ring of
+ * fixed-size records, so emitting a record is a handful of stores and no
+ * locks. A background thread drains all the rings to a file in batches.
+ *
+ * Records are emitted as each node is exited, so every node's children
+ * precede it in its thread's stream: trace-dump uses that (and the ply in
+ * each record) to rebuild the tree offline.
+ */
+
+#define TRACE_WRITER_SLEEP_US 1000
+
+static struct trace_ring **rings;
+static int nr_rings;
+static int trace_fd = -1;
+static int writer_stop;
+static pthread_t writer;
+static unsigned int search_nr;
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out whatever is in the ring right now. The records between tail and
+ * head are contiguous except when they wrap, so it's at most two writes.
+ */
+static int drain_ring(struct trace_ring *r)
+{
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = r->tail;
+	unsigned long off, len;
+	int err;
+
+	while (tail != head) {
+		off = tail % TRACE_RING_SIZE;
+		len = head - tail;
+		if (off + len > TRACE_RING_SIZE)
+			len = TRACE_RING_SIZE - off;
+
+		err = write_all(trace_fd, &r->rec[off], len * sizeof(r->rec[0]));
+		if (err)
+			return err;
+
+		tail += len;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static void *writer_thread(void *arg __unused)
+{
+	int i, stop;
+
+	do {
+		stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < nr_rings; i++)
+			if (drain_ring(rings[i]))
+				fatal("Can't write trace: %m\n");
+
+		if (!stop)
+			usleep(TRACE_WRITER_SLEEP_US);
+	} while (!stop);
+
+	return NULL;
+}
+
+/*
+ * Start tracing the first @nr_threads search threads to @path. Returns 0 on
+ * success, or a negative error code.
+ */
+int trace_start(const char *path, int nr_threads)
+{
+	struct trace_file_header h = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+	int i, err;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd == -1)
+		return -errno;
+
+	err = write_all(trace_fd, &h, sizeof(h));
+	if (err)
+		goto err;
+
+	rings = calloc(nr_threads, sizeof(*rings));
+	if (!rings) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		rings[i] = aligned_alloc(64, sizeof(struct trace_ring));
+		if (!rings[i])
+			fatal("Can't allocate trace ring\n");
+
+		memset(rings[i], 0, sizeof(struct trace_ring));
+		rings[i]->thread = i;
+	}
+
+	nr_rings = nr_threads;
+	writer_stop = 0;
+	if (pthread_create(&writer, NULL, writer_thread, NULL))
+		fatal("Can't create trace writer thread\n");
+
+	return 0;
+
+err:
+	close(trace_fd);
+	trace_fd = -1;
+	return err;
+}
+
+/*
+ * Flush everything that's been traced and close the file. The search threads
+ * must not be running.
+ */
+void trace_stop(void)
+{
+	unsigned long dropped = 0;
+	int i;
+
+	if (trace_fd == -1)
+		return;
+
+	__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+
+	for (i = 0; i < nr_rings; i++) {
+		dropped += rings[i]->dropped;
+		free(rings[i]);
+	}
+
+	if (dropped)
+		printf("WARNING: %lu trace records were dropped\n", dropped);
+
+	free(rings);
+	rings = NULL;
+	nr_rings = 0;
+
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+struct trace_ring *trace_ring(int thread)
+{
+	return thread < nr_rings ? rings[thread] : NULL;
+}
+
+/*
+ * Stamp subsequent records with a new search number. The search threads must
+ * not be running.
+ */
+void trace_new_search(void)
+{
+	int i;
+
+	search_nr++;
+	for (i = 0; i < nr_rings; i++)
+		rings[i]->search = search_nr;
+}
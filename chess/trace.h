@@ -0,0 +1,84 @@
+#pragma once
+
+#include "list.h"
+
+#define TRACE_MAGIC "CHESSTRC"
+#define TRACE_VERSION 2
+#define TRACE_RING_SIZE 65536
+
+enum trace_reason {
+	TRACE_ROOT	= 0,
+	TRACE_LEAF	= 1,
+	TRACE_EXACT	= 2,
+	TRACE_FAIL_LOW	= 3,
+	TRACE_CUTOFF	= 4,
+	TRACE_HASH	= 5,
+	TRACE_ABORT	= 6,
+};
+
+struct trace_file_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+};
+
+/*
+ * Scores are from the point of view of the side to move at the node, and
+ * [alpha,beta] is the window it was searched with. The move is the one which
+ * led to the node from its parent, as from | to << 8.
+ */
+struct trace_record {
+	unsigned int search;
+	int alpha;
+	int beta;
+	int score;
+	unsigned short move;
+	unsigned char ply;
+	unsigned char reason;
+	unsigned short thread;
+	unsigned short pad;
+};
+
+struct trace_ring {
+	struct trace_record rec[TRACE_RING_SIZE];
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	unsigned long dropped;
+	unsigned int search;
+	unsigned short thread;
+};
+
+extern int trace_start(const char *path, int nr_threads);
+extern void trace_stop(void);
+extern struct trace_ring *trace_ring(int thread);
+extern void trace_new_search(void);
+
+/*
+ * Called by the search thread which owns @r, and only that thread. If the
+ * writer has fallen behind, the record is dropped rather than waiting.
+ */
+static inline void trace_emit(struct trace_ring *r, int ply, struct move m,
+			      int alpha, int beta, int score,
+			      enum trace_reason reason)
+{
+	unsigned long head = r->head;
+	struct trace_record *rec;
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	rec = &r->rec[head % TRACE_RING_SIZE];
+	rec->search = r->search;
+	rec->alpha = alpha;
+	rec->beta = beta;
+	rec->score = score;
+	rec->move = m.from | m.to << 8;
+	rec->ply = ply;
+	rec->reason = reason;
+	rec->thread = r->thread;
+	rec->pad = 0;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tt.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+/*
+ * TRANSPOSITION TABLE
+ *
+ * A direct-mapped table of 16-byte entries indexed by the low bits of the
+ * Zobrist key. The search result is packed into a single 64-bit word:
+ *
+ *	[63:32] score
+ *	[31:24] depth
+ *	[23:18] generation
+ *	[17:16] bound
+ *	[15:0]  move, as from | to << 8
+ *
+ * Replacement is depth-preferred: a shallower result for a different position
+ * never evicts a deeper one from the same generation... except that an entry
+ * is always replaced by a newer result for the same position. The generation
+ * advances with every move the engine makes (see tt_new_search()) and every
+ * time a saved table is loaded, so deep results from old searches and old
+ * sessions don't squat in the table forever: anything from an older
+ * generation can be replaced by anything at all.
+ *
+ * Entries are read and written without any locking, because they may be
+ * shared with other threads or processes. Rather than the key itself, each
+ * entry stores (key ^ data): if two writers race and an entry ends up with
+ * one's key word and the other's data word, it simply won't verify when it is
+ * probed. Torn entries are indistinguishable from misses.
+ *
+ * The table can optionally be backed by a file, so results carry over between
+ * runs of the engine. The file is a one page header followed by the entries:
+ * while the table is mapped the header is marked dirty, and the checksum is
+ * only written back when the table is closed cleanly. A table which is dirty,
+ * has a bad checksum, or is from a different version is thrown away.
+ *
+ * Alternatively, the table can be placed in a named POSIX shared memory
+ * segment, so several engines running on the same machine can share their
+ * results. Whichever process creates the segment initializes it; the rest
+ * wait for it to be marked ready, and adopt its size. The segment lives until
+ * it is removed from /dev/shm or the machine reboots. If the creator dies
+ * before the segment is ready, the others give up after TT_SHM_TIMEOUT_MS
+ * rather than waiting forever: the stale segment has to be removed by hand.
+ */
+
+#define TT_MAGIC "CHESSTT"
+#define TT_VERSION 5
+#define TT_GENERATIONS 64
+#define TT_HEADER_SIZE 4096UL
+#define TT_DEFAULT_MB 64UL
+#define TT_SHM_TIMEOUT_MS 5000
+
+struct tt_entry {
+	unsigned long long check;
+	unsigned long long data;
+};
+
+struct tt_file_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int clean;
+	unsigned long long nr_entries;
+	unsigned long long checksum;
+	unsigned int ready;
+	unsigned int generation;
+};
+
+struct tt {
+	struct tt_entry *table;
+	unsigned long long table_mask;
+	struct tt_file_header *header;
+	size_t map_len;
+	int map_fd;
+};
+
+static unsigned long long pack(int depth, int score, enum tt_bound bound,
+			       unsigned int gen, struct move m)
+{
+	unsigned long long ret;
+
+	ret = (unsigned long long)(unsigned int)score << 32;
+	ret |= (unsigned long long)(depth & 0xff) << 24;
+	ret |= (unsigned long long)(gen % TT_GENERATIONS) << 18;
+	ret |= (unsigned long long)(bound & 3) << 16;
+	ret |= (unsigned long long)m.to << 8 | m.from;
+	return ret;
+}
+
+static void unpack(unsigned long long data, struct tt_hit *hit)
+{
+	hit->score = (int)(data >> 32);
+	hit->depth = (data >> 24) & 0xff;
+	hit->bound = (data >> 16) & 3;
+	hit->m.from = data & 0xff;
+	hit->m.to = (data >> 8) & 0xff;
+}
+
+static unsigned long long load(unsigned long long *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void store(unsigned long long *p, unsigned long long v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static unsigned int generation(struct tt *t)
+{
+	return __atomic_load_n(&t->header->generation, __ATOMIC_RELAXED) %
+	       TT_GENERATIONS;
+}
+
+/*
+ * Start a new generation: everything already in the table becomes fair game
+ * for replacement. Tables shared between processes share the generation.
+ */
+void tt_new_search(struct tt *t)
+{
+	if (t)
+		__atomic_fetch_add(&t->header->generation, 1, __ATOMIC_RELAXED);
+}
+
+int tt_probe(struct tt *t, unsigned long long key, struct tt_hit *hit)
+{
+	struct tt_entry *e;
+	unsigned long long data;
+
+	if (!t)
+		return 0;
+
+	e = &t->table[key & t->table_mask];
+	data = load(&e->data);
+	if (!data || (load(&e->check) ^ data) != key)
+		return 0;
+
+	unpack(data, hit);
+	return 1;
+}
+
+void tt_store(struct tt *t, unsigned long long key, int depth, int score,
+	      enum tt_bound bound, struct move m)
+{
+	unsigned long long old, data;
+	struct tt_entry *e;
+	unsigned int gen;
+
+	if (!t)
+		return;
+
+	gen = generation(t);
+	data = pack(depth, score, bound, gen, m);
+	e = &t->table[key & t->table_mask];
+	old = load(&e->data);
+	if (old && (load(&e->check) ^ old) != key && ((old >> 18) & 0x3f) == gen &&
+	    ((old >> 24) & 0xff) > (unsigned)depth)
+		return;
+
+	store(&e->check, key ^ data);
+	store(&e->data, data);
+}
+
+/* FNV-1a, a word at a time */
+static unsigned long long checksum_table(struct tt *t)
+{
+	unsigned long long i, ret = 0xcbf29ce484222325ULL;
+
+	for (i = 0; i <= t->table_mask; i++) {
+		ret = (ret ^ t->table[i].check) * 0x100000001b3ULL;
+		ret = (ret ^ t->table[i].data) * 0x100000001b3ULL;
+	}
+
+	return ret;
+}
+
+static int header_valid(struct tt *t)
+{
+	struct tt_file_header *header = t->header;
+
+	if (memcmp(header->magic, TT_MAGIC, sizeof(TT_MAGIC)))
+		return 0;
+
+	if (header->version != TT_VERSION) {
+		printf("Discarding version %u transposition table\n", header->version);
+		return 0;
+	}
+
+	if (header->nr_entries != t->table_mask + 1) {
+		printf("Discarding transposition table of different size\n");
+		return 0;
+	}
+
+	if (!header->clean) {
+		printf("Discarding transposition table which wasn't closed cleanly\n");
+		return 0;
+	}
+
+	if (header->checksum != checksum_table(t)) {
+		printf("Discarding transposition table with bad checksum\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void init_header(struct tt *t)
+{
+	memset(t->header, 0, TT_HEADER_SIZE);
+	tt_clear(t);
+	memcpy(t->header->magic, TT_MAGIC, sizeof(TT_MAGIC));
+	t->header->version = TT_VERSION;
+	t->header->nr_entries = t->table_mask + 1;
+}
+
+void tt_clear(struct tt *t)
+{
+	memset(t->table, 0, (t->table_mask + 1) * sizeof(struct tt_entry));
+}
+
+static int map_file(struct tt *t, const char *path)
+{
+	struct stat st;
+	void *ret;
+	int err;
+
+	t->map_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (t->map_fd == -1)
+		return -errno;
+
+	if (fstat(t->map_fd, &st) ||
+	    (st.st_size != (off_t)t->map_len && ftruncate(t->map_fd, t->map_len)))
+		goto err;
+
+	ret = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, t->map_fd, 0);
+	if (ret == MAP_FAILED)
+		goto err;
+
+	t->header = ret;
+	t->table = ret + TT_HEADER_SIZE;
+	return 0;
+
+err:
+	err = -errno;
+	close(t->map_fd);
+	t->map_fd = -1;
+	return err;
+}
+
+static int map_shm(struct tt *t, const char *name)
+{
+	struct tt_file_header *header;
+	unsigned int version;
+	struct stat st;
+	void *ret;
+	int fd, err, waited, created = 1;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1 && errno == EEXIST) {
+		fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+		created = 0;
+	}
+
+	if (fd == -1)
+		return -errno;
+
+	if (created) {
+		if (ftruncate(fd, t->map_len))
+			goto err;
+	} else {
+		/* Wait for the creator to size the segment */
+		for (waited = 0;; waited++) {
+			if (fstat(fd, &st))
+				goto err;
+
+			if (st.st_size >= (off_t)TT_HEADER_SIZE)
+				break;
+
+			if (waited == TT_SHM_TIMEOUT_MS) {
+				close(fd);
+				return -ETIMEDOUT;
+			}
+
+			usleep(1000);
+		}
+
+		t->map_len = st.st_size;
+	}
+
+	ret = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ret == MAP_FAILED)
+		goto err;
+
+	close(fd);
+
+	header = t->header = ret;
+	t->table = ret + TT_HEADER_SIZE;
+
+	if (created) {
+		init_header(t);
+		__atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	for (waited = 0; !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE); waited++) {
+		if (waited == TT_SHM_TIMEOUT_MS) {
+			munmap(header, t->map_len);
+			return -ETIMEDOUT;
+		}
+
+		usleep(1000);
+	}
+
+	version = header->version;
+	if (memcmp(header->magic, TT_MAGIC, sizeof(TT_MAGIC)) || version != TT_VERSION ||
+	    t->map_len != TT_HEADER_SIZE + header->nr_entries * sizeof(struct tt_entry)) {
+		munmap(header, t->map_len);
+		return -EINVAL;
+	}
+
+	t->table_mask = header->nr_entries - 1;
+	printf("Sharing %zuMB transposition table in %s\n",
+	       (t->map_len - TT_HEADER_SIZE) >> 20, name);
+	return 0;
+
+err:
+	err = -errno;
+	close(fd);
+	if (created)
+		shm_unlink(name);
+
+	return err;
+}
+
+static int __tt_init(struct tt *t, const char *path, const char *shm_name,
+		     unsigned long mbytes)
+{
+	unsigned long long nr_entries = 1;
+	void *ret;
+	int err;
+
+	if (!mbytes)
+		mbytes = TT_DEFAULT_MB;
+
+	while (nr_entries * 2 * sizeof(struct tt_entry) <= (mbytes << 20))
+		nr_entries *= 2;
+
+	t->map_fd = -1;
+	t->table_mask = nr_entries - 1;
+	t->map_len = TT_HEADER_SIZE + nr_entries * sizeof(struct tt_entry);
+
+	if (path && shm_name)
+		return -EINVAL;
+
+	if (shm_name)
+		return map_shm(t, shm_name);
+
+	if (!path) {
+		ret = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE,
+			   MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (ret == MAP_FAILED)
+			return -errno;
+
+		t->header = ret;
+		t->table = ret + TT_HEADER_SIZE;
+		return 0;
+	}
+
+	err = map_file(t, path);
+	if (err)
+		return err;
+
+	if (header_valid(t)) {
+		printf("Loaded transposition table from %s\n", path);
+		tt_new_search(t);
+	} else {
+		init_header(t);
+	}
+
+	t->header->clean = 0;
+	if (msync(t->header, TT_HEADER_SIZE, MS_SYNC))
+		fatal("Can't sync transposition table header: %m\n");
+
+	return 0;
+}
+
+/*
+ * Set up a table, @mbytes in size (or the default if zero). If @path is
+ * non-NULL, the table is backed by that file, and its contents are reused if
+ * they are valid. If @shm_name is non-NULL, the table is shared with other
+ * processes using a segment of that name. Returns 0 on success, or a negative
+ * error code.
+ */
+int tt_init(struct tt **ret, const char *path, const char *shm_name,
+	    unsigned long mbytes)
+{
+	struct tt *t = calloc(1, sizeof(*t));
+	int err;
+
+	if (!t)
+		return -ENOMEM;
+
+	err = __tt_init(t, path, shm_name, mbytes);
+	if (err) {
+		free(t);
+		return err;
+	}
+
+	*ret = t;
+	return 0;
+}
+
+/*
+ * Tear down a table. If it is file backed, checksum it and mark it clean so
+ * it can be reused by the next run. Shared segments are left alone.
+ */
+void tt_close(struct tt *t)
+{
+	struct tt_file_header *header = t->header;
+
+	if (t->map_fd != -1) {
+		/* Make sure the entries hit the disk before we claim they did */
+		if (msync(header, t->map_len, MS_SYNC))
+			fatal("Can't sync transposition table: %m\n");
+
+		header->checksum = checksum_table(t);
+		header->clean = 1;
+		if (msync(header, TT_HEADER_SIZE, MS_SYNC))
+			fatal("Can't sync transposition table header: %m\n");
+
+		close(t->map_fd);
+	}
+
+	munmap(header, t->map_len);
+	free(t);
+}
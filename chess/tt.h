@@ -0,0 +1,29 @@
+#pragma once
+
+#include "list.h"
+
+enum tt_bound {
+	TT_NONE		= 0,
+	TT_UPPER	= 1,
+	TT_LOWER	= 2,
+	TT_EXACT	= 3,
+};
+
+struct tt_hit {
+	int score;
+	int depth;
+	enum tt_bound bound;
+	struct move m;
+};
+
+struct tt;
+
+extern int tt_init(struct tt **ret, const char *path, const char *shm_name,
+		   unsigned long mbytes);
+extern void tt_close(struct tt *t);
+extern void tt_clear(struct tt *t);
+extern void tt_new_search(struct tt *t);
+
+extern int tt_probe(struct tt *t, unsigned long long key, struct tt_hit *hit);
+extern void tt_store(struct tt *t, unsigned long long key, int depth, int score,
+		     enum tt_bound bound, struct move m);
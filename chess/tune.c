@@ -0,0 +1,438 @@
+/*
+ * chess-tune: Fit the evaluation parameters to labelled positions
+ * Copyright (C) 2013 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "board.h"
+#include "eval-params.h"
+
+/*
+ * TEXEL TUNING
+ *
+ * Given positions labelled with the result of the game they came from, find
+ * the evaluation parameters which minimize
+ *
+ *	E = 1/N * sum((result - sigmoid(eval))^2)
+ *
+ * where sigmoid(s) = 1 / (1 + 10^(-K * s / 400)), and the result is 1, 0.5 or
+ * 0 for a white win, draw, or black win. K is fitted to the starting
+ * parameters first, and then held fixed.
+ *
+ * The evaluation is linear in its parameters: it's the dot product of the
+ * parameters with a feature vector, which for the piece values is the number
+ * of pieces of each type white has minus the number black has. So the
+ * gradient of E is cheap to compute exactly, and the parameters are fitted
+ * by gradient descent (Adam, which copes with the parameters' very different
+ * scales).
+ *
+ * The input is one position per line: a FEN (only the placement field is
+ * used), followed somewhere on the line by the result as "1-0", "0-1" or
+ * "1/2-1/2" (e.g. EPD's c9 opcode), or as "[1.0]", "[0.5]" or "[0.0]".
+ * Lines without a result are skipped.
+ *
+ * The file is mapped rather than read, and every pass over it parses the
+ * positions again: that costs some time, but it means memory use doesn't
+ * grow with the number of positions. Each thread parses its own contiguous
+ * slice of the file, accumulating its own error and gradient, which are
+ * summed once all the threads are done.
+ */
+
+#define NR_PARAMS 8
+#define DEFAULT_ITERATIONS 100
+#define DEFAULT_RATE 1.0
+
+/* The king is always there, so its value can't be fitted */
+static const int tunable[NR_PARAMS] = {
+	[PAWN] = 1, [ROOK] = 1, [KNIGHT] = 1, [BISHOP] = 1, [QUEEN] = 1,
+};
+
+struct tune_thread {
+	pthread_t thread;
+	const char *start;
+	const char *end;
+	int want_grad;
+
+	double error;
+	double grad[NR_PARAMS];
+	unsigned long nr_positions;
+	unsigned long nr_skipped;
+} __attribute__((aligned(64)));
+
+static double params[NR_PARAMS];
+static double K;
+
+static int piece_type(char c)
+{
+	switch (c | 0x20) {
+	case 'p':	return PAWN;
+	case 'r':	return ROOK;
+	case 'n':	return KNIGHT;
+	case 'b':	return BISHOP;
+	case 'q':	return QUEEN;
+	case 'k':	return KING;
+	default:	return EMPTY;
+	}
+}
+
+/*
+ * Parse the line [@p,@end) into @features and @result. Returns 0 on success,
+ * or -EINVAL if the line isn't a labelled position.
+ */
+static int parse_position(const char *p, const char *end, int *features,
+			  double *result)
+{
+	const char *r;
+	int x = 0, y = 7, type;
+
+	memset(features, 0, NR_PARAMS * sizeof(*features));
+
+	for (; p < end && *p != ' '; p++) {
+		if (*p == '/') {
+			if (x != 8 || --y < 0)
+				return -EINVAL;
+
+			x = 0;
+		} else if (*p >= '1' && *p <= '8') {
+			x += *p - '0';
+		} else {
+			type = piece_type(*p);
+			if (type == EMPTY || x > 7)
+				return -EINVAL;
+
+			/* Upper case is white */
+			features[type] += *p & 0x20 ? -1 : 1;
+			x++;
+		}
+	}
+
+	if (x != 8 || y != 0)
+		return -EINVAL;
+
+	r = memchr(p, '[', end - p);
+	if (r) {
+		*result = strtod(r + 1, NULL);
+		return 0;
+	}
+
+	if (memmem(p, end - p, "1/2", 3))
+		*result = 0.5;
+	else if (memmem(p, end - p, "1-0", 3))
+		*result = 1.0;
+	else if (memmem(p, end - p, "0-1", 3))
+		*result = 0.0;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static double sigmoid(double s)
+{
+	return 1.0 / (1.0 + exp(-K * s * M_LN10 / 400.0));
+}
+
+static void *tune_thread(void *arg)
+{
+	struct tune_thread *t = arg;
+	const char *p = t->start, *eol;
+	int i, features[NR_PARAMS];
+	double result, s, e, d;
+
+	t->error = 0;
+	t->nr_positions = t->nr_skipped = 0;
+	memset(t->grad, 0, sizeof(t->grad));
+
+	for (; p < t->end; p = eol + 1) {
+		eol = memchr(p, '\n', t->end - p);
+		if (!eol)
+			eol = t->end;
+
+		if (parse_position(p, eol, features, &result)) {
+			t->nr_skipped++;
+			continue;
+		}
+
+		for (i = 0, s = 0; i < NR_PARAMS; i++)
+			s += params[i] * features[i];
+
+		s = sigmoid(s);
+		e = result - s;
+		t->error += e * e;
+		t->nr_positions++;
+
+		if (!t->want_grad)
+			continue;
+
+		d = -2.0 * e * s * (1.0 - s) * K * M_LN10 / 400.0;
+		for (i = 0; i < NR_PARAMS; i++)
+			t->grad[i] += d * features[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Make one pass over the positions, returning the mean squared error, and the
+ * gradient in @grad if it isn't NULL.
+ */
+static double evaluate_all(struct tune_thread *threads, int nr_threads,
+			   double *grad, unsigned long *nr_positions,
+			   unsigned long *nr_skipped)
+{
+	unsigned long n = 0, skipped = 0;
+	double error = 0;
+	int i, k;
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].want_grad = !!grad;
+		if (i && pthread_create(&threads[i].thread, NULL, tune_thread, &threads[i]))
+			fatal("Can't create tuning thread\n");
+	}
+
+	tune_thread(&threads[0]);
+
+	if (grad)
+		memset(grad, 0, NR_PARAMS * sizeof(*grad));
+
+	for (i = 0; i < nr_threads; i++) {
+		if (i)
+			pthread_join(threads[i].thread, NULL);
+
+		error += threads[i].error;
+		n += threads[i].nr_positions;
+		skipped += threads[i].nr_skipped;
+
+		for (k = 0; grad && k < NR_PARAMS; k++)
+			grad[k] += threads[i].grad[k];
+	}
+
+	if (!n)
+		fatal("No labelled positions\n");
+
+	for (k = 0; grad && k < NR_PARAMS; k++)
+		grad[k] /= n;
+
+	if (nr_positions)
+		*nr_positions = n;
+	if (nr_skipped)
+		*nr_skipped = skipped;
+
+	return error / n;
+}
+
+/*
+ * The error is unimodal in K, so a golden section search finds it.
+ */
+static double fit_K(struct tune_thread *threads, int nr_threads)
+{
+	const double phi = (sqrt(5.0) - 1.0) / 2.0;
+	double lo = 0.01, hi = 100.0, a, b, ea, eb;
+	int i;
+
+	a = hi - phi * (hi - lo);
+	b = lo + phi * (hi - lo);
+	K = a;
+	ea = evaluate_all(threads, nr_threads, NULL, NULL, NULL);
+	K = b;
+	eb = evaluate_all(threads, nr_threads, NULL, NULL, NULL);
+
+	for (i = 0; i < 30; i++) {
+		if (ea < eb) {
+			hi = b;
+			b = a;
+			eb = ea;
+			a = hi - phi * (hi - lo);
+			K = a;
+			ea = evaluate_all(threads, nr_threads, NULL, NULL, NULL);
+		} else {
+			lo = a;
+			a = b;
+			ea = eb;
+			b = lo + phi * (hi - lo);
+			K = b;
+			eb = evaluate_all(threads, nr_threads, NULL, NULL, NULL);
+		}
+	}
+
+	return (lo + hi) / 2;
+}
+
+static void write_header(const char *path, unsigned long n, double error)
+{
+	FILE *f = path ? fopen(path, "w") : stdout;
+	int i;
+
+	if (!f)
+		fatal("Can't open %s: %m\n", path);
+
+	fprintf(f, "/*\n");
+	fprintf(f, " * Evaluation parameters, indexed by enum piece_type.\n");
+	fprintf(f, " *\n");
+	fprintf(f, " * chess-tune regenerates this file from a set of labelled positions.\n");
+	fprintf(f, " * These were fitted to %lu positions (K = %.4f, error %.6f).\n", n, K, error);
+	fprintf(f, " */\n");
+	fprintf(f, "#pragma once\n\n");
+	fprintf(f, "static const int piece_values[8] = {");
+
+	for (i = 0; i < NR_PARAMS; i++)
+		fprintf(f, "%s%d", i ? ", " : "", (int)lround(params[i]));
+
+	fprintf(f, "};\n");
+
+	if (path && fclose(f))
+		fatal("Can't write %s: %m\n", path);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-j threads] [-i iterations] [-r rate] [-K k] [-o header] positions\n", name);
+	printf("\t-j: Number of threads (default: one per CPU)\n");
+	printf("\t-i: Number of gradient descent iterations\n");
+	printf("\t-r: Learning rate, in piece value units per iteration\n");
+	printf("\t-K: Use this sigmoid scale, rather than fitting it\n");
+	printf("\t-o: Write the tuned eval-params.h here (default: stdout)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const double beta1 = 0.9, beta2 = 0.999, eps = 1e-8;
+	double grad[NR_PARAMS], m[NR_PARAMS] = {0}, v[NR_PARAMS] = {0};
+	double rate = DEFAULT_RATE, error, start_error;
+	int tmp, i, k, fd, nr_threads = 0, iterations = DEFAULT_ITERATIONS;
+	unsigned long nr_positions, nr_skipped;
+	struct tune_thread *threads;
+	const char *out = NULL, *map;
+	struct stat st;
+	size_t off;
+
+	while ((tmp = getopt(argc, argv, "j:i:r:K:o:h")) != -1) {
+		switch (tmp) {
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'K':
+			K = strtod(optarg, NULL);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return tmp == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (nr_threads < 1)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		fatal("Can't open %s: %m\n", argv[optind]);
+
+	if (fstat(fd, &st))
+		fatal("Can't stat %s: %m\n", argv[optind]);
+
+	if (!st.st_size)
+		fatal("%s is empty\n", argv[optind]);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		fatal("Can't map %s: %m\n", argv[optind]);
+
+	close(fd);
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	threads = aligned_alloc(64, nr_threads * sizeof(*threads));
+	if (!threads)
+		fatal("Can't allocate threads\n");
+
+	/* Split the file into slices which start at the beginning of a line */
+	memset(threads, 0, nr_threads * sizeof(*threads));
+	for (i = 0; i < nr_threads; i++) {
+		off = st.st_size * i / nr_threads;
+		while (off && off < (size_t)st.st_size && map[off - 1] != '\n')
+			off++;
+
+		threads[i].start = map + off;
+		if (i)
+			threads[i - 1].end = threads[i].start;
+	}
+	threads[nr_threads - 1].end = map + st.st_size;
+
+	for (k = 0; k < NR_PARAMS; k++)
+		params[k] = piece_values[k];
+
+	if (!K)
+		K = fit_K(threads, nr_threads);
+
+	start_error = evaluate_all(threads, nr_threads, NULL, &nr_positions, &nr_skipped);
+	printf("%lu positions (%lu lines skipped), K = %.4f, error %.6f\n",
+	       nr_positions, nr_skipped, K, start_error);
+
+	for (i = 1; i <= iterations; i++) {
+		error = evaluate_all(threads, nr_threads, grad, NULL, NULL);
+
+		for (k = 0; k < NR_PARAMS; k++) {
+			if (!tunable[k])
+				continue;
+
+			m[k] = beta1 * m[k] + (1 - beta1) * grad[k];
+			v[k] = beta2 * v[k] + (1 - beta2) * grad[k] * grad[k];
+			params[k] -= rate * (m[k] / (1 - pow(beta1, i))) /
+				     (sqrt(v[k] / (1 - pow(beta2, i))) + eps);
+
+			/* The batched evaluation needs them to be positive */
+			if (params[k] < 0)
+				params[k] = 0;
+		}
+
+		if (i % 10 == 0 || i == iterations)
+			printf("Iteration %d: error %.6f\n", i, error);
+	}
+
+	/* Report the error for the parameters as they'll be written, rounded */
+	for (k = 0; k < NR_PARAMS; k++)
+		params[k] = lround(params[k]);
+
+	error = evaluate_all(threads, nr_threads, NULL, NULL, NULL);
+	printf("Final error %.6f (was %.6f)\n", error, start_error);
+
+	write_header(out, nr_positions, error);
+
+	free(threads);
+	munmap((void *)map, st.st_size);
+	return 0;
+}